@@ -7,41 +7,62 @@
 #include "./simulator/simulator.h"
 #include "./simulator/utils.h"
 #include "./simulator/cache.h"
+#include "./simulator/interpreter.h"
+#include "./simulator/blocks.h"
+#include "./simulator/jit.h"
+#include "./simulator/aot.h"
+#include "./simulator/trace.h"
+#include "./simulator/image.h"
+#include "./simulator/cache_log.h"
 
 _Bool cache_enabled = false;
 cache_struct* cache = NULL;
-FILE* cache_output_file = NULL;
+_Bool icache_enabled = false;
+cache_struct* icache = NULL;
 
 
 label* label_array = NULL;  // array to store the labels
 int label_count = 0;        // number of labels in the input file
-int error_code = 0;         // specifies the error, if any. Value 0 is no error
+_Thread_local int error_code = 0;         // specifies the error, if any. Value 0 is no error
 
-int text_line_num = 1;      // points to the current instruction being executed. Doesn't include line with .text section. Ignores blank lines/lines with just labels/comment lines. Special ability: can make you cry. 
-size_t file_line_num = 1;   // equals the absolute line number of the line being parsed in the input file
+_Thread_local int text_line_num = 1;      // points to the current instruction being executed. Doesn't include line with .text section. Ignores blank lines/lines with just labels/comment lines. Special ability: can make you cry. 
+_Thread_local size_t file_line_num = 1;   // equals the absolute line number of the line being parsed in the input file
 
 uint32_t pc = 0;  // program counter, points to the memory location of current instruction. Is updated in each step.
 
-instruction_line instructions_array[1000] = {}; // holds the instruction strings to help in printing on command line when step/run is used
+instruction_line* instructions_array = NULL;  // line number and text of each instruction, for printing on command line when step/run is used
+char* source_text = NULL;                     // the loaded file, instruction texts point into it
+size_t source_text_size = 0;
 size_t max_instructions = 0;            // total no of instructions in the current file
 size_t current_instruction = 1;         // points to the current instruction being executed
 
 char* current_file_name = NULL;
-// Global input file
-FILE* input_file = NULL;
 
 // Register array
 int64_t registers[32];
 
-memory_node* memory_table[MEMORY_TABLE_SIZE];
-
-stack_node* main_node = NULL;
 _Bool debug_flag = false;
 _Bool file_load_success = false;        // if this flag is false, step/run/break won't work. It is set to true if file loading was successfull. Changes value on every file load.
 _Bool break_line_found = false;         // if this flag is true, run will stop;
+_Bool jit_enabled = true;               // compile hot blocks to native code when nothing needs per-instruction control
+size_t max_run_instructions = 0;       // default instruction budget of run, 0 for none
+double run_time_limit = 0;              // host seconds a run may take, 0 for no limit
+#define MAX_LOAD_FILES 256
+
 _Bool execute_command(char*);
+int run_compiled(char** file_names, int file_count);
+int run_assembled(char** arguments, int argument_count);
+
+int main(int argc, char** argv) {
+    if (argc >= 3 && strcmp(argv[1], "--compile") == 0) {
+        return run_compiled(argv + 2, argc - 2);
+    } else if (argc >= 3 && strcmp(argv[1], "--assemble") == 0) {
+        return run_assembled(argv + 2, argc - 2);
+    } else if (argc != 1) {
+        printf("Usage: %s [--compile <file.s> ... | --assemble <file.s> ... [-o <image.gimg>]]\n", argv[0]);
+        return 1;
+    }
 
-int main() {
     // clear_screen();
     //blue_underlined("RISC-V Simulator\n");
     //printf("For viewing the table of commands, their aliases and their function, type \"help\" or \"h\"\n\n");
@@ -69,6 +90,91 @@ int main() {
     return 0;
 }
 
+// Load the files with the load command, false if they can't be
+static bool load_from_arguments(char** file_names, int file_count) {
+    char command[4096];
+    size_t length = snprintf(command, sizeof(command), "load");
+    for (int i = 0; i < file_count && length < sizeof(command); i++) {
+        length += snprintf(command + length, sizeof(command) - length, " %s", file_names[i]);
+    }
+    if (length >= sizeof(command)) {
+        red("Too many files to load.\n");
+        return false;
+    }
+    execute_command(command);
+    return file_load_success;
+}
+
+// Batch mode: assemble and link the files, compile the program ahead of time and run it to the
+// end without tracing, then print the registers. Goes through the same commands as the
+// interactive mode.
+int run_compiled(char** file_names, int file_count) {
+    char command[4096];
+
+    strcpy(command, "set trace off");
+    execute_command(command);
+    if (!load_from_arguments(file_names, file_count)) {
+        return 1;
+    }
+    strcpy(command, "compile");
+    execute_command(command);
+    if (!aot_loaded()) {
+        return 1;
+    }
+
+    strcpy(command, "run");
+    execute_command(command);
+    strcpy(command, "regs");
+    execute_command(command);
+
+    _Bool finished = current_instruction > max_instructions;
+    free_instructions_array();
+    return finished ? 0 : 1;
+}
+
+// Batch mode: assemble and link the files, which caches their image next to the first one for
+// later loads, and with -o also write it where given
+int run_assembled(char** arguments, int argument_count) {
+    char* file_names[MAX_LOAD_FILES];
+    int file_count = 0;
+    char* image_name = NULL;
+    for (int i = 0; i < argument_count; i++) {
+        if (strcmp(arguments[i], "-o") == 0 && i + 1 < argument_count) {
+            image_name = arguments[++i];
+        } else if (file_count == MAX_LOAD_FILES) {
+            red("At most %d files can be loaded together.\n", MAX_LOAD_FILES);
+            return 1;
+        } else {
+            file_names[file_count++] = arguments[i];
+        }
+    }
+    if (file_count == 0) {
+        red("Error: Missing file name after '--assemble'.\n");
+        return 1;
+    }
+
+    _Bool written = load_from_arguments(file_names, file_count);
+    if (written && image_name != NULL && !write_image(image_name)) {
+        red("Cannot write \"%s\".\n", image_name);
+        written = false;
+    }
+    free_instructions_array();
+    return written ? 0 : 1;
+}
+
+// Split "file.s:line" into the file name, returned, and the line, left in *location.
+// NULL for a plain line number, which refers to the first file.
+static char* split_break_location(char** location) {
+    char* colon = strrchr(*location, ':');
+    if (colon == NULL) {
+        return NULL;
+    }
+    *colon = '\0';
+    char* file_name = *location;
+    *location = colon + 1;
+    return file_name;
+}
+
 _Bool execute_command(char* command) {
     char* token = NULL;
     remove_extra_spaces(command, 0);
@@ -93,15 +199,25 @@ _Bool execute_command(char* command) {
         max_instructions = 0;   // new file, new max
         current_instruction = 1;   // start from the beginning
         pc = 0;
-        token = strtok(NULL, "\n");
-        if(token == NULL) {
+        // load a.s b.s ...: the files are linked into one program that starts at the first
+        char* file_names[MAX_LOAD_FILES];
+        size_t file_count = 0;
+        while(file_count < MAX_LOAD_FILES && (token = strtok(NULL, " \n")) != NULL) {
+            file_names[file_count++] = token;
+        }
+        if(file_count == 0) {
             red("No file specified.\n\n");
             file_load_success = false;
             return 0;
         }
-        current_file_name = malloc(sizeof(char) * strlen(token));
-        strcpy(current_file_name, token);
-        file_load_success = load_file(token);
+        if(strtok(NULL, " \n") != NULL) {
+            red("At most %d files can be loaded together.\n", MAX_LOAD_FILES);
+            file_load_success = false;
+            return 0;
+        }
+        free(current_file_name);
+        current_file_name = strdup(file_names[0]);
+        file_load_success = load_file(file_names, file_count);
 
     } else if (strcmp(token, "mem") == 0) {
 
@@ -111,6 +227,16 @@ _Bool execute_command(char* command) {
             return 0;
         }
 
+        if (strcmp(token, "stats") == 0) {
+            char* residue = strtok(NULL, "\0");
+            if (residue != NULL) {
+                red("Did you mean 'mem stats'?\n");
+            } else {
+                display_memory_stats();
+            }
+            return 0;
+        }
+
         uint64_t start_address = strtoll(token, NULL, 0);
         token = strtok(NULL, " ");
         if (token == NULL) {
@@ -143,29 +269,48 @@ _Bool execute_command(char* command) {
         }
 
     } else if (strcmp(token, "run") == 0) {
-        char* residue = strtok(NULL, "\0");
-        if(residue != NULL) {
-            red("Did you mean 'run'?\n");
+        _Bool quiet = false;
+        _Bool valid = true;
+        size_t budget = max_run_instructions;
+        while((token = strtok(NULL, " ")) != NULL) {
+            char* end = NULL;
+            if(strcmp(token, "--quiet") == 0) {
+                quiet = true;
+            } else if(token[0] >= '0' && token[0] <= '9' && (budget = strtoull(token, &end, 0)) > 0 && *end == '\0') {
+                // instruction budget for this run
+            } else {
+                valid = false;
+            }
+        }
+
+        if(!valid) {
+            red("Usage: run [instructions] [--quiet]\n");
         } else if(!file_load_success) {
             printf("Nothing loaded. \n");
         } else if (current_instruction > max_instructions) {
             printf("Reached end of program. Load the file again to re-run.\n");
         } else {
-            long int i = 0;
-            while(current_instruction <= max_instructions && residue == NULL) {
-                step();
-                i++;
-                if(break_line_found) {
-                    break;
-                }
+            trace_level verbosity = trace_verbosity;
+            if(quiet) {
+                trace_verbosity = TRACE_SILENT;
+            }
 
-                if( i > 1000000) {
-                    printf("Timeout! Enter run again.");
-                    break;
-                }
+            run_result result = run_program(budget, run_time_limit);
+            trace_flush();
+
+            if(result.stop == RUN_BUDGET) {
+                printf("Stopped after %zu instructions (instruction limit). Enter run again to continue.\n", result.executed);
+            } else if(result.stop == RUN_TIME_LIMIT) {
+                printf("Stopped after %.3f s (time limit). Enter run again to continue.\n", result.elapsed);
+            } else if(result.stop == RUN_INTERRUPTED) {
+                printf("Interrupted. Enter run again to continue.\n");
+            }
+            if(trace_verbosity >= TRACE_SUMMARY) {
+                report_run_speed(result.executed, result.elapsed, run_engine_name());
             }
+            trace_verbosity = verbosity;
 
-            if(cache_enabled) {
+            if(cache_enabled || icache_enabled) {
                 output_cache_stats();
                 if(current_instruction > max_instructions) {
                     dump_cache_content("program_end_dump.text");
@@ -173,6 +318,75 @@ _Bool execute_command(char* command) {
             }
         }
 
+    } else if (strcmp(token, "reset") == 0) {
+        char* residue = strtok(NULL, "\0");
+        if(residue != NULL) {
+            red("Did you mean 'reset'?\n");
+        } else if(!file_load_success) {
+            printf("Nothing loaded. \n");
+        } else {
+            restore_snapshot();
+        }
+
+    } else if (strcmp(token, "compile") == 0) {
+        char* residue = strtok(NULL, "\0");
+        if(residue != NULL) {
+            red("Did you mean 'compile'?\n");
+        } else if(!file_load_success) {
+            printf("Nothing loaded. \n");
+        } else {
+            compile_program(current_file_name);
+        }
+
+    } else if (strcmp(token, "set") == 0) {
+        char* option = strtok(NULL, " ");
+        char* value = strtok(NULL, " ");
+        char* residue = strtok(NULL, "\0");
+        if(option == NULL || value == NULL || residue != NULL) {
+            red("Usage: set trace <off|summary|on>, set trace-file <file|->, set max-instructions <count>, set time-limit <seconds>, set jit <on|off>\n");
+        } else if(strcmp(option, "trace") == 0) {
+            if(strcmp(value, "off") == 0) {
+                trace_verbosity = TRACE_SILENT;
+            } else if(strcmp(value, "summary") == 0) {
+                trace_verbosity = TRACE_SUMMARY;
+            } else if(strcmp(value, "on") == 0) {
+                trace_verbosity = TRACE_INSTRUCTIONS;
+            } else {
+                red("Expected 'off', 'summary' or 'on'.\n");
+            }
+        } else if(strcmp(option, "trace-file") == 0) {
+            if(set_trace_file(value)) {
+                printf("Tracing to %s\n", trace_file_name());
+            }
+        } else if(strcmp(option, "max-instructions") == 0) {
+            char* end = NULL;
+            unsigned long long count = strtoull(value, &end, 0);
+            if(value[0] < '0' || value[0] > '9' || *end != '\0') {
+                red("Expected an instruction count (0 for no limit).\n");
+            } else {
+                max_run_instructions = count;
+            }
+        } else if(strcmp(option, "time-limit") == 0) {
+            char* end = NULL;
+            double seconds = strtod(value, &end);
+            if(*end != '\0' || !(seconds >= 0)) {
+                red("Expected a number of seconds (0 for no limit).\n");
+            } else {
+                run_time_limit = seconds;
+            }
+        } else if(strcmp(option, "jit") == 0) {
+            if(strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+                red("Expected 'on' or 'off'.\n");
+            } else {
+                jit_enabled = (strcmp(value, "on") == 0);
+                if(jit_enabled && !JIT_AVAILABLE) {
+                    yellow("No JIT for this host, run keeps using the block cache.\n");
+                }
+            }
+        } else {
+            red("Unknown option \"%s\".\n", option);
+        }
+
     } else if (strcmp(token, "break") == 0) {
         if(!file_load_success) {
             printf("Nothing loaded. \n");
@@ -186,11 +400,13 @@ _Bool execute_command(char* command) {
             if(token == NULL) {
                 red("Specify a line number.\n");
             } else {
+                // file.s:line for a file other than the first
+                char* file_name = split_break_location(&token);
                 break_line = strtol(token, &residue, 0);
                 if(strcmp(residue, "") != 0) {
                     red("Not a line number.\n", residue);
                 } else {
-                    insert_break(break_line);
+                    insert_break(file_name, break_line);
                 }
             }
         }
@@ -215,6 +431,7 @@ _Bool execute_command(char* command) {
                 if(token == NULL) {
                     red("Specify a line number.\n");
                 } else {
+                    char* file_name = split_break_location(&token);
                     break_line = strtol(token, &residue, 0);
                     if(strcmp(residue, "") != 0) {
                         red("Not a line number.\n", residue);
@@ -222,7 +439,7 @@ _Bool execute_command(char* command) {
                         if(!file_load_success) {
                             printf("Nothing loaded. \n");
                         } else {
-                            delete_break(break_line);
+                            delete_break(file_name, break_line);
                         }
                     }
                 }
@@ -301,6 +518,38 @@ _Bool execute_command(char* command) {
                 red("Not a valid command.\n");
             }
 
+        //7. cache_sim enable-icache config_file
+        } else if(strcmp(cache_command, "enable-icache") == 0) {
+            char* file_name = strtok(NULL, "\0");
+            if(file_name) {
+                enable_icache(file_name);
+            } else {
+                red("No config file provided.\n");
+            }
+
+        //8. cache_sim disable-icache
+        } else if(strcmp(cache_command, "disable-icache") == 0) {
+            char* residue = strtok(NULL, "\0");
+            if(!residue) {
+                disable_icache();
+            } else {
+                red("Not a valid command.\n");
+            }
+
+        //9. cache_sim log on, cache_sim log off, cache_sim log text [log_file]
+        } else if(strcmp(cache_command, "log") == 0) {
+            char* log_command = strtok(NULL, " ");
+            char* residue = strtok(NULL, "\0");
+            if(log_command != NULL && strcmp(log_command, "on") == 0 && !residue) {
+                set_cache_logging(true);
+            } else if(log_command != NULL && strcmp(log_command, "off") == 0 && !residue) {
+                set_cache_logging(false);
+            } else if(log_command != NULL && strcmp(log_command, "text") == 0) {
+                write_cache_log_text(residue);
+            } else {
+                red("Usage: cache_sim log <on|off>, cache_sim log text [log file]\n");
+            }
+
         } else {
             red("Unknown command.\n");
         }
@@ -309,6 +558,8 @@ _Bool execute_command(char* command) {
         red("Unknown command \"%s\".\n", token);
     }
 
+    trace_flush();
+    cache_log_flush();
     printf("\n");
     return 0;
 }
@@ -0,0 +1,416 @@
+#define _DEFAULT_SOURCE     // posix_spawnp
+#include "aot.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "decode.h"
+#include "linker.h"
+#include "native.h"
+#include "simulator.h"
+#include "utils.h"
+
+static void* aot_library = NULL;
+static native_block const* aot_blocks = NULL;       // indexed by pc / 4, NULL where no block starts
+static const uint16_t* aot_block_lengths = NULL;
+static size_t aot_count = 0;
+static uint64_t aot_hash = 0;
+
+static uint64_t checked_generation = UINT64_MAX;    // text_generation the hash was last compared at
+static bool text_matches = false;
+
+// Must match native_runtime in native.h field for field
+static const char* runtime_declaration =
+    "typedef struct native_runtime {\n"
+    "    uint64_t (*load_byte)(uint64_t);\n"
+    "    uint64_t (*load_half)(uint64_t);\n"
+    "    uint64_t (*load_word)(uint64_t);\n"
+    "    uint64_t (*load_dword)(uint64_t);\n"
+    "    uint64_t (*load_byte_unsigned)(uint64_t);\n"
+    "    uint64_t (*load_half_unsigned)(uint64_t);\n"
+    "    uint64_t (*load_word_unsigned)(uint64_t);\n"
+    "    uint64_t (*store_byte)(uint64_t, uint64_t);\n"
+    "    uint64_t (*store_half)(uint64_t, uint64_t);\n"
+    "    uint64_t (*store_word)(uint64_t, uint64_t);\n"
+    "    uint64_t (*store_dword)(uint64_t, uint64_t);\n"
+    "} native_runtime;\n";
+
+// FNV-1a over the text segment as it is in guest memory now
+static uint64_t hash_text() {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < decoded_count; i++) {
+        hash ^= read_memory_word(i * 4);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool ends_block(uint8_t op) {
+    return (op >= OP_BEQ && op <= OP_BGEU) || op == OP_JAL || op == OP_JALR;
+}
+
+static bool is_branch(uint8_t op) {
+    return op >= OP_BEQ && op <= OP_BGEU;
+}
+
+// Register operand as a C expression
+static const char* operand(uint8_t reg) {
+    static char buffers[2][16];
+    static int next = 0;
+    if (reg == 0) {
+        return "0";
+    }
+    char* buffer = buffers[next];
+    next ^= 1;
+    snprintf(buffer, sizeof(buffers[0]), "x[%u]", reg);
+    return buffer;
+}
+
+static void write_exit(FILE* out, size_t length, size_t retired, uint32_t next_pc) {
+    fprintf(out, "return ((iterations * %zuu + %zuu) << 32) | 0x%08" PRIX32 "u;", length, retired, next_pc);
+}
+
+static void write_instruction(FILE* out, const decoded_instruction* d, size_t index, uint32_t start_pc, size_t length) {
+    const char* a = operand(d->rs1);
+    const char* b = operand(d->rs2);
+    int64_t imm = d->imm;
+
+    static const char* const loads[] = {
+        [OP_LB] = "load_byte", [OP_LH] = "load_half", [OP_LW] = "load_word", [OP_LD] = "load_dword",
+        [OP_LBU] = "load_byte_unsigned", [OP_LHU] = "load_half_unsigned", [OP_LWU] = "load_word_unsigned",
+    };
+    static const char* const stores[] = {
+        [OP_SB] = "store_byte", [OP_SH] = "store_half", [OP_SW] = "store_word", [OP_SD] = "store_dword",
+    };
+
+    fprintf(out, "    ");
+    switch (d->op) {
+        case OP_NOP:
+            fprintf(out, ";");
+            break;
+        case OP_ADD:  fprintf(out, "x[%u] = (int64_t)((uint64_t)%s + (uint64_t)%s);", d->rd, a, b); break;
+        case OP_SUB:  fprintf(out, "x[%u] = (int64_t)((uint64_t)%s - (uint64_t)%s);", d->rd, a, b); break;
+        case OP_XOR:  fprintf(out, "x[%u] = (int64_t)%s ^ (int64_t)%s;", d->rd, a, b); break;
+        case OP_OR:   fprintf(out, "x[%u] = (int64_t)%s | (int64_t)%s;", d->rd, a, b); break;
+        case OP_AND:  fprintf(out, "x[%u] = (int64_t)%s & (int64_t)%s;", d->rd, a, b); break;
+        case OP_SLL:  fprintf(out, "x[%u] = (int64_t)((uint64_t)%s << (%s & 0x3F));", d->rd, a, b); break;
+        case OP_SRL:  fprintf(out, "x[%u] = (int64_t)((uint64_t)%s >> (%s & 0x3F));", d->rd, a, b); break;
+        case OP_SRA:  fprintf(out, "x[%u] = (int64_t)%s >> (%s & 0x3F);", d->rd, a, b); break;
+        case OP_SLT:  fprintf(out, "x[%u] = (int64_t)%s < (int64_t)%s;", d->rd, a, b); break;
+        case OP_SLTU: fprintf(out, "x[%u] = (uint64_t)%s < (uint64_t)%s;", d->rd, a, b); break;
+        case OP_ADDI: fprintf(out, "x[%u] = (int64_t)((uint64_t)%s + (uint64_t)%" PRId64 "LL);", d->rd, a, imm); break;
+        case OP_XORI: fprintf(out, "x[%u] = (int64_t)%s ^ %" PRId64 "LL;", d->rd, a, imm); break;
+        case OP_ORI:  fprintf(out, "x[%u] = (int64_t)%s | %" PRId64 "LL;", d->rd, a, imm); break;
+        case OP_ANDI: fprintf(out, "x[%u] = (int64_t)%s & %" PRId64 "LL;", d->rd, a, imm); break;
+        case OP_SLLI: fprintf(out, "x[%u] = (int64_t)((uint64_t)%s << %" PRId64 ");", d->rd, a, imm); break;
+        case OP_SRLI: fprintf(out, "x[%u] = (int64_t)((uint64_t)%s >> %" PRId64 ");", d->rd, a, imm); break;
+        case OP_SRAI: fprintf(out, "x[%u] = (int64_t)%s >> %" PRId64 ";", d->rd, a, imm); break;
+        case OP_LUI:  fprintf(out, "x[%u] = %" PRId64 "LL;", d->rd, imm); break;
+
+        case OP_LB: case OP_LH: case OP_LW: case OP_LD: case OP_LBU: case OP_LHU: case OP_LWU:
+            // a load into x0 is still made, the cache model counts it
+            if (d->rd != 0) {
+                fprintf(out, "x[%u] = (int64_t)rt->%s((uint64_t)%s + (uint64_t)%" PRId64 "LL);", d->rd, loads[d->op], a, imm);
+            } else {
+                fprintf(out, "(void)rt->%s((uint64_t)%s + (uint64_t)%" PRId64 "LL);", loads[d->op], a, imm);
+            }
+            break;
+
+        case OP_SB: case OP_SH: case OP_SW: case OP_SD:
+            fprintf(out, "if (rt->%s((uint64_t)%s + (uint64_t)%" PRId64 "LL, (uint64_t)%s)) ", stores[d->op], a, imm, b);
+            write_exit(out, length, index + 1, start_pc + (index + 1) * 4);
+            break;
+
+        case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU: {
+            static const char* const conditions[] = {
+                [OP_BEQ] = "(int64_t)%s == (int64_t)%s", [OP_BNE] = "(int64_t)%s != (int64_t)%s",
+                [OP_BLT] = "(int64_t)%s < (int64_t)%s", [OP_BGE] = "(int64_t)%s >= (int64_t)%s",
+                [OP_BLTU] = "(uint64_t)%s < (uint64_t)%s", [OP_BGEU] = "(uint64_t)%s >= (uint64_t)%s",
+            };
+            fprintf(out, "if (");
+            fprintf(out, conditions[d->op], a, b);
+            fprintf(out, ") {\n        ");
+            if (d->target == start_pc) {
+                fprintf(out, "if (++iterations < max_iterations) goto top;\n        ");
+                write_exit(out, length, 0, start_pc);
+            } else {
+                write_exit(out, length, length, d->target);
+            }
+            fprintf(out, "\n    }\n    ");
+            write_exit(out, length, length, start_pc + length * 4);
+            break;
+        }
+    }
+    fprintf(out, "\n");
+}
+
+// One function per block, with the same boundaries translate_block() picks for the same start
+static void write_block(FILE* out, size_t start, size_t length) {
+    uint32_t start_pc = start * 4;
+    const decoded_instruction* last = fetch_decoded((start + length - 1) * 4);
+    bool ends_in_jump = last->op == OP_JAL || last->op == OP_JALR;
+    size_t body = ends_in_jump ? length - 1 : length;
+
+    fprintf(out, "\n// %s:%d\n", instruction_file_name(start + 1), instructions_array[start + 1].file_line_num);
+    fprintf(out, "static uint64_t block_%08" PRIX32 "(int64_t* x, uint64_t max_iterations) {\n", start_pc);
+    fprintf(out, "    uint64_t iterations = 0;\n    (void)max_iterations;\n");
+    if (is_branch(last->op) && last->target == start_pc) {
+        fprintf(out, "top:\n");
+    }
+
+    for (size_t i = 0; i < body; i++) {
+        write_instruction(out, fetch_decoded((start + i) * 4), i, start_pc, length);
+    }
+
+    // a closing jal/jalr is left to the caller, which keeps the call stack
+    if (ends_in_jump) {
+        fprintf(out, "    ");
+        write_exit(out, length, body, start_pc + body * 4);
+        fprintf(out, "\n");
+    } else if (!is_branch(last->op)) {
+        fprintf(out, "    ");
+        write_exit(out, length, length, start_pc + length * 4);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "}\n");
+}
+
+static bool write_program(const char* path, uint64_t text_hash) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        red("Cannot write \"%s\".\n", path);
+        return false;
+    }
+
+    size_t count = decoded_count;
+    bool* leaders = calloc(count + 1, sizeof(bool));
+    uint16_t* lengths = calloc(count + 1, sizeof(uint16_t));
+    if (leaders == NULL || lengths == NULL) {
+        red("Memory allocation failed while compiling the program!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // blocks start at the entry point, at branch/jal targets and after every branch or jump
+    // (which covers the return addresses jalr goes back to)
+    leaders[0] = true;
+    for (size_t i = 0; i < count; i++) {
+        const decoded_instruction* d = fetch_decoded(i * 4);
+        if (ends_block(d->op)) {
+            leaders[i + 1] = true;
+            if ((is_branch(d->op) || d->op == OP_JAL) && (d->target & 3) == 0 && d->target / 4 < count) {
+                leaders[d->target / 4] = true;
+            }
+        }
+    }
+
+    fprintf(out, "// Generated by riscv_sim from %s by the 'compile' command. Do not edit.\n", current_file_name);
+    fprintf(out, "#include <stdint.h>\n\n%s\n", runtime_declaration);
+    fprintf(out, "const uint32_t aot_runtime_version = %d;\n", NATIVE_RUNTIME_VERSION);
+    fprintf(out, "const uint64_t aot_text_hash = 0x%016" PRIX64 "ULL;\n", text_hash);
+    fprintf(out, "const uint32_t aot_instruction_count = %zu;\n\n", count);
+    fprintf(out, "static const native_runtime* rt;\n\n");
+    fprintf(out, "void aot_bind(const native_runtime* runtime) {\n    rt = runtime;\n}\n");
+
+    for (size_t start = 0; start < count; start++) {
+        if (!leaders[start]) {
+            continue;
+        }
+
+        size_t length = 0;
+        while (start + length < count && length < BLOCK_MAX_LENGTH) {
+            length++;
+            if (ends_block(fetch_decoded((start + length - 1) * 4)->op)) {
+                break;
+            }
+        }
+
+        const decoded_instruction* last = fetch_decoded((start + length - 1) * 4);
+        if (length == 1 && (last->op == OP_JAL || last->op == OP_JALR)) {
+            continue;   // nothing but the jump, which runs outside the compiled code anyway
+        }
+        write_block(out, start, length);
+        lengths[start] = length;
+    }
+
+    fprintf(out, "\nuint64_t (*const aot_blocks[%zu])(int64_t*, uint64_t) = {\n", count + 1);
+    for (size_t i = 0; i < count; i++) {
+        if (lengths[i]) {
+            fprintf(out, "    [%zu] = block_%08" PRIX32 ",\n", i, (uint32_t)(i * 4));
+        }
+    }
+    fprintf(out, "};\n\nconst uint16_t aot_block_lengths[%zu] = {\n", count + 1);
+    for (size_t i = 0; i < count; i++) {
+        if (lengths[i]) {
+            fprintf(out, "    [%zu] = %u,\n", i, lengths[i]);
+        }
+    }
+    fprintf(out, "};\n");
+
+    free(leaders);
+    free(lengths);
+    return fclose(out) == 0;
+}
+
+static void* find_symbol(const char* name) {
+    void* symbol = dlsym(aot_library, name);
+    if (symbol == NULL) {
+        red("Compiled program has no symbol \"%s\".\n", name);
+    }
+    return symbol;
+}
+
+extern char** environ;
+
+// Runs the compiler on c_path without a shell, so no file name is ever interpreted. $CC is split
+// at blanks into the program and its leading arguments; quoting inside it isn't supported.
+static bool build_library(const char* c_path, const char* so_path) {
+    const char* compiler = getenv("CC") != NULL && getenv("CC")[0] != '\0' ? getenv("CC") : AOT_DEFAULT_COMPILER;
+    char* words = strdup(compiler);
+    size_t word_count = strlen(compiler) / 2 + 1;
+    char** argv = malloc((word_count + 7) * sizeof(char*));
+    if (words == NULL || argv == NULL) {
+        red("Memory allocation failed while compiling the program!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t argc = 0;
+    char* save = NULL;
+    for (char* word = strtok_r(words, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save)) {
+        argv[argc++] = word;
+    }
+    if (argc == 0) {
+        argv[argc++] = AOT_DEFAULT_COMPILER;
+    }
+    const char* options[] = {"-O2", "-shared", "-fPIC", "-o", so_path, c_path};
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+        argv[argc++] = (char*)options[i];
+    }
+    argv[argc] = NULL;
+
+    pid_t child;
+    int status = 0;
+    int spawn_error = posix_spawnp(&child, argv[0], NULL, NULL, argv, environ);
+    if (spawn_error != 0) {
+        red("Cannot run the compiler \"%s\": %s\n", argv[0], strerror(spawn_error));
+    } else {
+        while (waitpid(child, &status, 0) < 0) {
+            if (errno != EINTR) {
+                status = -1;
+                break;
+            }
+        }
+    }
+    free(argv);
+    free(words);
+    return spawn_error == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Translate the loaded program to C, build it into a shared object next to the source file
+// and use it for run from now on. Returns false (and leaves run as it was) on any failure.
+_Bool compile_program(const char* source_name) {
+    aot_unload();
+
+    size_t path_size = strlen(source_name) + 16;
+    char* c_path = malloc(path_size);
+    char* so_path = malloc(path_size + 2);
+    if (c_path == NULL || so_path == NULL) {
+        red("Memory allocation failed while compiling the program!\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(c_path, path_size, "%s.aot.c", source_name);
+    // dlopen() only takes a path as-is when it contains a slash
+    snprintf(so_path, path_size + 2, "%s%s.aot.so", strchr(source_name, '/') ? "" : "./", source_name);
+
+    uint64_t text_hash = hash_text();
+    bool success = write_program(c_path, text_hash);
+
+    if (success && !build_library(c_path, so_path)) {
+        red("Building \"%s\" failed.\n", c_path);
+        success = false;
+    }
+    // only the shared object is kept
+    remove(c_path);
+
+    if (success) {
+        aot_library = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+        if (aot_library == NULL) {
+            red("Cannot load \"%s\": %s\n", so_path, dlerror());
+            success = false;
+        }
+    }
+
+    if (success) {
+        const uint32_t* version = find_symbol("aot_runtime_version");
+        const uint64_t* hash = find_symbol("aot_text_hash");
+        const uint32_t* count = find_symbol("aot_instruction_count");
+        void (*bind)(const native_runtime*) = (void (*)(const native_runtime*))(uintptr_t)find_symbol("aot_bind");
+        aot_blocks = find_symbol("aot_blocks");
+        aot_block_lengths = find_symbol("aot_block_lengths");
+
+        if (version == NULL || hash == NULL || count == NULL || bind == NULL || aot_blocks == NULL || aot_block_lengths == NULL) {
+            success = false;
+        } else if (*version != NATIVE_RUNTIME_VERSION || *hash != text_hash || *count != decoded_count) {
+            red("\"%s\" was not built for this program.\n", so_path);
+            success = false;
+        } else {
+            bind(&guest_runtime);
+            aot_count = *count;
+            aot_hash = *hash;
+            checked_generation = text_generation;
+            text_matches = true;
+            flush_blocks();
+            printf("Compiled %s into %s\n", source_name, so_path);
+        }
+    }
+
+    if (!success) {
+        aot_unload();
+    }
+    free(c_path);
+    free(so_path);
+    return success;
+}
+
+// Compiled code for the block of `length` instructions starting at pc, or NULL. Nothing is
+// returned once the text differs from what was compiled (self-modifying code); it is used
+// again if the text goes back, e.g. after 'reset'.
+native_block aot_lookup(uint32_t pc, size_t length) {
+    if (aot_library == NULL) {
+        return NULL;
+    }
+    if (checked_generation != text_generation) {
+        checked_generation = text_generation;
+        text_matches = decoded_count == aot_count && hash_text() == aot_hash;
+    }
+
+    size_t index = pc >> 2;
+    if (!text_matches || (pc & 3) != 0 || index >= aot_count || aot_block_lengths[index] != length) {
+        return NULL;
+    }
+    return aot_blocks[index];
+}
+
+_Bool aot_loaded() {
+    return aot_library != NULL;
+}
+
+void aot_unload() {
+    if (aot_library != NULL) {
+        flush_blocks();     // translated blocks may point into the library
+        dlclose(aot_library);
+    }
+    aot_library = NULL;
+    aot_blocks = NULL;
+    aot_block_lengths = NULL;
+    aot_count = 0;
+    checked_generation = UINT64_MAX;
+    text_matches = false;
+}
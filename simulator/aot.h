@@ -0,0 +1,19 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "blocks.h"
+
+#ifndef AOT
+#define AOT
+
+#define AOT_DEFAULT_COMPILER "cc"   // overridden by $CC
+
+// Ahead-of-time translation: the loaded program is written out as C (one function per basic
+// block, same calling convention as the JIT's native_block), built into a shared object with
+// the system compiler and loaded with dlopen. The generated code reaches guest memory only
+// through the native_runtime table handed over by aot_bind().
+_Bool compile_program(const char* source_name);
+native_block aot_lookup(uint32_t pc, size_t length);
+_Bool aot_loaded();
+void aot_unload();
+#endif
@@ -0,0 +1,97 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+void arena_init(arena* a, size_t chunk_size, size_t alignment) {
+    memset(a, 0, sizeof(arena));
+    a->chunk_size = chunk_size;
+    a->alignment = alignment;
+}
+
+static void add_chunk(arena* a, size_t size) {
+    if (a->chunk_count == a->chunk_capacity) {
+        a->chunk_capacity = a->chunk_capacity ? a->chunk_capacity * 2 : 8;
+        a->chunks = realloc(a->chunks, a->chunk_capacity * sizeof(arena_chunk));
+        if (a->chunks == NULL) {
+            red("Memory allocation failed while expanding arena!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // aligned_alloc wants the size to be a multiple of the alignment
+    size = (size + a->alignment - 1) & ~(a->alignment - 1);
+    uint8_t* base = aligned_alloc(a->alignment, size);
+    if (base == NULL) {
+        red("Memory allocation failed while expanding arena!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    a->chunks[a->chunk_count].base = base;
+    a->chunks[a->chunk_count].size = size;
+    a->chunk_count++;
+
+    a->reserved += size;
+    if (a->reserved > a->peak_reserved) {
+        a->peak_reserved = a->reserved;
+    }
+}
+
+// Returns uninitialised memory, aligned to `alignment` (a power of two, at most the arena alignment)
+void* arena_alloc(arena* a, size_t size, size_t alignment) {
+    while (a->current < a->chunk_count) {
+        arena_chunk* chunk = &a->chunks[a->current];
+        size_t start = (a->offset + alignment - 1) & ~(alignment - 1);
+
+        if (start + size <= chunk->size) {
+            a->used += start + size - a->offset;
+            if (a->used > a->peak_used) {
+                a->peak_used = a->used;
+            }
+            a->offset = start + size;
+            return chunk->base + start;
+        }
+
+        // the rest of this chunk is wasted until the next reset
+        a->used += chunk->size - a->offset;
+        a->current++;
+        a->offset = 0;
+    }
+
+    add_chunk(a, size > a->chunk_size ? size : a->chunk_size);
+    a->current = a->chunk_count - 1;
+    a->offset = 0;
+    return arena_alloc(a, size, alignment);
+}
+
+// NUL-terminated copy of the first `length` characters of text
+char* arena_strndup(arena* a, const char* text, size_t length) {
+    char* copy = arena_alloc(a, length + 1, 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Forget every allocation but keep the chunks for reuse
+void arena_reset(arena* a) {
+    a->current = 0;
+    a->offset = 0;
+    a->used = 0;
+}
+
+// Give every chunk back to the system
+void arena_release(arena* a) {
+    for (size_t i = 0; i < a->chunk_count; i++) {
+        free(a->chunks[i].base);
+    }
+    free(a->chunks);
+
+    a->chunks = NULL;
+    a->chunk_count = 0;
+    a->chunk_capacity = 0;
+    a->reserved = 0;
+    arena_reset(a);
+}
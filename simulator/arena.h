@@ -0,0 +1,36 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef ARENA
+#define ARENA
+
+// Bump allocator over a list of large chunks. Individual allocations are never freed;
+// arena_reset() recycles every chunk in O(1) so the next user carves from the same memory.
+typedef struct arena_chunk {
+    uint8_t* base;
+    size_t size;
+} arena_chunk;
+
+typedef struct arena {
+    size_t chunk_size;      // default size of a new chunk
+    size_t alignment;       // alignment of every chunk base
+
+    arena_chunk* chunks;
+    size_t chunk_count;
+    size_t chunk_capacity;
+
+    size_t current;         // chunk being carved
+    size_t offset;          // bytes used in the current chunk
+
+    size_t used;            // bytes handed out since the last reset, including padding
+    size_t peak_used;
+    size_t reserved;        // bytes held in chunks
+    size_t peak_reserved;
+} arena;
+
+void arena_init(arena* a, size_t chunk_size, size_t alignment);
+void* arena_alloc(arena* a, size_t size, size_t alignment);
+char* arena_strndup(arena* a, const char* text, size_t length);
+void arena_reset(arena* a);
+void arena_release(arena* a);
+#endif
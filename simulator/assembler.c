@@ -1,23 +1,409 @@
 #include "assembler.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "utils.h"
 
-uint32_t assemble(const char* string_input) {
-    char* string = strdup(string_input);
-    format_input(string);
-    if (check_has_label(string)) {
-        // remove label
-        strtok(string, ": ");
-        string = strtok(NULL, "\n");
+#define OBJECT_ARENA_CHUNK_SIZE (64 * 1024)
+#define LINE_CACHE_MIN_LINES 1024
+#define LINE_CACHE_WINDOW 8           // lines looked at from next, and misses in a row before the hashes are
+#define LINE_HASH_SEED 2166136261u
+
+void init_object(object_file* object, const char* file_name, char* source, size_t source_size) {
+    memset(object, 0, sizeof(object_file));
+    object->file_name = strdup(file_name);
+    object->source = source;
+    object->source_size = source_size;
+    arena_init(&object->scratch, OBJECT_ARENA_CHUNK_SIZE, 16);
+    object->labels.names = &object->scratch;
+}
+
+void free_object(object_file* object) {
+    free(object->file_name);
+    free(object->text);
+    free(object->lines);
+    free(object->data);
+    for (size_t i = 0; i < object->fill_count; i++) {
+        if (object->fills[i].mapping != NULL) {
+            munmap(object->fills[i].mapping, object->fills[i].mapping_size);
+        }
+        free(object->fills[i].page);
+    }
+    free(object->fills);
+    free(object->globals);
+    free(object->fixups);
+    free_label_table(&object->labels);
+    arena_release(&object->scratch);
+    free_line_cache(&object->known_lines);
+    free_line_cache(&object->new_lines);
+    memset(object, 0, sizeof(object_file));
+}
+
+// Start remembering the lines of a load of the file in source, expecting about line_count of them
+void begin_line_cache(line_cache* cache, const char* source, size_t source_size, size_t line_count) {
+    memset(cache, 0, sizeof(line_cache));
+    cache->capacity = line_count > LINE_CACHE_MIN_LINES ? line_count : LINE_CACHE_MIN_LINES;
+    cache->source = malloc(source_size + 1);
+    cache->lines = malloc(cache->capacity * sizeof(assembled_line));
+    if (cache->source == NULL || cache->lines == NULL) {
+        red("Memory allocation failed while copying source file!\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(cache->source, source, source_size);
+    arena_init(&cache->strings, OBJECT_ARENA_CHUNK_SIZE, 16);
+}
+
+void free_line_cache(line_cache* cache) {
+    free(cache->source);
+    free(cache->lines);
+    free(cache->slots);
+    arena_release(&cache->strings);
+    memset(cache, 0, sizeof(line_cache));
+}
+
+// Match the lines of a new load from the top again
+void rewind_line_cache(line_cache* cache) {
+    cache->next = 0;
+    cache->misses = 0;
+}
+
+static bool line_matches(const line_cache* cache, size_t index, const char* line, size_t length) {
+    const assembled_line* known = &cache->lines[index];
+    return known->length == length && memcmp(cache->source + known->source_offset, line, length) == 0;
+}
+
+static size_t find_line_slot(const line_cache* cache, const char* line, size_t length, uint32_t hash) {
+    size_t slot = hash & cache->slot_mask;
+    while (cache->slots[slot] != -1) {
+        int index = cache->slots[slot];
+        if (cache->lines[index].hash == hash && line_matches(cache, index, line, length)) {
+            break;
+        }
+        slot = (slot + 1) & cache->slot_mask;
+    }
+    return slot;
+}
+
+// Index the lines by their text, at most half filling the table. Identical lines share a slot.
+static void build_line_slots(line_cache* cache) {
+    size_t slot_count = LINE_CACHE_MIN_LINES;
+    while (slot_count < cache->count * 2) {
+        slot_count *= 2;
+    }
+    cache->slots = malloc(slot_count * sizeof(int));
+    if (cache->slots == NULL) {
+        red("Memory allocation failed while indexing line cache!\n");
+        exit(EXIT_FAILURE);
+    }
+    cache->slot_mask = slot_count - 1;
+    memset(cache->slots, -1, slot_count * sizeof(int));
+
+    for (size_t i = 0; i < cache->count; i++) {
+        const assembled_line* known = &cache->lines[i];
+        size_t slot = find_line_slot(cache, cache->source + known->source_offset, known->length, known->hash);
+        if (cache->slots[slot] == -1) {
+            cache->slots[slot] = i;
+        }
+    }
+}
+
+// The same line in the previous load, or NULL. Looks from the line after the last one found, a
+// few lines ahead (lines were removed or this one replaces one), and after a run of lines that
+// weren't there, anywhere.
+const assembled_line* find_assembled_line(line_cache* cache, const char* line, size_t length) {
+    size_t end = cache->next + LINE_CACHE_WINDOW;
+    for (size_t index = cache->next; index < end && index < cache->count; index++) {
+        if (line_matches(cache, index, line, length)) {
+            cache->next = index + 1;
+            cache->misses = 0;
+            return &cache->lines[index];
+        }
+    }
+
+    if (cache->count == 0 || ++cache->misses < LINE_CACHE_WINDOW) {
+        return NULL;
+    }
+    if (cache->slots == NULL) {
+        build_line_slots(cache);
+    }
+    int found = cache->slots[find_line_slot(cache, line, length, hash_name(line, length, LINE_HASH_SEED))];
+    if (found == -1) {
+        return NULL;
+    }
+    cache->next = found + 1;
+    cache->misses = 0;
+    return &cache->lines[found];
+}
+
+// Add the next line of the file, as assembled the last time if known isn't NULL. The caller fills
+// in a new line once it has assembled.
+assembled_line* add_assembled_line(line_cache* cache, size_t source_offset, size_t length, const assembled_line* known) {
+    if (cache->count == cache->capacity) {
+        cache->capacity *= 2;
+        cache->lines = realloc(cache->lines, cache->capacity * sizeof(assembled_line));
+        if (cache->lines == NULL) {
+            red("Memory allocation failed while expanding line cache!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    assembled_line* line = &cache->lines[cache->count++];
+    if (known == NULL) {
+        memset(line, 0, sizeof(assembled_line));
+        line->hash = hash_name(cache->source + source_offset, length, LINE_HASH_SEED);
+    } else {
+        *line = *known;
+        if (known->label != NULL) {
+            line->label = copy_line_string(cache, known->label, strlen(known->label));
+        }
+        if (known->target != NULL) {
+            line->target = copy_line_string(cache, known->target, strlen(known->target));
+        }
+    }
+    line->source_offset = source_offset;
+    line->length = length;
+    return line;
+}
+
+const char* copy_line_string(line_cache* cache, const char* text, size_t length) {
+    return arena_strndup(&cache->strings, text, length);
+}
+
+// Append an instruction whose text starts at text_offset in source_text
+void add_object_instruction(object_file* object, uint32_t word, size_t text_offset, int line) {
+    if (object->text_count == object->text_capacity) {
+        object->text_capacity = object->text_capacity ? object->text_capacity * 2 : 1024;
+        object->text = realloc(object->text, object->text_capacity * sizeof(uint32_t));
+        object->lines = realloc(object->lines, object->text_capacity * sizeof(instruction_line));
+        if (object->text == NULL || object->lines == NULL) {
+            red("Memory allocation failed while expanding object text!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    object->text[object->text_count] = word;
+    object->lines[object->text_count].text_offset = text_offset;
+    object->lines[object->text_count].file_line_num = line;
+    object->text_count++;
+}
+
+void add_object_data(object_file* object, const uint8_t* bytes, size_t length) {
+    if (object->data_length + length > object->data_capacity) {
+        while (object->data_length + length > object->data_capacity) {
+            object->data_capacity = object->data_capacity ? object->data_capacity * 2 : 4096;
+        }
+        object->data = realloc(object->data, object->data_capacity);
+        if (object->data == NULL) {
+            red("Memory allocation failed while expanding object data!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memcpy(object->data + object->data_length, bytes, length);
+    object->data_length += length;
+    object->data_size += length;
+}
+
+static data_fill* new_object_fill(object_file* object, size_t size) {
+    if (object->fill_count == object->fill_capacity) {
+        object->fill_capacity = object->fill_capacity ? object->fill_capacity * 2 : 16;
+        object->fills = realloc(object->fills, object->fill_capacity * sizeof(data_fill));
+        if (object->fills == NULL) {
+            red("Memory allocation failed while expanding object data!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    data_fill* fill = &object->fills[object->fill_count++];
+    memset(fill, 0, sizeof(data_fill));
+    fill->data_offset = object->data_length;
+    fill->size = size;
+    object->data_size += size;
+    return fill;
+}
+
+// size bytes of pattern repeated, pattern_size being 1, 2, 4 or 8. Nothing is stored: zeros are
+// what untouched guest memory reads as, and other patterns need a single page.
+void add_object_fill(object_file* object, size_t size, uint64_t pattern, int pattern_size) {
+    if (size == 0) {
+        return;
+    }
+    data_fill* fill = new_object_fill(object, size);
+    fill->pattern = pattern;
+    fill->pattern_size = pattern_size;
+}
+
+// size bytes from contents, inside pages of a mapping the object now owns
+void add_object_file_data(object_file* object, const uint8_t* contents, size_t size, void* mapping, size_t mapping_size) {
+    data_fill* fill = new_object_fill(object, size);
+    fill->contents = contents;
+    fill->mapping = mapping;
+    fill->mapping_size = mapping_size;
+}
+
+// Pad the section with zeros to a multiple of alignment, a power of two
+void align_object_data(object_file* object, size_t alignment) {
+    if (alignment > object->data_alignment) {
+        object->data_alignment = alignment;
+    }
+    add_object_fill(object, (alignment - object->data_size % alignment) % alignment, 0, 1);
+}
+
+void add_object_global(object_file* object, const char* name, size_t length) {
+    if (object->global_count == object->global_capacity) {
+        object->global_capacity = object->global_capacity ? object->global_capacity * 2 : 16;
+        object->globals = realloc(object->globals, object->global_capacity * sizeof(char*));
+        if (object->globals == NULL) {
+            red("Memory allocation failed while expanding global list!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    object->globals[object->global_count++] = arena_strndup(&object->scratch, name, length);
+}
+
+static void record_fixup(object_file* object, char type, const char* label_name, size_t length) {
+    if (object->fixup_count == object->fixup_capacity) {
+        object->fixup_capacity = object->fixup_capacity ? object->fixup_capacity * 2 : 64;
+        object->fixups = realloc(object->fixups, object->fixup_capacity * sizeof(label_fixup));
+        if (object->fixups == NULL) {
+            red("Memory allocation failed while expanding fixup list!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    label_fixup* fixup = &object->fixups[object->fixup_count++];
+    fixup->type = type;
+    fixup->label_name = arena_strndup(&object->scratch, label_name, length);
+    fixup->instruction = text_line_num;
+    fixup->file_line_num = file_line_num;
+}
+
+// imm[12|10:5] and imm[4:1|11] of a B-type instruction
+static uint32_t branch_offset_bits(long int num_bytes_to_jump) {
+    uint32_t imm11 = (num_bytes_to_jump & 0b100000000000) >> 11;
+    uint32_t imm4_1 = (num_bytes_to_jump & 0b011110) >> 1;
+    uint32_t imm10_5 = (num_bytes_to_jump & 0b11111100000) >> 5;
+    uint32_t imm12 = (num_bytes_to_jump & 0b1000000000000) >> 12;
+
+    return (imm12 << 31) + (imm11 << 7) + (imm4_1 << 8) + (imm10_5 << 25);
+}
+
+// imm[20|10:1|11|19:12] of a J-type instruction
+static uint32_t jump_offset_bits(long int num_bytes_to_jump) {
+    uint32_t imm10_1 = (num_bytes_to_jump & 0b11111111110) >> 1;
+    uint32_t imm19_12 = (num_bytes_to_jump & 0b11111111000000000000) >> 12;
+    uint32_t imm11 = (num_bytes_to_jump & 0b100000000000) >> 11;
+    uint32_t imm20 = (num_bytes_to_jump & 0b100000000000000000000) >> 20;
+
+    return (imm19_12 << 12) + (imm11 << 20) + (imm10_1 << 21) + (imm20 << 31);
+}
+
+// A word of the line being assembled, as a view into the line. An empty token means the line
+// ran out, where strtok would have returned NULL.
+typedef struct token {
+    const char* text;
+    size_t length;
+} token;
+
+// strtok without writing into the line: skips leading delimiters, returns the text up to the
+// next one and moves the cursor past it
+static token next_token(const char** cursor, const char* delimiters) {
+    const char* start = *cursor + strspn(*cursor, delimiters);
+    size_t length = strcspn(start, delimiters);
+    *cursor = start[length] != '\0' ? start + length + 1 : start + length;
+    return (token){start, length};
+}
+
+static bool token_is(token word, const char* text) {
+    return strncmp(word.text, text, word.length) == 0 && text[word.length] == '\0';
+}
+
+static uint32_t token_register(token word) {
+    return find_register(word.text, word.length);
+}
+
+// The whole token as a number in any C base; false if it's empty or has anything left over
+static bool token_number(token word, long int* num) {
+    if (word.length == 0) {
+        return false;
+    }
+    char* endptr;
+    *num = strtol(word.text, &endptr, 0L);
+    return endptr == word.text + word.length;
+}
+
+// The mnemonic at the start of an instruction of the given format, or NULL with error 101
+static const mnemonic_info* token_mnemonic(token word, char type) {
+    const mnemonic_info* mnemonic = find_mnemonic(word.text, word.length);
+    if (mnemonic == NULL || mnemonic->type != type) {
+        error_code = 101;
+        return NULL;
+    }
+    return mnemonic;
+}
+
+// The register inside "(rs)" of a memory operand; false if there's no closing bracket
+static bool base_token(token source, token* base) {
+    const char* cursor = source.text;
+    *base = next_token(&cursor, ")\n");
+    return !(base->text == source.text && base->length == source.length);
+}
+
+// Branch target: a label or a byte offset. Labels further down, or in another file, get offset 0
+// and a fixup. Returns false if the target is a number outside [min, max].
+static bool target_offset(object_file* object, char type, token target, long int min, long int max, long int* num_bytes_to_jump) {
+    long int num;
+    bool is_number = token_number(target, &num);
+    if (!is_number) {
+        // the offset to a label is worked out again whenever the line is reused on a reload
+        object->target = target.text;
+        object->target_length = target.length;
+        object->target_type = type;
+    }
+
+    int label_index = find_label(&object->labels, target.text, target.length);
+    if (label_index != -1) {
+        // a label spelled like a number: the offset can't be told apart from the line, so don't reuse it
+        object->line_reusable = !is_number;
+        *num_bytes_to_jump = (long int)(object->labels.labels[label_index].line_num - text_line_num) * 4;
+        return true;
+    }
+
+    if (!is_number) {
+        // a label further down: leave the offset 0 and patch it once every label is known
+        record_fixup(object, type, target.text, target.length);
+        num = 0;
     }
+    if (num < min || num > max) {
+        return false;
+    }
+
+    *num_bytes_to_jump = num;
+    return true;
+}
+
+// `line` has been through format_input(). It is only read: operands are views into it, so
+// assembling allocates nothing but the names of labels used before their definition.
+uint32_t assemble(object_file* object, const char* line) {
+    object->target = NULL;
+    object->target_type = 0;
+    object->line_reusable = true;
+
+    const char* string = line;
+    if (check_has_label(line)) {
+        // skip the label
+        string += strcspn(line, ": ") + 1;
+    }
+    string += strspn(string, "\n");
 
     // not an error when string is a blank line
-    if ((string == NULL) || (string[0] == '\0') || (strcmp(string, "\n") == 0)) {
+    if (string[0] == '\0') {
         return 0u;
     };
     char type = identify_type(string);
@@ -29,11 +415,11 @@ uint32_t assemble(const char* string_input) {
         case 's':
             return assemble_s(string);
         case 'b':
-            return assemble_b(string);
+            return assemble_b(object, string);
         case 'u':
             return assemble_u(string);
         case 'j':
-            return assemble_j(string);
+            return assemble_j(object, string);
         default:
             break;
     }
@@ -45,26 +431,23 @@ uint32_t assemble(const char* string_input) {
 
 uint32_t assemble_r(const char* string) {
     uint32_t opcode = 0b0110011;
-    char* string_copy = strdup(string);
 
-    if (string_copy == NULL) {
-        // error handling
-        printf("Something went wrong while assembling.\n");
-        return 0;
+    // Tokenize the string
+    const char* cursor = string;
+    const mnemonic_info* mnemonic = token_mnemonic(next_token(&cursor, " \n"), 'r');
+    token rd_str = next_token(&cursor, " \n");
+    token rs1_str = next_token(&cursor, " \n");
+    token rs2_str = next_token(&cursor, "\n");
+    if (mnemonic == NULL) {
+        return -1u;
     }
 
-    // Tokenize the string and store them
-    char* instruction_str = strtok(string_copy, " ");
-    char* rd_str = strtok(NULL, " ");
-    char* rs1_str = strtok(NULL, " ");
-    char* rs2_str = strtok(NULL, "\n");
-
-    uint32_t funct3 = get_funct3('r', instruction_str) << 12;
-    uint32_t funct7 = get_funct7('r', instruction_str) << 25;
+    uint32_t funct3 = mnemonic->funct3 << 12;
+    uint32_t funct7 = mnemonic->funct7 << 25;
 
-    uint32_t rd = parse_register(rd_str);
-    uint32_t rs1 = parse_register(rs1_str);
-    uint32_t rs2 = parse_register(rs2_str);
+    uint32_t rd = token_register(rd_str);
+    uint32_t rs1 = token_register(rs1_str);
+    uint32_t rs2 = token_register(rs2_str);
 
     // unidentified rd and rs error codes are 102 and 103
     if (rd == -1u) {
@@ -84,103 +467,38 @@ uint32_t assemble_r(const char* string) {
 
 uint32_t assemble_i(const char* string) {
     uint32_t opcode;
-    char* string_copy = strdup(string);
 
-    if (string_copy == NULL) {
-        // error handling
-        printf("Something went wrong in assemble_i.\n");
-        return 0;
+    const char* cursor = string;
+    token instruction = next_token(&cursor, " \n");
+    const mnemonic_info* mnemonic = token_mnemonic(instruction, 'i');
+    if (mnemonic == NULL) {
+        return -1u;
     }
 
-    char* instruction = strtok(string_copy, " ");
-
-    if (check_load_or_not(instruction)) {
-        opcode = 0b0000011;
-
-        char* dest = strtok(NULL, " ");
-        char* immediate = strtok(NULL, "(");
-        char* source = strtok(NULL, "\n");
+    if (mnemonic->is_load || token_is(instruction, "jalr")) {
+        // loads are rd imm(rs), and so is jalr
+        opcode = mnemonic->is_load ? 0b0000011 : 0b1100111;
+        uint32_t funct3 = mnemonic->funct3 << 12;
 
-        if (source == NULL) {
+        token dest = next_token(&cursor, " \n");
+        token immediate = next_token(&cursor, "(");
+        token source = next_token(&cursor, "\n");
+        token base;
+        if (source.length == 0 || !base_token(source, &base)) {
             error_code = 103;
             return -1u;
         }
 
-        char* source1 = (char*)malloc(strlen(source) * sizeof(char));
-
-        strcpy(source1, source);
-        char* source2 = strtok(source1, ")");
-
-        if (strcmp(source2, source) == 0) {
-            error_code = 103;
-            return -1u;
-        }
-
-        uint32_t rd = parse_register(dest);
-        uint32_t rs = parse_register(source2);
-        uint32_t funct3 = get_funct3('i', instruction) << 12;
-
-        char* endptr;
-        long int num = strtol(immediate, &endptr, 0L);
-        // 105 is immediate value error
-        if (*endptr != '\0') {
-            error_code = 105;
-            return -1u;
-        }
-        // 108 is immediate value out of bounds
-        if (num < -2048 || num > 2047) {
-            error_code = 108;
-            return -1u;
-        }
-        // unidentified rd and rs error codes are 102 and 103
-        if (rd == -1u) {
-            error_code = 102;
-            return -1u;
-        }
-        if (rs == -1u) {
-            error_code = 103;
-            return -1u;
-        }
-
-        uint32_t imm11_0 = num & 0b111111111111;
-
-        rd <<= 7;
-        rs <<= 15;
-        imm11_0 <<= 20;
-        return opcode + rd + funct3 + rs + imm11_0;
-
-    } else if (strcmp(instruction, "jalr") == 0) {
-        opcode = 0b1100111;
-        uint32_t funct3 = 0b000;
-
-        char* dest = strtok(NULL, " ");
-        char* immediate = strtok(NULL, "(");
-        char* source = strtok(NULL, "\n");
-        if (source == NULL) {
-            error_code = 103;
-            return -1u;
-        }
-
-        char* source1 = (char*)malloc(strlen(source) * sizeof(char));
-
-        strcpy(source1, source);
-        char* source2 = strtok(source1, ")");
-
-        if (strcmp(source2, source) == 0) {
-            error_code = 103;
-            return -1u;
-        }
-
-        uint32_t rd = parse_register(dest);
-        uint32_t rs = parse_register(source2);
-        char* endptr;
-        if (immediate == NULL) {
+        uint32_t rd = token_register(dest);
+        uint32_t rs = token_register(base);
+        if (!mnemonic->is_load && immediate.length == 0) {
             error_code = 112;
             return -1u;
         }
-        long int num = strtol(immediate, &endptr, 0L);
+
+        long int num;
         // 105 is immediate value error
-        if (*endptr != '\0') {
+        if (!token_number(immediate, &num)) {
             error_code = 105;
             return -1u;
         }
@@ -205,20 +523,19 @@ uint32_t assemble_i(const char* string) {
         rd <<= 7;
         rs <<= 15;
         imm11_0 <<= 20;
-
         return opcode + rd + funct3 + rs + imm11_0;
     }
 
     // following is executed only if instruction is neither load type nor jalr
     opcode = 0b0010011;
-    uint32_t funct3 = get_funct3('i', instruction) << 12;
+    uint32_t funct3 = mnemonic->funct3 << 12;
 
-    char* dest = strtok(NULL, " ");
-    char* source = strtok(NULL, " ");
-    char* immediate = strtok(NULL, "\n");
+    token dest = next_token(&cursor, " \n");
+    token source = next_token(&cursor, " \n");
+    token immediate = next_token(&cursor, "\n");
 
-    uint32_t rd = parse_register(dest);
-    uint32_t rs = parse_register(source);
+    uint32_t rd = token_register(dest);
+    uint32_t rs = token_register(source);
 
     // unidentified rd and rs error codes are 102 and 103
     if (rd == -1u) {
@@ -229,25 +546,20 @@ uint32_t assemble_i(const char* string) {
         error_code = 103;
         return -1u;
     }
-    if (immediate == NULL) {
-        error_code = 105;
-        return -1u;
-    }
 
-    char* endptr;
-    long int num = strtol(immediate, &endptr, 0L);
+    long int num;
     // 105 is immediate value error
-    if (*endptr != '\0') {
+    if (!token_number(immediate, &num)) {
         error_code = 105;
         return -1u;
     }
 
     int shift_instruction_flag = 0;
-    if (strcmp(instruction, "slli") == 0) {
+    if (token_is(instruction, "slli")) {
         shift_instruction_flag = 1;
-    } else if (strcmp(instruction, "srli") == 0) {
+    } else if (token_is(instruction, "srli")) {
         shift_instruction_flag = 2;
-    } else if (strcmp(instruction, "srai") == 0) {
+    } else if (token_is(instruction, "srai")) {
         shift_instruction_flag = 3;
     }
 
@@ -286,38 +598,27 @@ uint32_t assemble_i(const char* string) {
 
 uint32_t assemble_s(const char* string) {
     int32_t opcode = 0b0100011;
-    char* string_copy = strdup(string);
-
-    if (string_copy == NULL) {
-        // error handling
-        printf("Something went wrong in assemble_s.\n");
-        return 0;
-    }
-
-    char* instruction = strtok(string_copy, " ");
 
-    uint32_t funct3 = get_funct3('s', instruction);
-    char* source1 = strtok(NULL, " ");
-    char* offset = strtok(NULL, "(");
-    char* source2 = strtok(NULL, "\n");
-
-    if (source2 == NULL) {
-        error_code = 103;
+    const char* cursor = string;
+    const mnemonic_info* mnemonic = token_mnemonic(next_token(&cursor, " \n"), 's');
+    if (mnemonic == NULL) {
         return -1u;
     }
 
-    char* source2_temp = (char*)malloc(strlen(source2) * sizeof(char));
+    uint32_t funct3 = mnemonic->funct3;
+    token source1 = next_token(&cursor, " \n");
+    token offset = next_token(&cursor, "(");
+    token source2 = next_token(&cursor, "\n");
 
-    strcpy(source2_temp, source2);
-    char* source2_final = strtok(source2_temp, ")");
-
-    if (strcmp(source2_final, source2) == 0) {
+    token base;
+    if (source2.length == 0 || !base_token(source2, &base)) {
         error_code = 103;
         return -1u;
     }
+
     // sd/w/b rs2 n(rs1)
-    uint32_t rs2 = parse_register(source1);
-    uint32_t rs1 = parse_register(source2_final);
+    uint32_t rs2 = token_register(source1);
+    uint32_t rs1 = token_register(base);
 
     // unidentified rs error code is 103 (both are source)
     if (rs1 == -1u || rs2 == -1u) {
@@ -325,11 +626,9 @@ uint32_t assemble_s(const char* string) {
         return -1u;
     }
 
-    char* endptr;
-    long int num = strtol(offset, &endptr, 0L);
-
+    long int num;
     // 105 is immediate value error (for offet) (-2048 to 2047)
-    if (*endptr != '\0') {
+    if (!token_number(offset, &num)) {
         error_code = 105;
         return -1u;
     }
@@ -353,27 +652,22 @@ uint32_t assemble_s(const char* string) {
     return opcode + imm40 + funct3 + rs1 + rs2 + imm115;
 };
 
-uint32_t assemble_b(const char* string) {
+uint32_t assemble_b(object_file* object, const char* string) {
     uint32_t opcode = 0b1100011;
 
-    char* string_copy = strdup(string);
-
-    if (string_copy == NULL) {
-        // error handling
-        printf("Something went wrong in assemble_b.\n");
-        return 0;
+    const char* cursor = string;
+    const mnemonic_info* mnemonic = token_mnemonic(next_token(&cursor, " \n"), 'b');
+    if (mnemonic == NULL) {
+        return -1u;
     }
+    uint32_t funct3 = mnemonic->funct3 << 12;
 
-    char* instruction = strtok(string_copy, " ");
-    uint32_t funct3 = get_funct3('b', instruction) << 12;
-
-    char* source_1 = strtok(NULL, " ");
-    char* source_2 = strtok(NULL, " ");
-    char* label = strtok(NULL, "\n");
+    token source_1 = next_token(&cursor, " \n");
+    token source_2 = next_token(&cursor, " \n");
+    token label = next_token(&cursor, "\n");
 
-    uint32_t rs1 = parse_register(source_1);
-    uint32_t rs2 = parse_register(source_2);
-    int label_line_num = get_label_line_num(label);
+    uint32_t rs1 = token_register(source_1);
+    uint32_t rs2 = token_register(source_2);
 
     // unidentified rs error code is 103 (both are source)
     if (rs1 == -1u || rs2 == -1u) {
@@ -381,64 +675,39 @@ uint32_t assemble_b(const char* string) {
         return -1u;
     }
 
-    int num_bytes_to_jump;
-    if (label_line_num == -1) {
-        // check if a number has been entered
-        char* endptr;
-        long int num = strtol(label, &endptr, 0L);
-        // 109 is label not found
-        if (*endptr != '\0') {
-            error_code = 109;
-            return -1u;
-        }
-
-        // 106 is value out of bounds
-        if (num < -4096 || num > 4094) {
-            error_code = 106;
-            return -1u;
-        }
-
-        num_bytes_to_jump = num;
-    } else {
-        num_bytes_to_jump = (label_line_num - text_line_num) * 4;
+    // 109 is label not found
+    if (label.length == 0) {
+        error_code = 109;
+        return -1u;
     }
 
-    uint32_t imm11 = (num_bytes_to_jump & 0b100000000000) >> 11;
-    uint32_t imm4_1 = (num_bytes_to_jump & 0b011110) >> 1;
-    uint32_t imm10_5 = (num_bytes_to_jump & 0b11111100000) >> 5;
-    uint32_t imm12 = (num_bytes_to_jump & 0b1000000000000) >> 12;
+    // 106 is value out of bounds
+    long int num_bytes_to_jump;
+    if (!target_offset(object, 'b', label, -4096, 4094, &num_bytes_to_jump)) {
+        error_code = 106;
+        return -1u;
+    }
 
     rs1 <<= 15;
     rs2 <<= 20;
-    imm12 <<= 31;
-    imm11 <<= 7;
-    imm4_1 <<= 8;
-    imm10_5 <<= 25;
 
-    return opcode + imm11 + imm4_1 + funct3 + rs1 + rs2 + imm10_5 + imm12;
+    return opcode + funct3 + rs1 + rs2 + branch_offset_bits(num_bytes_to_jump);
 };
 
 uint32_t assemble_u(const char* string) {
     uint32_t opcode = 0b0110111;
-    char* string_copy = strdup(string);
-
-    if (string_copy == NULL) {
-        // error handling
-        printf("Something went wrong in assemble_u.\n");
-        return 0;
-    }
 
     // discard first token as only lui is possible
-    strtok(string_copy, " ");
-    char* dest = strtok(NULL, " ");
-    char* immediate = strtok(NULL, "\n");
+    const char* cursor = string;
+    next_token(&cursor, " \n");
+    token dest = next_token(&cursor, " \n");
+    token immediate = next_token(&cursor, "\n");
 
-    uint32_t rd = parse_register(dest);
+    uint32_t rd = token_register(dest);
 
-    char* endptr;
-    long int num = strtol(immediate, &endptr, 0L);
+    long int num;
     // 105 is immediate value error
-    if (*endptr != '\0') {
+    if (!token_number(immediate, &num)) {
         error_code = 105;
         return -1u;
     }
@@ -460,62 +729,98 @@ uint32_t assemble_u(const char* string) {
     return opcode + rd + imm;
 };
 
-uint32_t assemble_j(const char* string) {
+uint32_t assemble_j(object_file* object, const char* string) {
     uint32_t opcode = 0b1101111;
 
-    char* string_copy = strdup(string);
-    if (string_copy == NULL) {
-        // error handling
-        printf("Something went wrong in assemble_j.\n");
-        return 0;
-    }
-
     // discard first token as only jal is possible
-    strtok(string_copy, " ");
-    char* dest = strtok(NULL, " ");
-    char* label = strtok(NULL, "\n");
-
-    int label_line_num = get_label_line_num(label);
+    const char* cursor = string;
+    next_token(&cursor, " \n");
+    token dest = next_token(&cursor, " \n");
+    token label = next_token(&cursor, "\n");
+
+    // 109 is label not found
+    if (label.length == 0) {
+        error_code = 109;
+        return -1u;
+    }
 
+    // 111 is value out of bounds
     long int num_bytes_to_jump;
-    if (label_line_num == -1) {
-        // check if a number has been entered
-        char* endptr;
-        long int num = strtol(label, &endptr, 0L);
-        // 109 is label not found
-        if (*endptr != '\0') {
-            error_code = 109;
-            return -1u;
-        }
-
-        // 111 is value out of bounds
-        if (num < -1048576 || num > 1048575) {
-            error_code = 111;
-            return -1u;
-        }
-
-        num_bytes_to_jump = num;
-    } else {
-        num_bytes_to_jump = (label_line_num - text_line_num) * 4;
+    if (!target_offset(object, 'j', label, -1048576, 1048575, &num_bytes_to_jump)) {
+        error_code = 111;
+        return -1u;
     }
 
-    uint32_t rd = parse_register(dest);
+    uint32_t rd = token_register(dest);
     // 102 is unidentified destination register
     if (rd == -1u) {
         error_code = 102;
         return -1u;
     }
 
-    uint32_t imm10_1 = (num_bytes_to_jump & 0b11111111110) >> 1;
-    uint32_t imm19_12 = (num_bytes_to_jump & 0b11111111000000000000) >> 12;
-    uint32_t imm11 = (num_bytes_to_jump & 0b100000000000) >> 11;
-    uint32_t imm20 = (num_bytes_to_jump & 0b100000000000000000000) >> 20;
-
     rd <<= 7;
-    imm19_12 <<= 12;
-    imm11 <<= 20;
-    imm10_1 <<= 21;
-    imm20 <<= 31;
 
-    return opcode + rd + imm19_12 + imm11 + imm10_1 + imm20;
-};
\ No newline at end of file
+    return opcode + rd + jump_offset_bits(num_bytes_to_jump);
+};
+
+// Every bit a label offset can set in a branch ('b') or jal ('j')
+uint32_t label_offset_mask(char type) {
+    return type == 'b' ? branch_offset_bits(-1) : jump_offset_bits(-1);
+}
+
+// Offset bits of a branch or jal at text_line_num to a label, as target_offset() works them out:
+// the label's if it's already defined, otherwise 0 and a fixup
+uint32_t label_offset_bits(object_file* object, char type, const char* name, size_t length) {
+    int label_index = find_label(&object->labels, name, length);
+    if (label_index == -1) {
+        record_fixup(object, type, name, length);
+        return 0;
+    }
+
+    long int num_bytes_to_jump = (long int)(object->labels.labels[label_index].line_num - text_line_num) * 4;
+    return type == 'b' ? branch_offset_bits(num_bytes_to_jump) : jump_offset_bits(num_bytes_to_jump);
+}
+
+// Patch every branch and jal whose label was defined further down the same file. The rest name
+// labels of other files and stay for the linker.
+void resolve_local_fixups(object_file* object) {
+    size_t unresolved = 0;
+    for (size_t i = 0; i < object->fixup_count; i++) {
+        const label_fixup* fixup = &object->fixups[i];
+        int label_index = find_label(&object->labels, fixup->label_name, strlen(fixup->label_name));
+        if (label_index == -1) {
+            object->fixups[unresolved++] = *fixup;
+            continue;
+        }
+
+        long int num_bytes_to_jump = (long int)(object->labels.labels[label_index].line_num - fixup->instruction) * 4;
+        if (!apply_fixup(object, fixup, num_bytes_to_jump)) {
+            object->error_code = error_code;
+            object->error_line = fixup->file_line_num;
+            object->error_text = source_text + object->lines[fixup->instruction - 1].text_offset;
+            break;
+        }
+    }
+    object->fixup_count = unresolved;
+}
+
+// Put the offset into the branch or jal of `fixup`, if it's in range. Sets error_code if not.
+_Bool apply_fixup(object_file* object, const label_fixup* fixup, long int num_bytes_to_jump) {
+    uint32_t* word = &object->text[fixup->instruction - 1];
+    if (fixup->type == 'b') {
+        // 106 is value out of bounds
+        if (num_bytes_to_jump < -4096 || num_bytes_to_jump > 4094) {
+            error_code = 106;
+            return false;
+        }
+        *word |= branch_offset_bits(num_bytes_to_jump);
+    } else {
+        // 111 is value out of bounds
+        if (num_bytes_to_jump < -1048576 || num_bytes_to_jump > 1048575) {
+            error_code = 111;
+            return false;
+        }
+        *word |= jump_offset_bits(num_bytes_to_jump);
+    }
+    return true;
+}
@@ -1,13 +1,139 @@
 #include<stdint.h>
+#include<stddef.h>
+
+#include "arena.h"
+#include "utils.h"
+
 #ifndef ASSEMBLER
 #define ASSEMBLER
 
+// A branch or jal naming a label that hadn't been seen yet when it was assembled
+typedef struct label_fixup {
+    char type;              // 'b' or 'j'
+    char* label_name;       // from the object's arena
+    int instruction;        // text_line_num of the branch / jal, in its object
+    int file_line_num;
+} label_fixup;
+
+// A run of the .data section that isn't stored value by value: zeros, a repeated value, or part of
+// a file read by .incbin. The linker backs the run's whole pages with shared pages where it can.
+typedef struct data_fill {
+    size_t data_offset;         // bytes of object->data before the run
+    size_t size;
+    uint64_t pattern;           // repeated every pattern_size bytes, little endian
+    int pattern_size;
+    const uint8_t* contents;    // the .incbin bytes, or NULL for the pattern
+    void* mapping;              // pages holding the .incbin bytes, from their start
+    size_t mapping_size;
+    uint8_t* page;              // a page of the pattern, made when linking
+} data_fill;
+
+// One line of a file as it assembled. A file remembers its lines from one load to the next, so
+// reloading it after an edit only assembles the lines that changed.
+typedef struct assembled_line {
+    uint32_t source_offset; // in the line cache's copy of the file
+    uint32_t length;
+    uint32_t hash;
+    uint32_t word;          // 0 for a line without an instruction
+    uint32_t text_start;    // where the display text starts, if tidy
+    _Bool reusable;         // a text line that assembled without error
+    _Bool tidy;             // the line from text_start on is its display text as it is
+    char target_type;       // 'b' or 'j' when word branches to target; the offset is left out
+    const char* target;
+    const char* label;      // label the line defines, or NULL
+} assembled_line;
+
+// Every line of one load of a file, in file order, directives and data included so the next load
+// stays in step with them. The next load matches its lines against these in order, so an edit
+// of a few lines costs a compare or two per line; after a bigger change lines are looked up by
+// their hash.
+typedef struct line_cache {
+    char* source;           // copy of the file as it was loaded
+    assembled_line* lines;
+    size_t count;
+    size_t capacity;
+    size_t next;            // line expected to come next
+    size_t misses;          // lines in a row that weren't near next
+    int* slots;             // open addressing over lines, built after a run of misses
+    size_t slot_mask;
+    arena strings;          // label and target names
+} line_cache;
+
+// One source file assembled on its own, as if it were loaded at address 0. Branches to labels the
+// file doesn't define are left as fixups for the linker, which places the objects one after
+// another and resolves them against the labels other files declared .globl.
+typedef struct object_file {
+    char* file_name;
+    char* source;               // the file's part of source_text
+    size_t source_size;
+    uint64_t source_hash;       // of the file as read, before it's formatted in place
+
+    uint32_t* text;             // instruction words
+    instruction_line* lines;    // lines[i] describes text[i]
+    size_t text_count;
+    size_t text_capacity;
+    size_t first_instruction;   // instruction number of text[0] once linked
+
+    uint8_t* data;              // values of the .data section, its fills left out
+    size_t data_length;
+    size_t data_capacity;
+    size_t data_size;           // of the .data section, fills included
+    size_t data_alignment;      // the section's start must be a multiple of this
+    uint64_t data_address;      // where the section starts once linked
+    int data_directive_size;    // bytes per value of the active data directive, 0 for none
+    data_fill* fills;           // in section order
+    size_t fill_count;
+    size_t fill_capacity;
+
+    label_table labels;
+    char** globals;             // names declared .globl
+    size_t global_count;
+    size_t global_capacity;
+
+    label_fixup* fixups;
+    size_t fixup_count;
+    size_t fixup_capacity;
+
+    arena scratch;              // line buffer, label and fixup names
+    line_cache known_lines;     // the lines of the previous load of the file
+    line_cache new_lines;       // the lines of this load, known_lines of the next once it assembles
+
+    const char* target;         // label named by the branch or jal assembled last, NULL if none
+    size_t target_length;
+    char target_type;
+    _Bool line_reusable;        // false if the line assembled last can't be kept in known_lines
+
+    int error_code;
+    int error_line;             // file line of the error
+    const char* error_text;     // instruction to show with the error, NULL if it was reported already
+} object_file;
+
+void init_object(object_file* object, const char* file_name, char* source, size_t source_size);
+void free_object(object_file* object);
+void add_object_instruction(object_file* object, uint32_t word, size_t text_offset, int line);
+void add_object_data(object_file* object, const uint8_t* bytes, size_t length);
+void add_object_fill(object_file* object, size_t size, uint64_t pattern, int pattern_size);
+void add_object_file_data(object_file* object, const uint8_t* contents, size_t size, void* mapping, size_t mapping_size);
+void align_object_data(object_file* object, size_t alignment);
+void add_object_global(object_file* object, const char* name, size_t length);
+
+void begin_line_cache(line_cache* cache, const char* source, size_t source_size, size_t line_count);
+void free_line_cache(line_cache* cache);
+void rewind_line_cache(line_cache* cache);
+const assembled_line* find_assembled_line(line_cache* cache, const char* line, size_t length);
+assembled_line* add_assembled_line(line_cache* cache, size_t source_offset, size_t length, const assembled_line* known);
+const char* copy_line_string(line_cache* cache, const char* text, size_t length);
+
 // void instruction_R(char*);
-uint32_t assemble(const char*);
+uint32_t assemble(object_file* object, const char*);
 uint32_t assemble_r(const char*);
 uint32_t assemble_i(const char*);
 uint32_t assemble_s(const char*);
-uint32_t assemble_b(const char*);
+uint32_t assemble_b(object_file* object, const char*);
 uint32_t assemble_u(const char*);
-uint32_t assemble_j(const char*);
-#endif
\ No newline at end of file
+uint32_t assemble_j(object_file* object, const char*);
+uint32_t label_offset_mask(char type);
+uint32_t label_offset_bits(object_file* object, char type, const char* name, size_t length);
+void resolve_local_fixups(object_file* object);
+_Bool apply_fixup(object_file* object, const label_fixup* fixup, long int num_bytes_to_jump);
+#endif
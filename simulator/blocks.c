@@ -0,0 +1,266 @@
+#include "blocks.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "arena.h"
+#include "breakpoints.h"
+#include "cache.h"
+#include "cache_log.h"
+#include "callstack.h"
+#include "interpreter.h"
+#include "jit.h"
+#include "simulator.h"
+#include "trace.h"
+#include "utils.h"
+
+#define BLOCK_ARENA_CHUNK_SIZE (1 << 20)
+
+static arena block_arena;
+static bool block_arena_ready = false;
+
+static translated_block** block_map = NULL;    // indexed by start pc / 4
+static size_t block_map_size = 0;
+static uint64_t block_generation = UINT64_MAX;  // text_generation the cache was built against
+
+static bool ends_block(uint8_t op) {
+    return (op >= OP_BEQ && op <= OP_BGEU) || op == OP_JAL || op == OP_JALR;
+}
+
+// Drop every translated block, e.g. after the program stored into its own text
+void flush_blocks() {
+    if (!block_arena_ready) {
+        arena_init(&block_arena, BLOCK_ARENA_CHUNK_SIZE, 64);
+        block_arena_ready = true;
+    }
+    arena_reset(&block_arena);
+    jit_reset();
+
+    free(block_map);
+    block_map = calloc(decoded_count + 1, sizeof(translated_block*));
+    if (block_map == NULL) {
+        red("Memory allocation failed while translating the program!\n");
+        exit(EXIT_FAILURE);
+    }
+    block_map_size = decoded_count;
+    block_generation = text_generation;
+}
+
+static translated_block* translate_block(uint32_t start_pc) {
+    size_t start = start_pc / 4;
+    size_t length = 0;
+
+    while (start + length < decoded_count && length < BLOCK_MAX_LENGTH) {
+        decoded_instruction* decoded = fetch_decoded((start + length) * 4);
+        length++;
+        if (ends_block(decoded->op)) {
+            break;
+        }
+    }
+
+    translated_block* block = arena_alloc(&block_arena, sizeof(translated_block) + length * sizeof(decoded_instruction), 16);
+    memcpy(block->ops, &decoded_text[start], length * sizeof(decoded_instruction));
+
+    const decoded_instruction* last = &block->ops[length - 1];
+    block->start_pc = start_pc;
+    block->length = length;
+    block->first_instruction = start + 1;
+    block->last_line = instructions_array[start + length].file_line_num;
+    block->fallthrough_pc = start_pc + length * 4;
+    block->taken_pc = (last->op == OP_JAL || (last->op >= OP_BEQ && last->op <= OP_BGEU)) ? last->target : block->fallthrough_pc;
+    block->taken = NULL;
+    block->fallthrough = NULL;
+    block->executions = 0;
+    block->native = aot_lookup(start_pc, length);
+
+    block_map[start] = block;
+    return block;
+}
+
+// Cached block starting at pc, translated on first use. NULL outside the text segment.
+static translated_block* find_block(uint32_t pc) {
+    size_t index = pc >> 2;
+    if ((pc & 3) != 0 || index >= block_map_size) {
+        return NULL;
+    }
+    return block_map[index] ? block_map[index] : translate_block(pc);
+}
+
+// Runs a whole block with the step() bookkeeping done once. Stops right after an instruction
+// that changed the text segment, since the rest of the block may no longer be valid.
+static size_t execute_block(const translated_block* block) {
+    size_t last = block->length - 1;
+
+    break_line_found = false;
+    stack_frame* function = return_top_of_stack();
+    if (function != NULL) {
+        function->line_num = block->last_line;
+    }
+
+    for (size_t i = 0; i < last; i++) {
+        const decoded_instruction* d = &block->ops[i];
+        if (trace_verbosity == TRACE_INSTRUCTIONS) {
+            trace_instruction(block->first_instruction + i, block->start_pc + i * 4);
+        }
+        if (icache_enabled) {
+            fetch_cache(block->start_pc + i * 4);
+        }
+        d->handler(d);
+
+        if (text_generation != block_generation) {
+            pc = block->start_pc + (i + 1) * 4;
+            current_instruction = block->first_instruction + i + 1;
+            if (function != NULL) {
+                function->line_num = instructions_array[current_instruction - 1].file_line_num;
+            }
+            return i + 1;
+        }
+    }
+
+    // the terminator computes its target from pc and current_instruction
+    pc = block->start_pc + last * 4;
+    current_instruction = block->first_instruction + last;
+    if (trace_verbosity == TRACE_INSTRUCTIONS) {
+        trace_instruction(current_instruction, pc);
+    }
+    if (icache_enabled) {
+        fetch_cache(pc);
+    }
+    block->ops[last].handler(&block->ops[last]);
+    finish_step();
+    return block->length;
+}
+
+// Same effect as execute_block(), in compiled code. A block that branches back to itself keeps
+// looping natively for as many whole iterations as the budget allows.
+static size_t execute_native(const translated_block* block, size_t budget) {
+    size_t iterations = budget / block->length;
+    if (iterations > JIT_MAX_ITERATIONS) {
+        iterations = JIT_MAX_ITERATIONS;
+    }
+
+    break_line_found = false;
+    stack_frame* function = return_top_of_stack();
+    if (function != NULL) {
+        function->line_num = block->last_line;
+    }
+
+    uint64_t result = block->native(registers, iterations);
+    size_t retired = result >> 32;
+    pc = (uint32_t)result;
+    current_instruction = pc / 4 + 1;
+
+    if (text_generation != block_generation) {
+        // stopped after a store into the text
+        if (function != NULL) {
+            function->line_num = instructions_array[current_instruction - 1].file_line_num;
+        }
+        return retired;
+    }
+
+    // the compiled body stops short of a closing jal/jalr
+    const decoded_instruction* last = &block->ops[block->length - 1];
+    if ((last->op == OP_JAL || last->op == OP_JALR) && retired == block->length - 1) {
+        last->handler(last);
+        finish_step();
+        retired++;
+    } else if (current_instruction > max_instructions) {
+        pop_from_stack();
+    }
+    return retired;
+}
+
+// Compiled code (ahead of time or JIT) is only used when nothing needs per-instruction control.
+// Its loads and stores go through the D-cache model; instruction fetches and the cache log don't.
+static bool native_allowed() {
+    return trace_verbosity != TRACE_INSTRUCTIONS && !icache_enabled && !cache_logging();
+}
+
+static bool jit_allowed() {
+    return JIT_AVAILABLE && jit_enabled && native_allowed();
+}
+
+const char* run_engine_name() {
+    if (native_allowed() && aot_loaded()) {
+        return jit_allowed() ? "AOT compiled + x86-64 JIT" : "AOT compiled";
+    }
+    return jit_allowed() ? "x86-64 JIT" : "block cache + " DISPATCH_NAME " dispatch";
+}
+
+// Runs the program a block at a time. Blocks containing a breakpoint, and anything outside
+// the text segment, go through run_instructions() so stops stay exact.
+// Returns the number of instructions executed.
+size_t run_blocks(size_t limit) {
+    size_t executed = 0;
+    translated_block* block = NULL;
+    bool use_native = native_allowed();
+    bool use_jit = jit_allowed();
+
+    if (block_generation != text_generation) {
+        flush_blocks();
+    }
+
+    while (executed < limit && current_instruction <= max_instructions) {
+        if (block == NULL) {
+            block = find_block(pc);
+        }
+
+        if (block == NULL || block->length > limit - executed || breakpoint_in_range(block->start_pc, block->length)) {
+            size_t count = block ? block->length : 1;
+            if (count > limit - executed) {
+                count = limit - executed;
+            }
+
+            size_t done = run_instructions(count);
+            executed += done;
+            if (done < count) {
+                break;
+            }
+            if (block_generation != text_generation) {
+                flush_blocks();
+            }
+            block = NULL;
+            continue;
+        }
+
+        if (use_jit && block->native == NULL && ++block->executions == JIT_THRESHOLD) {
+            block->native = jit_compile(block);
+            if (jit_out_of_space()) {
+                // start over with an empty code buffer
+                flush_blocks();
+                block = NULL;
+                continue;
+            }
+        }
+
+        if (use_native && block->native != NULL) {
+            executed += execute_native(block, limit - executed);
+        } else {
+            executed += execute_block(block);
+        }
+        if (block_generation != text_generation) {
+            flush_blocks();
+            block = NULL;
+            continue;
+        }
+
+        // follow the chain, linking the successor in on first use
+        if (pc == block->taken_pc) {
+            if (block->taken == NULL) {
+                block->taken = find_block(pc);
+            }
+            block = block->taken;
+        } else if (pc == block->fallthrough_pc) {
+            if (block->fallthrough == NULL) {
+                block->fallthrough = find_block(pc);
+            }
+            block = block->fallthrough;
+        } else {
+            block = NULL;
+        }
+    }
+    return executed;
+}
@@ -0,0 +1,38 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "decode.h"
+
+#ifndef BLOCKS
+#define BLOCKS
+
+#define BLOCK_MAX_LENGTH 256
+
+// Native code for one block (see jit.c): runs the block, looping in place at most max_iterations
+// times while it branches back to its own start, and returns (instructions retired << 32) | next pc.
+// A block ending in jal/jalr returns before the jump so the caller can do the call stack work.
+typedef uint64_t (*native_block)(int64_t* registers, uint64_t max_iterations);
+
+// A straight run of instructions ending at the first branch, jal or jalr (or the end of the text).
+// Successors are chained on first use so a hot loop goes from block to block without a lookup.
+typedef struct translated_block {
+    uint32_t start_pc;
+    uint32_t length;                        // instructions, including the terminator
+    size_t first_instruction;               // index into instructions_array
+    int last_line;                          // file line of the final instruction, for the call stack
+
+    uint32_t taken_pc;                      // target of the terminating branch / jal
+    uint32_t fallthrough_pc;                // pc after the block
+    struct translated_block* taken;
+    struct translated_block* fallthrough;
+
+    uint32_t executions;                    // counts up to JIT_THRESHOLD
+    native_block native;                    // compiled code, NULL until the block is hot
+
+    decoded_instruction ops[];
+} translated_block;
+
+size_t run_blocks(size_t limit);
+const char* run_engine_name();
+void flush_blocks();
+#endif
@@ -0,0 +1,113 @@
+#include "breakpoints.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "linker.h"
+#include "utils.h"
+
+uint64_t* breakpoint_bits = NULL;
+size_t breakpoint_limit = 0;
+size_t breakpoint_count = 0;
+
+static size_t* line_instructions = NULL;   // file line -> instruction number, 0 for none, file after file
+static size_t* line_bases = NULL;          // where each object's lines start in line_instructions
+
+// Called after a successful load: no breakpoints, and line tables for the new text
+void build_breakpoint_index(size_t instruction_count) {
+    free_breakpoint_index();
+
+    // instructions are stored in source order within an object, so its last one has its largest line
+    line_bases = malloc((object_count + 1) * sizeof(size_t));
+    if (line_bases == NULL) {
+        red("Memory allocation failed while indexing breakpoints!\n");
+        exit(EXIT_FAILURE);
+    }
+    line_bases[0] = 0;
+    for (size_t i = 0; i < object_count; i++) {
+        const object_file* object = &objects[i];
+        size_t lines = object->text_count ? object->lines[object->text_count - 1].file_line_num + 1 : 1;
+        line_bases[i + 1] = line_bases[i] + lines;
+    }
+
+    breakpoint_bits = calloc(instruction_count / 64 + 1, sizeof(uint64_t));
+    line_instructions = calloc(line_bases[object_count] + 1, sizeof(size_t));
+    if (breakpoint_bits == NULL || line_instructions == NULL) {
+        red("Memory allocation failed while indexing breakpoints!\n");
+        exit(EXIT_FAILURE);
+    }
+    breakpoint_limit = instruction_count;
+
+    for (size_t i = 0; i < object_count; i++) {
+        const object_file* object = &objects[i];
+        for (size_t j = 0; j < object->text_count; j++) {
+            line_instructions[line_bases[i] + object->lines[j].file_line_num] = object->first_instruction + j;
+        }
+    }
+}
+
+void free_breakpoint_index() {
+    free(breakpoint_bits);
+    free(line_instructions);
+    free(line_bases);
+    breakpoint_bits = NULL;
+    line_instructions = NULL;
+    line_bases = NULL;
+    breakpoint_limit = 0;
+    breakpoint_count = 0;
+}
+
+// Instruction on a line of one of the loaded files, or 0 if the line holds none
+size_t find_line_instruction(size_t object, int line) {
+    if (line_bases == NULL || object >= object_count || line <= 0 || (size_t)line >= line_bases[object + 1] - line_bases[object]) {
+        return 0;
+    }
+    return line_instructions[line_bases[object] + line];
+}
+
+_Bool has_breakpoint(size_t instruction) {
+    return breakpoint_at((instruction - 1) * 4);
+}
+
+void set_breakpoint(size_t instruction, _Bool enabled) {
+    size_t index = instruction - 1;
+    if (index >= breakpoint_limit) {
+        return;
+    }
+
+    uint64_t mask = 1ull << (index & 63);
+    bool was_set = (breakpoint_bits[index >> 6] & mask) != 0;
+    if (enabled && !was_set) {
+        breakpoint_bits[index >> 6] |= mask;
+        breakpoint_count++;
+    } else if (!enabled && was_set) {
+        breakpoint_bits[index >> 6] &= ~mask;
+        breakpoint_count--;
+    }
+}
+
+// Tests the bits of instructions first .. first + count - 1 a word at a time
+_Bool breakpoint_in_slots(size_t first, size_t count) {
+    if (first >= breakpoint_limit || count == 0) {
+        return false;
+    }
+    size_t last = first + count - 1;
+    if (last >= breakpoint_limit) {
+        last = breakpoint_limit - 1;
+    }
+
+    for (size_t word = first >> 6; word <= last >> 6; word++) {
+        uint64_t bits = breakpoint_bits[word];
+        if (word == first >> 6) {
+            bits &= ~0ull << (first & 63);
+        }
+        if (word == last >> 6) {
+            bits &= ~0ull >> (63 - (last & 63));
+        }
+        if (bits != 0) {
+            return true;
+        }
+    }
+    return false;
+}
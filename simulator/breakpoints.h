@@ -0,0 +1,31 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef BREAKPOINTS
+#define BREAKPOINTS
+
+// Breakpoints are one bit per instruction, indexed by pc / 4, so a whole block is checked with
+// a few word tests. Source lines are mapped to instructions through a table per file built at load.
+extern uint64_t* breakpoint_bits;
+extern size_t breakpoint_limit;     // instructions covered by breakpoint_bits
+extern size_t breakpoint_count;     // bits set, lets run skip every check while it is 0
+
+void build_breakpoint_index(size_t instruction_count);
+void free_breakpoint_index();
+size_t find_line_instruction(size_t object, int line);
+_Bool has_breakpoint(size_t instruction);
+void set_breakpoint(size_t instruction, _Bool enabled);
+_Bool breakpoint_in_slots(size_t first, size_t count);
+
+// Is there a breakpoint on the instruction at pc
+static inline _Bool breakpoint_at(uint32_t pc) {
+    size_t index = pc >> 2;
+    return breakpoint_count != 0 && (pc & 3) == 0 && index < breakpoint_limit &&
+           ((breakpoint_bits[index >> 6] >> (index & 63)) & 1);
+}
+
+// Is there a breakpoint on any of the `count` instructions starting at start_pc
+static inline _Bool breakpoint_in_range(uint32_t start_pc, size_t count) {
+    return breakpoint_count != 0 && breakpoint_in_slots(start_pc >> 2, count);
+}
+#endif
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,119 +6,189 @@
 #include <math.h>
 
 #include "cache.h"
+#include "cache_log.h"
 #include "utils.h"
 #include "assembler.h"
 
 
-void enable_cache(char* config_file_name) {
-   cache_enabled = false;
-   free_cache();     // always free cache since new cache structure is being given 
-
-
-   //first read the file and extract all data
-   //file_name not null verified in main
-   FILE *config_file = fopen(config_file_name, "r");
+#define CACHE_INDEXED_WAYS 16     // levels with more ways find lines through a hash of the block address
 
-   if (config_file == NULL) {
-      red("Error opening file %s.\n", config_file_name);
-      return;
-   }
+// One level as the config file gives it
+typedef struct cache_config {
+   int cache_size;
+   int block_size;
+   int associativity;
+   int rep_policy;
+   int write_policy;
+   int inclusion;       // with the level after it
+} cache_config;
 
-   int cache_size = 0;
-   int block_size = 0;
-   int associativity = 0;
+static _Bool is_power_of_two(int value) {
+   return value > 0 && (value & (value - 1)) == 0;
+}
 
-   int rep_policy;      // 0 is LRU, 1 is FIFO, 2 is RANDOM
-   int write_policy;    // 0 is write back, 1 is write through
+// Size, block size, associativity, replacement and write policy of one level, a line each. The
+// size has been read already, as size_str.
+static _Bool read_cache_config(FILE* config_file, const char* size_str, cache_config* config) {
+   char policy_str[256];
+   char write_str[256];
+   char extra;
 
-   // Read the first three lines as integers
-   if (fscanf(config_file, "%d", &cache_size) != 1) {
+   if (sscanf(size_str, "%d%c", &config->cache_size, &extra) != 1 ||
+       fscanf(config_file, "%d %d %255s %255s", &config->block_size, &config->associativity, policy_str, write_str) != 4) {
       red("Config file format invalid.\n");
-      fclose(config_file);
-      return;
+      return false;
    }
-   fgetc(config_file);  // Consume the newline character after the integer
 
-   if (fscanf(config_file, "%d", &block_size) != 1) {
-      red("Config file format invalid.\n");
-      fclose(config_file);
-      return;
+   // set rep_policy and write_policy
+   if (strcmp(policy_str, "LRU") == 0) {
+      config->rep_policy = 0;
+   } else if (strcmp(policy_str, "FIFO") == 0) {
+      config->rep_policy = 1;
+   } else if (strcmp(policy_str, "RANDOM") == 0) {
+      config->rep_policy = 2;
+   } else {
+      printf("%s\n", policy_str);
+      red("Invalid REPLACEMENT POLICY in config file.\n");
+      return false;
    }
-   fgetc(config_file);  // Consume the newline character after the integer
 
-   if (fscanf(config_file, "%d", &associativity) != 1) {
-      red("Config file format invalid.\n");
-      fclose(config_file);
-      return;
+   if (strcmp(write_str, "WB") == 0) {
+      config->write_policy = 0;
+   } else if (strcmp(write_str, "WT") == 0) {
+      config->write_policy = 1;
+   } else {
+      red("Invalid WRITE POLICY in config file.\n");
+      return false;
    }
-   fgetc(config_file);  // Consume the newline character after the integer
 
-   // Allocate memory for strings
-   char* policy_str = (char*)malloc(256 * sizeof(char));  
-   char* write_str = (char*)malloc(256 * sizeof(char));  
-   if (policy_str == NULL || write_str == NULL) {
-      red("Memory allocation failed in cache_enable.\n");
-      fclose(config_file);
-      return;
+   // before creating cache, check if it's fully associative
+   if (config->associativity == 0 && config->block_size > 0) {
+      config->associativity = config->cache_size / config->block_size;
+   }
+   if (!is_power_of_two(config->block_size) || config->associativity <= 0 || config->cache_size % (config->block_size * config->associativity) != 0 ||
+       !is_power_of_two(config->cache_size / (config->block_size * config->associativity))) {
+      red("Invalid cache geometry in config file.\n");
+      return false;
    }
+   return true;
+}
 
-   // Read the next two lines as strings
-   if (fgets(policy_str, 256, config_file) == NULL) {
-      red("Config file format invalid.\n");
-      free(policy_str);
-      free(write_str);
-      fclose(config_file);
-      return;
+// Reads the levels of a config file into configs, and returns how many there are, 0 if the file
+// is invalid. When unified isn't NULL the file may end in UNIFIED in place of a level.
+static int read_cache_levels(const char* config_file_name, cache_config* configs, _Bool* unified) {
+   //file_name not null verified in main
+   FILE *config_file = fopen(config_file_name, "r");
+
+   if (config_file == NULL) {
+      red("Error opening file %s.\n", config_file_name);
+      return 0;
    }
 
-   if (fgets(write_str, 256, config_file) == NULL) {
+   int level_count = 0;
+   char token[256];
+   if (fscanf(config_file, "%255s", token) != 1) {
       red("Config file format invalid.\n");
-      free(policy_str);
-      free(write_str);
       fclose(config_file);
-      return;
+      return 0;
    }
+   while (true) {
+      if (level_count == MAX_CACHE_LEVELS) {
+         red("At most %d cache levels are supported.\n", MAX_CACHE_LEVELS);
+         fclose(config_file);
+         return 0;
+      }
+      cache_config* config = &configs[level_count++];
+      if (!read_cache_config(config_file, token, config)) {
+         fclose(config_file);
+         return 0;
+      }
 
-   // set rep_policy and write_policy
-   if (strcmp(policy_str, "LRU\n") == 0) {
-      rep_policy = 0;
-   } else if (strcmp(policy_str, "FIFO\n") == 0) {
-      rep_policy = 1;
-   } else if (strcmp(policy_str, "RANDOM\n") == 0) {
-      rep_policy = 2;
-   } else {
-      printf("%s\n", policy_str);
-      red("Invalid REPLACEMENT POLICY in config file.\n");
-      return;
-   }
+      config->inclusion = INCLUSION_NINE;
+      if (fscanf(config_file, "%255s", token) != 1) {
+         break;
+      }
+      if (strcmp(token, "INCLUSIVE") == 0) {
+         config->inclusion = INCLUSION_INCLUSIVE;
+      } else if (strcmp(token, "EXCLUSIVE") == 0) {
+         config->inclusion = INCLUSION_EXCLUSIVE;
+      } else if (strcmp(token, "NINE") != 0) {
+         red("Invalid INCLUSION POLICY in config file.\n");
+         fclose(config_file);
+         return 0;
+      }
 
-   if (strcmp(write_str, "WB\n") == 0 || strcmp(write_str, "WB") == 0) {
-      write_policy = 0;
-   } else if (strcmp(write_str, "WT\n") == 0 || strcmp(write_str, "WT") == 0) {
-      write_policy = 1;
-   } else {
-      red("Invalid WRITE POLICY in config file.\n");
-      return;      
+      if (fscanf(config_file, "%255s", token) != 1) {
+         red("Config file format invalid.\n");
+         fclose(config_file);
+         return 0;
+      }
+      if (unified != NULL && strcmp(token, "UNIFIED") == 0) {
+         *unified = true;
+         break;
+      }
    }
 
-   //printf("C=%d, B=%d, A=%d, Rep=%d, Wri=%d\n", cache_size, block_size, associativity, rep_policy, write_policy);
-
    // Close the file after reading
    fclose(config_file);
-   free(policy_str);
-   free(write_str);
+   return level_count;
+}
 
-   // before creating cache, check if it's fully associative
-   if(associativity == 0) {
-      associativity = cache_size / block_size;
+// A block filled from below must fit in the level's blocks; one moving between exclusive levels
+// must be the same size, and a write through the level above would leave a copy below. suffix
+// follows the level numbers in messages.
+static _Bool check_cache_levels(const cache_config* configs, int level_count, const char* suffix) {
+   for (int i = 1; i < level_count; i++) {
+      const cache_config* above = &configs[i - 1];
+      if (configs[i].block_size < above->block_size) {
+         red("L%d%s's block size must be at least that of L%d%s.\n", i + 1, suffix, i, suffix);
+         return false;
+      }
+      if (above->inclusion == INCLUSION_EXCLUSIVE && (configs[i].block_size != above->block_size || above->write_policy == 1)) {
+         red("L%d%s can only be exclusive of L%d%s with the same block size and L%d%s write back.\n", i + 1, suffix, i, suffix, i, suffix);
+         return false;
+      }
    }
+   return true;
+}
 
-   create_cache(cache_size, block_size, associativity, rep_policy, write_policy);
-   if(!cache_output_file) {
-      if(current_file_name) {
-         open_cache_output_file(current_file_name);
+// Creates the levels and links each to the next; returns the top one
+static cache_struct* create_cache_levels(const cache_config* configs, int level_count, _Bool instructions) {
+   cache_struct* top = NULL;
+   cache_struct* above = NULL;
+   for (int i = 0; i < level_count; i++) {
+      const cache_config* config = &configs[i];
+      cache_struct* level = create_cache(config->cache_size, config->block_size, config->associativity, config->rep_policy, config->write_policy);
+      level->inclusion = config->inclusion;
+      level->level = i + 1;
+      level->instructions = instructions;
+      if (above == NULL) {
+         top = level;
+      } else {
+         above->next = level;
+         level->above[level->above_count++] = above;
       }
+      above = level;
    }
+   return top;
+}
+
+// The config file describes the levels from L1 down. A level is five lines: cache size, block
+// size, associativity (0 for fully associative), LRU/FIFO/RANDOM and WB/WT. Between two levels a
+// line of INCLUSIVE, EXCLUSIVE or NINE says how they relate, so a file with a single level reads
+// as it always has.
+void enable_cache(char* config_file_name) {
+   cache_enabled = false;
+   free_cache();     // always free cache since new cache structure is being given 
+
+
+   //first read the file and extract all data
+   cache_config configs[MAX_CACHE_LEVELS];
+   int level_count = read_cache_levels(config_file_name, configs, NULL);
+   if (level_count == 0 || !check_cache_levels(configs, level_count, "")) {
+      return;
+   }
+   cache = create_cache_levels(configs, level_count, false);
    cache_enabled = true;
 }
 
@@ -127,211 +198,345 @@ void disable_cache() {
    free_cache();
 }
 
+// The I-cache's config file has the same form. It may end with UNIFIED in place of a level: the
+// I-cache then shares the D-cache's levels from there down, the line before saying how its last
+// level relates to them.
+void enable_icache(char* config_file_name) {
+   icache_enabled = false;
+   free_icache();
+
+   cache_config configs[MAX_CACHE_LEVELS];
+   _Bool unified = false;
+   int level_count = read_cache_levels(config_file_name, configs, &unified);
+   if (level_count == 0 || !check_cache_levels(configs, level_count, "I")) {
+      return;
+   }
+
+   cache_struct* shared = NULL;
+   if (unified) {
+      shared = cache_enabled ? cache : NULL;
+      for (int i = 0; i < level_count && shared != NULL; i++) {
+         shared = shared->next;
+      }
+      const cache_config* last = &configs[level_count - 1];
+      if (shared == NULL) {
+         red("A unified L%d needs the D-cache enabled with at least %d levels.\n", level_count + 1, level_count + 1);
+         return;
+      }
+      if (shared->block_size < last->block_size) {
+         red("L%d's block size must be at least that of L%dI.\n", level_count + 1, level_count);
+         return;
+      }
+      // the block would move up out of the D-cache's reach
+      if (last->inclusion == INCLUSION_EXCLUSIVE) {
+         red("L%dI can't be exclusive of the unified L%d.\n", level_count, level_count + 1);
+         return;
+      }
+   }
+
+   icache = create_cache_levels(configs, level_count, true);
+   if (shared != NULL) {
+      cache_struct* last = icache;
+      while (last->next != NULL) {
+         last = last->next;
+      }
+      last->next = shared;
+      shared->above[shared->above_count++] = last;
+   }
+   icache_enabled = true;
+}
+
+void disable_icache() {
+   icache_enabled = false;
+   free_icache();
+}
+
+static void print_level_status(const cache_struct* level) {
+   printf("Cache Size: %d\n", level->cache_size);
+   printf("Block Size: %d\n", level->block_size);
+   printf("Associativity: %d\n", level->associativity);
+
+   printf("Replacement Policy: ");
+   switch(level->rep_policy) {
+      case 0:
+         printf("LRU\n");
+         break;
+      case 1:
+         printf("FIFO\n");
+         break;
+      case 2:
+         printf("RANDOM\n");
+         break;
+   }
+
+   printf("Write Back Policy: ");
+   switch(level->write_policy) {
+      case 0:
+         printf("WB\n");
+         break;
+      case 1:
+         printf("WT\n");
+         break;
+   }
+}
+
+static void print_levels_status(const cache_struct* top, const char* suffix) {
+   static const char* inclusion_names[] = {"NINE", "INCLUSIVE", "EXCLUSIVE"};
+   for(const cache_struct* level = top; level != NULL; level = level->next) {
+      if(level->instructions != top->instructions) {
+         // unified, shown with the D-cache
+         break;
+      }
+      printf("L%d%s:\n", level->level, suffix);
+      print_level_status(level);
+      if(level->next != NULL) {
+         const char* next_suffix = level->next->instructions ? suffix : "";
+         printf("L%d%s to L%d%s: %s\n", level->level, suffix, level->next->level, next_suffix, inclusion_names[level->inclusion]);
+      }
+   }
+}
+
 void output_cache_status() {
+   if(!cache_enabled && !icache_enabled) {
+      printf("Cache disabled\n");
+      return;
+   }
+
    if(cache_enabled) {
-      printf("Cache Size: %d\n", cache->cache_size);
-      printf("Block Size: %d\n", cache->block_size);
-      printf("Associativity: %d\n", cache->associativity);
-
-      printf("Replacement Policy: ");
-      switch(cache->rep_policy) {
-         case 0:
-            printf("LRU\n");
-            break;
-         case 1:
-            printf("FIFO\n");
-            break;
-         case 2:
-            printf("RANDOM\n");
-            break;
-      }
-
-      printf("Write Back Policy: ");
-      switch(cache->write_policy) {
-         case 0:
-            printf("WB\n");
-            break;
-         case 1:
-            printf("WT\n");
-            break;
+      if(cache->next == NULL) {
+         print_level_status(cache);
+      } else {
+         print_levels_status(cache, "");
+      }
+   }
+
+   if(icache_enabled) {
+      printf("I-cache:\n");
+      if(icache->next == NULL) {
+         print_level_status(icache);
+      } else {
+         print_levels_status(icache, "I");
       }
-   } else {
-      printf("Cache disabled\n");
    }
 }
 
-void free_cache() {
-   if (cache == NULL) {
-     return;  // No cache to wipe
+static void free_level(cache_struct* level) {
+   int no_of_sets = level->cache_size / (level->block_size * level->associativity);
+   for (int i = 0; i < no_of_sets; i++) {
+      for (int j = 0; j < level->associativity; j++) {
+         free(level->sets[i].lines[j].block);
+      }
+      free(level->sets[i].lines);
    }
+   free(level->sets);
+   free(level->incoming);
+   free(level->tag_index);
+   free(level);
+}
 
-   int no_of_sets = (int)pow((double)2, (double)cache->index_length);
-   // Free each cache set, 
-   if (cache->sets != NULL) {
-      for (int i = 0; i < no_of_sets; i++) {
-         cache_set *set = &cache->sets[i];
+// The I-cache's levels, up to the first unified one
+static _Bool icache_is_unified() {
+   const cache_struct* level = icache;
+   while (level != NULL && level->instructions) {
+      level = level->next;
+   }
+   return level != NULL;
+}
 
-         // Free each cache line
-         if (set->lines != NULL) {
-            for (int j = 0; j < cache->associativity; j++) {
-               cache_line *line = &set->lines[j];
+void free_cache() {
+   // an I-cache sharing the levels can't outlive them
+   if (icache_is_unified()) {
+      disable_icache();
+      printf("I-cache disabled along with the D-cache levels it shared.\n");
+   }
 
-               // Free the block memory for each line
-               if (line->block != NULL) {
-                  free(line->block);
-                  line->block = NULL;  
-               }
-            }
+   while (cache != NULL) {
+      cache_struct* level = cache;
+      cache = level->next;
+      free_level(level);
+   }
+}
 
-            free(set->lines);
-            set->lines = NULL;  
+void free_icache() {
+   while (icache != NULL && icache->instructions) {
+      cache_struct* level = icache;
+      icache = level->next;
+
+      if (icache != NULL && !icache->instructions) {
+         // the unified level stops filling it
+         for (int i = 0; i < icache->above_count; i++) {
+            if (icache->above[i] == level) {
+               icache->above[i] = icache->above[--icache->above_count];
+               break;
+            }
          }
       }
-
-      free(cache->sets);
-      cache->sets = NULL;  
+      free_level(level);
    }
+   icache = NULL;
+}
 
-   free(cache);
-   cache = NULL;  // Set cache pointer to NULL after freeing
+// Back to an empty level's order: the sets' recency order by way, as when all timestamps are
+// equal, and no line in tag_index
+static void reset_level_order(cache_struct* level) {
+   int no_of_sets = level->cache_size / (level->block_size * level->associativity);
+   for (int i = 0; i < no_of_sets; i++) {
+      cache_set* set = &level->sets[i];
+      for (int j = 0; j < level->associativity; j++) {
+         set->lines[j].older = j - 1;
+         set->lines[j].newer = j + 1 < level->associativity ? j + 1 : -1;
+         set->lines[j].next_indexed = -1;
+      }
+      set->oldest = 0;
+      set->newest = level->associativity - 1;
+   }
+   if (level->tag_index != NULL) {
+      memset(level->tag_index, 0xFF, ((size_t)1 << (32 - level->tag_index_shift)) * sizeof(int));
+   }
 }
 
-void create_cache(int cache_size, int block_size, int associativity, int rep_policy, int write_policy) {
+// One level, not yet linked to others
+cache_struct* create_cache(int cache_size, int block_size, int associativity, int rep_policy, int write_policy) {
 
    // Initialize the cache structure
-   cache = (cache_struct*)malloc(sizeof(cache_struct));
-   cache->cache_size = cache_size;
-   cache->block_size = block_size;
-   cache->associativity = associativity;
-   cache->rep_policy = rep_policy;
-   cache->write_policy = write_policy;
-
-   // All stats are zero in the beginning
-   cache->accesses = 0;
-   cache->hits = 0;
-   cache->misses = 0;
+   cache_struct* level = (cache_struct*)calloc(1, sizeof(cache_struct));
+   if (level == NULL) {
+      red("Memory allocation failed while creating the cache!\n");
+      exit(EXIT_FAILURE);
+   }
+   level->cache_size = cache_size;
+   level->block_size = block_size;
+   level->associativity = associativity;
+   level->rep_policy = rep_policy;
+   level->write_policy = write_policy;
+   level->inclusion = INCLUSION_NINE;
+   level->level = 1;
 
    // Calculate index, tag, and offset lengths
-   cache->offset_length = (int)log2(block_size); // Number of bits for block offset
-   cache->index_length = (int)log2(cache_size / (block_size * associativity)); // Index bits
-   cache->tag_length = 20 - cache->index_length - cache->offset_length; // Remaining bits for the tag
+   level->offset_length = (int)log2(block_size); // Number of bits for block offset
+   level->index_length = (int)log2(cache_size / (block_size * associativity)); // Index bits
+   level->tag_length = 32 - level->index_length - level->offset_length; // Remaining bits for the tag
 
    // Allocate memory for cache sets
    int num_sets = cache_size / (block_size * associativity);
-   cache->sets = (cache_set*)malloc(num_sets * sizeof(cache_set));
+   level->sets = (cache_set*)malloc(num_sets * sizeof(cache_set));
+   if (level->sets == NULL) {
+      red("Memory allocation failed while creating the cache!\n");
+      exit(EXIT_FAILURE);
+   }
 
-   // Initialize each cache set
+   // Initialize each cache line; all zero is invalid and never used
    for (int i = 0; i < num_sets; i++) {
-      cache->sets[i].lines = (cache_line*)malloc(associativity * sizeof(cache_line));
-
-      // Initialize each cache line
+      level->sets[i].lines = (cache_line*)calloc(associativity, sizeof(cache_line));
+      if (level->sets[i].lines == NULL) {
+         red("Memory allocation failed while creating the cache!\n");
+         exit(EXIT_FAILURE);
+      }
       for (int j = 0; j < associativity; j++) {
-         cache->sets[i].lines[j].tag = 0;
-         cache->sets[i].lines[j].block = (uint8_t*)malloc(block_size * sizeof(uint8_t));  // Allocate block memory
-         cache->sets[i].lines[j].valid = 0;
-         cache->sets[i].lines[j].dirty = 0;
-         cache->sets[i].lines[j].last_use_time = 0;
-         cache->sets[i].lines[j].arrival_time = 0;
+         level->sets[i].lines[j].block = (uint8_t*)malloc(block_size * sizeof(uint8_t));  // Allocate block memory
+         if (level->sets[i].lines[j].block == NULL) {
+            red("Memory allocation failed while creating the cache!\n");
+            exit(EXIT_FAILURE);
+         }
       }
    }
 
-   // printf("Cache Initialized:\n");
-   // printf("Cache Size: %d bytes\n", cache_size);
-   // printf("Block Size: %d bytes\n", block_size);
-   // printf("Associativity: %d\n", associativity);
-   // printf("Replacement Policy: %d\n", rep_policy);
-   // printf("Write Policy: %d\n", write_policy);
-   // printf("Index Length: %d bits\n", cache->index_length);
-   // printf("Tag Length: %d bits\n", cache->tag_length);
-   // printf("Offset Length: %d bits\n", cache->offset_length);
-}
+   level->incoming = (uint8_t*)malloc(block_size * sizeof(uint8_t));
+   if (level->incoming == NULL) {
+      red("Memory allocation failed while creating the cache!\n");
+      exit(EXIT_FAILURE);
+   }
 
-// Function to clear cache lines when new file is loaded(set valid bit to 0)
-void clear_cache() {
-   if (cache == NULL) {
-      return; // If cache is not initialized, do nothing
+   // a bucket per line or more, so lookups don't scan the ways
+   if (associativity > CACHE_INDEXED_WAYS) {
+      int bits = 1;
+      while ((1 << bits) < num_sets * associativity) {
+         bits++;
+      }
+      level->tag_index_shift = 32 - bits;
+      level->tag_index = (int*)malloc(((size_t)1 << bits) * sizeof(int));
+      if (level->tag_index == NULL) {
+         red("Memory allocation failed while creating the cache!\n");
+         exit(EXIT_FAILURE);
+      }
    }
+   reset_level_order(level);
+   return level;
+}
 
-   int no_of_sets = cache->cache_size / (cache->block_size * cache->associativity);
+static void clear_level(cache_struct* level) {
+   int no_of_sets = level->cache_size / (level->block_size * level->associativity);
    // Iterate over all cache sets
    for (int i = 0; i < no_of_sets; i++) {
       // Iterate over each cache line in the set
-      for (int j = 0; j < cache->associativity; j++) {
+      for (int j = 0; j < level->associativity; j++) {
          // Set the valid bit to 0 (invalidate the cache line)
-         cache->sets[i].lines[j].valid = 0;
-         cache->sets[i].lines[j].arrival_time = 0;
-         cache->sets[i].lines[j].last_use_time = 0;
-         cache->sets[i].lines[j].dirty = 0;
+         level->sets[i].lines[j].valid = 0;
+         level->sets[i].lines[j].dirty = 0;
       }
    }
 
-   cache->accesses = 0;
-   cache->hits = 0;
-   cache->misses = 0;
+   reset_level_order(level);
 
+   level->accesses = 0;
+   level->hits = 0;
+   level->misses = 0;
+   level->writebacks = 0;
 }
 
-void open_cache_output_file(char* file_name) {
-   char input_filename[256];  // don't mutate the file_name
-   strcpy(input_filename, file_name);
-
-   
-   char output_filename[256];  
-
-   char *dot_pos = strrchr(input_filename, '.');
-   if (dot_pos != NULL) {
-      // Terminate the string at the dot to remove the extension and append ".output"
-      *dot_pos = '\0';
-   }
-
-   // Append ".output" to the modified filename
-   strcpy(output_filename, input_filename);
-   strcat(output_filename, ".output");
-
-   if(cache_output_file) {
-      // close the previous file if not closed. 
-      fclose(cache_output_file);
-      cache_output_file = NULL;
+// Function to clear cache lines when new file is loaded(set valid bit to 0)
+void clear_cache() {
+   for (cache_struct* level = cache; level != NULL; level = level->next) {
+      clear_level(level);
    }
-
-   cache_output_file = fopen(output_filename, "w");
-
-   if (cache_output_file == NULL) {
-      red("Error opening cache output file\n");
-      return;
+   for (cache_struct* level = icache; level != NULL && level->instructions; level = level->next) {
+      clear_level(level);
    }
-
 }
 
-void cache_invalidate() {
-   // first write back dirty blocks, and use clear_cache();
-   if(!cache_enabled) {
-      printf("Cache disabled\n");
-      return;
-   }
-
-   int no_of_sets = cache->cache_size/(cache->associativity * cache->block_size);
+// Write the level's dirty blocks back to memory and empty it
+static void flush_level(cache_struct* level) {
+   int no_of_sets = level->cache_size/(level->associativity * level->block_size);
 
    for(int index = 0; index < no_of_sets; index++) {
-      for(int j = 0; j < cache->associativity; j++){
-         cache_line* current_line = &cache->sets[index].lines[j];
+      for(int j = 0; j < level->associativity; j++){
+         cache_line* current_line = &level->sets[index].lines[j];
 
          if(current_line->valid) {
             // if current line is valid, write it back and set it to zero
-            if(cache->write_policy == 0 && current_line->dirty) {
-               uint32_t address = (current_line->tag << (cache->index_length + cache->offset_length)) | (index << cache->offset_length);
-               for(int i = 0; i < cache->block_size; i++) {
-                  write_memory_byte(address + i, current_line->block[i]);
-               }
+            if(current_line->dirty) {
+               uint32_t address = (current_line->tag << (level->index_length + level->offset_length)) | (index << level->offset_length);
+               write_memory_block(address, current_line->block, level->block_size);
             }
 
-            current_line->arrival_time = 0;
-            current_line->last_use_time = 0;
             current_line->dirty = 0;
             current_line->valid = 0;
          }
       }
    }
+   reset_level_order(level);
+}
+
+// Write every dirty block back and empty the whole hierarchy. Lower levels go first: a block
+// dirty in two levels is newer in the upper one.
+void cache_invalidate() {
+   if(!cache_enabled && !icache_enabled) {
+      printf("Cache disabled\n");
+      return;
+   }
+
+   for(int depth = MAX_CACHE_LEVELS; depth >= 1; depth--) {
+      for(cache_struct* level = cache; level != NULL; level = level->next) {
+         if(level->level == depth) {
+            flush_level(level);
+         }
+      }
+      for(cache_struct* level = icache; level != NULL && level->instructions; level = level->next) {
+         if(level->level == depth) {
+            flush_level(level);
+         }
+      }
+   }
 }
 
 int64_t get_data_for_register(uint32_t address, uint8_t funct3) {
@@ -394,280 +599,447 @@ int64_t get_data_for_register(uint32_t address, uint8_t funct3) {
 
 }
 
-uint8_t *read_cache(uint32_t address) {
-   // check for hit
-   cache->accesses++;
-   int index = (address >> cache->offset_length) & ((1 << cache->index_length) - 1);
-   uint32_t tag = (address >> (cache->offset_length + cache->index_length)) & ((1 << cache->tag_length) - 1);
-
-   for (int i = 0; i < cache->associativity; i++) {
-      if (cache->sets[index].lines[i].valid && cache->sets[index].lines[i].tag == tag) {
-         cache->hits++;
-         cache->sets[index].lines[i].last_use_time = cache->accesses;
-
-         if (cache->sets[index].lines[i].dirty == 0) 
-            fprintf(cache_output_file, "R: Address: 0x%X, Set: 0x%X, Hit, Tag: 0x%X, Clean\n", address, index, tag);
-         else 
-            fprintf(cache_output_file, "R: Address: 0x%X, Set: 0x%X, Hit, Tag: 0x%X, Dirty\n", address, index, tag);
-
-         fflush(cache_output_file);
-         return cache->sets[index].lines[i].block;
-      }
-   }
+static inline int set_index(const cache_struct* level, uint32_t address) {
+   return (address >> level->offset_length) & ((1 << level->index_length) - 1);
+}
 
+static inline uint32_t address_tag(const cache_struct* level, uint32_t address) {
+   return (uint64_t)address >> (level->offset_length + level->index_length);
+}
 
-   // cache read miss
+static inline uint32_t line_address(const cache_struct* level, int index, const cache_line* line) {
+   return ((uint64_t)line->tag << (level->offset_length + level->index_length)) | (index << level->offset_length);
+}
 
-   cache->misses++;
+static inline int tag_index_bucket(const cache_struct* level, uint32_t address) {
+   return ((address >> level->offset_length) * 0x9E3779B1u) >> level->tag_index_shift;
+}
 
-   // rep_policy --> 0 is LRU, 1 is FIFO, 2 is RANDOM
-   // write_policy --> 0 is write back, 1 is write through 
+static inline cache_line* indexed_line(cache_struct* level, int id) {
+   return &level->sets[id / level->associativity].lines[id % level->associativity];
+}
 
-   int replacement_line = 0;
-   int min_of_line;
-   
+static cache_line* find_line(cache_struct* level, uint32_t address) {
+   int index = set_index(level, address);
+   cache_set* set = &level->sets[index];
+   uint32_t tag = address_tag(level, address);
 
-   if (cache->rep_policy == 0){
-      min_of_line = cache->sets[index].lines[0].last_use_time;
-      for (int i = 0; i < cache->associativity; i++) {
-         if (cache->sets[index].lines[i].last_use_time < min_of_line) {
-            min_of_line = cache->sets[index].lines[i].last_use_time;
-            replacement_line = i;
+   if (level->tag_index != NULL) {
+      for (int id = level->tag_index[tag_index_bucket(level, address)]; id != -1; ) {
+         cache_line* line = indexed_line(level, id);
+         if (line->tag == tag && id / level->associativity == index) {
+            return line;
          }
+         id = line->next_indexed;
       }
+      return NULL;
    }
-   else if (cache->rep_policy == 1) {
-      min_of_line = cache->sets[index].lines[0].arrival_time;
-      for (int i = 0; i < cache->associativity; i++) {
-         if (cache->sets[index].lines[i].arrival_time < min_of_line) {
-            min_of_line = cache->sets[index].lines[i].arrival_time;
-            replacement_line = i;
-         }
+
+   for (int i = 0; i < level->associativity; i++) {
+      if (set->lines[i].valid && set->lines[i].tag == tag) {
+         return &set->lines[i];
       }
    }
-   else if (cache->rep_policy == 2) {
-      replacement_line = rand() % cache->associativity;
+   return NULL;
+}
+
+// Each set keeps its ways in recency order, a list through the lines from oldest to newest, so a
+// miss takes the oldest without looking at the others. Invalid lines are kept at the oldest end.
+static void unlink_line(cache_set* set, cache_line* line) {
+   if (line->older == -1) {
+      set->oldest = line->newer;
+   } else {
+      set->lines[line->older].newer = line->newer;
+   }
+   if (line->newer == -1) {
+      set->newest = line->older;
+   } else {
+      set->lines[line->newer].older = line->older;
    }
+}
 
-   if (cache->write_policy == 0 && cache->sets[index].lines[replacement_line].dirty && cache->sets[index].lines[replacement_line].valid) {
-      uint32_t address = (cache->sets[index].lines[replacement_line].tag << (cache->offset_length + cache->index_length) | (index << cache->offset_length));
-      for (int i = 0; i < cache->block_size; i++) 
-         write_memory_byte(address + i, cache->sets[index].lines[replacement_line].block[i]);
+static void make_newest(cache_set* set, cache_line* line) {
+   int way = line - set->lines;
+   if (set->newest == way) {
+      return;
    }
 
-   cache->sets[index].lines[replacement_line].arrival_time = cache->accesses;
-   cache->sets[index].lines[replacement_line].last_use_time = cache->accesses;
-   cache->sets[index].lines[replacement_line].tag = tag;
-   cache->sets[index].lines[replacement_line].valid = 1;
-   cache->sets[index].lines[replacement_line].dirty = 0;
+   unlink_line(set, line);
+   line->older = set->newest;
+   line->newer = -1;
+   set->lines[set->newest].newer = way;
+   set->newest = way;
+}
 
-   uint32_t block_addr = (cache->sets[index].lines[replacement_line].tag << (cache->offset_length + cache->index_length) | (index << cache->offset_length));
+static void make_oldest(cache_set* set, cache_line* line) {
+   int way = line - set->lines;
+   if (set->oldest == way) {
+      return;
+   }
 
-   for (int i = 0; i < cache->block_size; i++) 
-         cache->sets[index].lines[replacement_line].block[i] = read_memory_byte(block_addr + i);
+   unlink_line(set, line);
+   line->newer = set->oldest;
+   line->older = -1;
+   set->lines[set->oldest].older = way;
+   set->oldest = way;
+}
 
+// A hit on the line
+static void touch_line(cache_struct* level, int index, cache_line* line) {
+   if (level->rep_policy == 0) {
+      make_newest(&level->sets[index], line);
+   }
+}
 
-   fprintf(cache_output_file, "R: Address: 0x%X, Set: 0x%X, Miss, Tag: 0x%X, Clean\n", address, index, tag);
-   fflush(cache_output_file);
-   return cache->sets[index].lines[replacement_line].block;
+// The line now holds the block of address
+static void fill_line(cache_struct* level, int index, cache_line* line, uint32_t address) {
+   line->tag = address_tag(level, address);
+   line->valid = 1;
+   make_newest(&level->sets[index], line);
 
-   // 
+   if (level->tag_index != NULL) {
+      int bucket = tag_index_bucket(level, address);
+      line->next_indexed = level->tag_index[bucket];
+      level->tag_index[bucket] = index * level->associativity + (line - level->sets[index].lines);
+   }
 }
 
-void write_cache(uint32_t address, uint64_t data, int size) {
-   //check for hit
-   int offset = address & ((1 << cache->offset_length) - 1);
-   int index = (address >> cache->offset_length) & ((1 << cache->index_length) - 1);
-   uint32_t tag = (address >> (cache->offset_length + cache->index_length)) & ((1 << cache->tag_length) - 1);
+// The line no longer holds its block, and is the first to be filled again
+static void drop_line(cache_struct* level, int index, cache_line* line) {
+   if (line->valid && level->tag_index != NULL) {
+      int id = index * level->associativity + (line - level->sets[index].lines);
+      int* link = &level->tag_index[tag_index_bucket(level, line_address(level, index, line))];
+      while (*link != id) {
+         link = &indexed_line(level, *link)->next_indexed;
+      }
+      *link = line->next_indexed;
+      line->next_indexed = -1;
+   }
+   line->valid = 0;
+   line->dirty = 0;
+   make_oldest(&level->sets[index], line);
+}
 
+// The line a miss in the set replaces: a free way if there is one, since lines can be dropped
+// mid-run by a block moving up or by back-invalidation. Free ways are the oldest.
+static cache_line* choose_victim(cache_struct* level, int index) {
+   cache_set* set = &level->sets[index];
+   cache_line* oldest = &set->lines[set->oldest];
 
    // rep_policy --> 0 is LRU, 1 is FIFO, 2 is RANDOM
-   // write_policy --> 0 is write back, 1 is write through 
-   cache->accesses++;
-   for (int i = 0; i < cache->associativity; i++) {
-      if (cache->sets[index].lines[i].valid && cache->sets[index].lines[i].tag == tag) {
-         cache->hits++;
-         cache->sets[index].lines[i].last_use_time = cache->accesses;
-
-         if (cache->write_policy == 0) {
-            cache->sets[index].lines[i].dirty = 1;
-            for (int j = 0; j < size; j++)
-               cache->sets[index].lines[i].block[offset + j] = (data >> (j * 8)) & 0xFF;
-         }
-         else if (cache->write_policy == 1) {
-            for (int j = 0; j < size; j++)
-               cache->sets[index].lines[i].block[offset + j] = (data >> (j * 8)) & 0xFF;
-
-            for (int j = 0; j < size; j++)
-               write_memory_byte(address + j, (data >> (j * 8)) & 0xFF);
-         }
+   if (oldest->valid && level->rep_policy == 2) {
+      return &set->lines[rand() % level->associativity];
+   }
+   return oldest;
+}
 
-         if (cache->sets[index].lines[i].dirty == 0) 
-            fprintf(cache_output_file, "W: Address: 0x%X, Set: 0x%X, Hit, Tag: 0x%X, Clean\n", address, index, tag);
-         else 
-            fprintf(cache_output_file, "W: Address: 0x%X, Set: 0x%X, Hit, Tag: 0x%X, Dirty\n", address, index, tag);
+static void write_level(cache_struct* level, uint32_t address, const uint8_t* bytes, int size);
+static cache_line* allocate_line(cache_struct* level, uint32_t address);
+static void evict_line_at(cache_struct* level, int index, cache_line* line);
 
-         fflush(cache_output_file);
-         return;
-      }
+// A write leaving the level: a writeback or a store written through
+static void write_below(cache_struct* level, uint32_t address, const uint8_t* bytes, int size) {
+   if (level->next == NULL) {
+      write_memory_block(address, bytes, size);
+   } else {
+      write_level(level->next, address, bytes, size);
    }
+}
 
-   cache->misses++;
-   int replacement_line = 0;
-   int min_of_line;
-
-   if (cache->rep_policy == 0){
-      min_of_line = cache->sets[index].lines[0].last_use_time;
-      for (int i = 0; i < cache->associativity; i++) {
-         if (cache->sets[index].lines[i].last_use_time < min_of_line) {
-            replacement_line = i;
-            min_of_line = cache->sets[index].lines[i].last_use_time;
-         }
+static void take_back_from_above(cache_struct* level, uint32_t address, int size, cache_line* line);
+
+// Back-invalidation: an inclusive level giving up a block first takes its parts out of the level
+// above, with anything written to them there, into line
+static void take_back_block(cache_struct* upper, uint32_t address, int size, cache_line* line) {
+   for (uint32_t block = address; block - address < (uint32_t)size; block += upper->block_size) {
+      cache_line* copy = find_line(upper, block);
+      if (copy == NULL) {
+         continue;
       }
-   }
-   else if (cache->rep_policy == 1) {
-      min_of_line = cache->sets[index].lines[0].arrival_time;
-      for (int i = 0; i < cache->associativity; i++) {
-         if (cache->sets[index].lines[i].arrival_time < min_of_line) {
-            replacement_line = i;
-            min_of_line = cache->sets[index].lines[i].arrival_time;
-         }
+      take_back_from_above(upper, block, upper->block_size, copy);
+      if (copy->dirty) {
+         memcpy(line->block + (block - address), copy->block, upper->block_size);
+         line->dirty = 1;
       }
+      drop_line(upper, set_index(upper, block), copy);
    }
-   else if (cache->rep_policy == 2) {
-      replacement_line = rand() % cache->associativity;
-   }
-
-   if (cache->write_policy == 0 && cache->sets[index].lines[replacement_line].dirty && cache->sets[index].lines[replacement_line].valid) {
-      uint32_t address = ((cache->sets[index].lines[replacement_line].tag << (cache->offset_length + cache->index_length)) | (index << cache->offset_length));
-      for (int i = 0; i < cache->block_size; i++) 
-         write_memory_byte(address + i, cache->sets[index].lines[replacement_line].block[i]);
-   }
-
-   // for write back, also do allocate when miss
-   if (cache->write_policy == 0) {
-      cache->sets[index].lines[replacement_line].arrival_time = cache->accesses;
-      cache->sets[index].lines[replacement_line].dirty = 1;
-      cache->sets[index].lines[replacement_line].last_use_time = cache->accesses;
-      cache->sets[index].lines[replacement_line].tag = tag;
-      cache->sets[index].lines[replacement_line].valid = 1;
-
-      uint32_t block_addr = ((cache->sets[index].lines[replacement_line].tag << (cache->offset_length + cache->index_length)) | (index << cache->offset_length));
-      for (int i = 0; i < cache->block_size; i++) 
-            cache->sets[index].lines[replacement_line].block[i] = read_memory_byte(block_addr + i);
-
-      for (int i = 0; i < size; i++)
-         cache->sets[index].lines[replacement_line].block[offset + i] = ((data >> (i * 8)) & 0xFF);
+}
 
+// The same for every level above that's inclusive of this one; a unified level has two
+static void take_back_from_above(cache_struct* level, uint32_t address, int size, cache_line* line) {
+   for (int i = 0; i < level->above_count; i++) {
+      if (level->above[i]->inclusion == INCLUSION_INCLUSIVE) {
+         take_back_block(level->above[i], address, size, line);
+      }
    }
-   else if (cache->write_policy == 1) {
-      // very few lines since no allocate
-      for (int i = 0; i < size; i++)
-         write_memory_byte(address + i, (data >> (i * 8)) & 0xFF);
-   }
-
-   if (cache->sets[index].lines[replacement_line].dirty == 0) 
-      fprintf(cache_output_file, "W: Address: 0x%X, Set: 0x%X, Miss, Tag: 0x%X, Clean\n", address, index, tag);
-   else 
-      fprintf(cache_output_file, "W: Address: 0x%X, Set: 0x%X, Miss, Tag: 0x%X, Dirty\n", address, index, tag);
-
-   fflush(cache_output_file);
-
-   return;
 }
 
-void output_cache_stats() {
-   if(cache_enabled) {
-      printf("D-cache statistics: Accesses=%d, Hit=%d, Miss=%d, ", cache->accesses, cache->hits, cache->misses);
-      float hit_rate = 0;
-
-      if(cache->accesses != 0) hit_rate = (float)cache->hits/cache->accesses;
-      
-      printf("Hit Rate=%.2f\n", hit_rate);
+// A block evicted from an exclusive level above arrives in place of one of the level's own
+static void insert_victim(cache_struct* level, uint32_t address, const uint8_t* block, _Bool dirty) {
+   int index = set_index(level, address);
+   cache_line* line = find_line(level, address);
+   if (line == NULL) {
+      line = choose_victim(level, index);
+      evict_line_at(level, index, line);
+      fill_line(level, index, line, address);
    } else {
-      printf("Cache disabled.\n");
+      touch_line(level, index, line);
    }
+   memcpy(line->block, block, level->block_size);
+   line->dirty = line->dirty || dirty;
 }
 
-void dump_cache_content(char* filename) {
-   if(!cache_enabled) {
-      printf("Cache disabled\n");
+// Give up the block in line: pass it down as a writeback if dirty, or whatever its state to an
+// exclusive level below. An inclusive level takes the block out of the level above first.
+static void evict_line_at(cache_struct* level, int index, cache_line* line) {
+   if (!line->valid) {
       return;
    }
+   uint32_t address = line_address(level, index, line);
+   take_back_from_above(level, address, level->block_size, line);
 
-   FILE *dump_file = fopen(filename, "w");
+   _Bool dirty = line->dirty;
+   drop_line(level, index, line);
+   if (dirty) {
+      level->writebacks++;
+   }
+   if (level->next != NULL && level->inclusion == INCLUSION_EXCLUSIVE) {
+      insert_victim(level->next, address, line->block, dirty);
+   } else if (dirty) {
+      write_below(level, address, line->block, level->block_size);
+   }
+}
 
-   if (dump_file == NULL) {
-      red("Error opening dump file\n");
-      return;
+// Read the level's block at address from the levels below into destination. Returns true if it
+// comes up dirty, moved out of an exclusive level that had written it.
+static _Bool fetch_block(cache_struct* level, uint32_t address, uint8_t* destination) {
+   cache_struct* next = level->next;
+   if (next == NULL) {
+      read_memory_block(address, destination, level->block_size);
+      return false;
    }
 
-   int no_of_sets = cache->cache_size/(cache->block_size * cache->associativity);
-   for(int index = 0; index < no_of_sets; index++) {
-      for(int j = 0; j < cache->associativity; j++) {
-         if(cache->sets[index].lines[j].valid) {
-            cache_line current_line = cache->sets[index].lines[j];
-            if(current_line.dirty) {
-               fprintf(dump_file, "Set: 0x%X, Tag: 0x%X, Dirty\n", index, current_line.tag);
-            } else {
-               fprintf(dump_file, "Set: 0x%X, Tag: 0x%X, Clean\n", index, current_line.tag);
-            }
-         }
+   next->accesses++;
+   cache_line* line = find_line(next, address);
+   if (level->inclusion == INCLUSION_EXCLUSIVE) {
+      // the block moves up, or comes from further down without stopping in next
+      if (line == NULL) {
+         next->misses++;
+         return fetch_block(next, address, destination);
       }
+      next->hits++;
+      memcpy(destination, line->block, level->block_size);
+      _Bool dirty = line->dirty;
+      drop_line(next, set_index(next, address), line);
+      return dirty;
    }
 
-   fclose(dump_file);
+   if (line != NULL) {
+      next->hits++;
+      touch_line(next, set_index(next, address), line);
+   } else {
+      next->misses++;
+      line = allocate_line(next, address);
+   }
+   memcpy(destination, line->block + (address & (next->block_size - 1)), level->block_size);
+   return false;
 }
 
+// Bring the block holding address into the level, in place of the replacement policy's victim.
+// The victim is chosen once the block is fetched: the fetch can free a way, by moving the block out
+// of an exclusive level below into which the victim then goes, or by back-invalidation.
+static cache_line* allocate_line(cache_struct* level, uint32_t address) {
+   int index = set_index(level, address);
+   _Bool dirty = fetch_block(level, address & ~(uint32_t)(level->block_size - 1), level->incoming);
+
+   cache_line* line = choose_victim(level, index);
+   evict_line_at(level, index, line);
+   memcpy(line->block, level->incoming, level->block_size);
+   line->dirty = dirty;
+   fill_line(level, index, line, address);
+   return line;
+}
 
+// A write from the level above: into the block if the level has it, or allocates it if it's
+// write back, and on down if it's write through
+static void write_level(cache_struct* level, uint32_t address, const uint8_t* bytes, int size) {
+   level->accesses++;
+   cache_line* line = find_line(level, address);
+   if (line != NULL) {
+      level->hits++;
+      touch_line(level, set_index(level, address), line);
+   } else {
+      level->misses++;
+      if (level->write_policy == 0) {
+         line = allocate_line(level, address);
+      }
+   }
 
+   if (line != NULL) {
+      memcpy(line->block + (address & (level->block_size - 1)), bytes, size);
+   }
+   if (level->write_policy == 0) {
+      line->dirty = 1;
+   } else {
+      write_below(level, address, bytes, size);
+   }
+}
 
+uint8_t *read_cache(uint32_t address) {
+   // check for hit
+   cache->accesses++;
+   int index = set_index(cache, address);
+   uint32_t tag = address_tag(cache, address);
+
+   cache_line* line = find_line(cache, address);
+   if (line != NULL) {
+      cache->hits++;
+      touch_line(cache, index, line);
+      log_cache_access('R', address, index, tag, true, line->dirty);
+      return line->block;
+   }
 
+   // cache read miss
+   cache->misses++;
+   line = allocate_line(cache, address);
+   log_cache_access('R', address, index, tag, false, line->dirty);
+   return line->block;
+}
 
+void write_cache(uint32_t address, uint64_t data, int size) {
+   //check for hit
+   int offset = address & ((1 << cache->offset_length) - 1);
+   int index = set_index(cache, address);
+   uint32_t tag = address_tag(cache, address);
 
+   uint8_t bytes[8];
+   for (int i = 0; i < size; i++)
+      bytes[i] = (data >> (i * 8)) & 0xFF;
 
+   // write_policy --> 0 is write back, 1 is write through 
+   cache->accesses++;
+   cache_line* line = find_line(cache, address);
+   if (line != NULL) {
+      cache->hits++;
+      touch_line(cache, index, line);
+      memcpy(line->block + offset, bytes, size);
+
+      if (cache->write_policy == 0) {
+         line->dirty = 1;
+      } else if (cache->write_policy == 1) {
+         write_below(cache, address, bytes, size);
+      }
 
+      log_cache_access('W', address, index, tag, true, line->dirty);
+      return;
+   }
 
+   cache->misses++;
 
+   // for write back, also do allocate when miss
+   if (cache->write_policy == 0) {
+      line = allocate_line(cache, address);
+      line->dirty = 1;
+      memcpy(line->block + offset, bytes, size);
+   }
+   else if (cache->write_policy == 1) {
+      // no allocate; the log shows the line an allocation would have replaced
+      line = choose_victim(cache, index);
+      write_below(cache, address, bytes, size);
+   }
 
+   log_cache_access('W', address, index, tag, false, line->dirty);
+   return;
+}
 
+// An instruction fetch: read through the I-cache, logged like a data read
+void fetch_cache(uint32_t address) {
+   icache->accesses++;
+   int index = set_index(icache, address);
+   uint32_t tag = address_tag(icache, address);
+
+   cache_line* line = find_line(icache, address);
+   if (line != NULL) {
+      icache->hits++;
+      touch_line(icache, index, line);
+      log_cache_access('F', address, index, tag, true, line->dirty);
+   } else {
+      icache->misses++;
+      line = allocate_line(icache, address);
+      log_cache_access('F', address, index, tag, false, line->dirty);
+   }
+}
 
+static void print_levels_stats(const cache_struct* top, const char* suffix) {
+   for(const cache_struct* level = top; level != NULL && level->instructions == top->instructions; level = level->next) {
+      float hit_rate = 0;
+      if(level->accesses != 0) hit_rate = (float)level->hits/level->accesses;
 
+      if(top->next == NULL) {
+         printf("%c-cache statistics: Accesses=%" PRIu64 ", Hit=%" PRIu64 ", Miss=%" PRIu64 ", ", top->instructions ? 'I' : 'D', level->accesses, level->hits, level->misses);
+      } else {
+         printf("L%d%s statistics: Accesses=%" PRIu64 ", Hit=%" PRIu64 ", Miss=%" PRIu64 ", Writebacks=%" PRIu64 ", ", level->level, suffix, level->accesses, level->hits, level->misses, level->writebacks);
+      }
+      printf("Hit Rate=%.2f\n", hit_rate);
+   }
+}
 
+// A unified level's counts include the I-cache's misses
+void output_cache_stats() {
+   if(!cache_enabled && !icache_enabled) {
+      printf("Cache disabled.\n");
+      return;
+   }
 
+   if(cache_enabled) {
+      print_levels_stats(cache, "");
+   }
+   if(icache_enabled) {
+      print_levels_stats(icache, "I");
+   }
+}
 
+static void dump_levels(FILE* dump_file, const cache_struct* top, const char* suffix) {
+   for(const cache_struct* level = top; level != NULL && level->instructions == top->instructions; level = level->next) {
+      int no_of_sets = level->cache_size/(level->block_size * level->associativity);
+      for(int index = 0; index < no_of_sets; index++) {
+         for(int j = 0; j < level->associativity; j++) {
+            if(level->sets[index].lines[j].valid) {
+               cache_line current_line = level->sets[index].lines[j];
+               if(level != cache) {
+                  fprintf(dump_file, "L%d%s ", level->level, suffix);
+               }
+               if(current_line.dirty) {
+                  fprintf(dump_file, "Set: 0x%X, Tag: 0x%X, Dirty\n", index, current_line.tag);
+               } else {
+                  fprintf(dump_file, "Set: 0x%X, Tag: 0x%X, Clean\n", index, current_line.tag);
+               }
+            }
+         }
+      }
+   }
+}
 
+void dump_cache_content(char* filename) {
+   if(!cache_enabled && !icache_enabled) {
+      printf("Cache disabled\n");
+      return;
+   }
 
+   FILE *dump_file = fopen(filename, "w");
 
+   if (dump_file == NULL) {
+      red("Error opening dump file\n");
+      return;
+   }
 
+   // the lines of lower levels and the I-cache say which level they're in
+   if(cache_enabled) {
+      dump_levels(dump_file, cache, "");
+   }
+   if(icache_enabled) {
+      dump_levels(dump_file, icache, "I");
+   }
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+   fclose(dump_file);
+}
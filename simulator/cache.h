@@ -12,7 +12,7 @@
 #define CACHE
 
 extern _Bool cache_enabled;
-extern FILE* cache_output_file;
+extern _Bool icache_enabled;
 
 typedef struct cache_line {
    uint32_t tag;
@@ -20,49 +20,78 @@ typedef struct cache_line {
 
    _Bool valid;
    _Bool dirty;
-   int last_use_time;
-   int arrival_time;
+
+   int newer;           // neighbouring ways in the set's recency order, -1 past either end
+   int older;
+   int next_indexed;    // next line in the same tag_index bucket, -1 for none
 }  cache_line;
 
 typedef struct cache_set {
    cache_line* lines;
+   int newest;          // ends of the recency order: by last use for LRU, by arrival for FIFO,
+   int oldest;          // with the invalid lines oldest
 } cache_set;
 
+#define MAX_CACHE_LEVELS 4
+
+// How a level relates to the next one down
+#define INCLUSION_NINE 0         // neither inclusive nor exclusive: blocks are filled into both, and evicted independently
+#define INCLUSION_INCLUSIVE 1    // the next level holds every block of this one, and takes them back when it evicts
+#define INCLUSION_EXCLUSIVE 2    // a block is in one of the two: it moves up on a hit, and down when evicted
+
+#define MAX_UPPER_LEVELS 2       // a unified level fills both a D-cache and an I-cache level
+
 typedef struct cache_struct {
    int cache_size;
    int block_size;
    int associativity;   // the ABC of cache
 
-   int accesses;
-   int hits;
-   int misses;    // cache stats
+   uint64_t accesses;
+   uint64_t hits;
+   uint64_t misses;    // cache stats
+   uint64_t writebacks;      // dirty blocks passed down on eviction
 
    int rep_policy;      // 0 is LRU, 1 is FIFO, 2 is RANDOM
    int write_policy;    // 0 is write back, 1 is write through
+   int inclusion;       // with next, see INCLUSION_*
 
    int index_length;
    int tag_length;
    int offset_length;
 
+   int level;                    // 1 for L1
+   _Bool instructions;           // an I-cache level, filled by instruction fetches only
+   struct cache_struct* next;    // level below, NULL for memory
+   struct cache_struct* above[MAX_UPPER_LEVELS];
+   int above_count;
+
    cache_set* sets;
+   uint8_t* incoming;   // a block being fetched, until the line it goes into is chosen
+   int* tag_index;      // buckets of lines by block address, for levels with many ways; NULL otherwise
+   int tag_index_shift;
 } cache_struct;
 
-extern cache_struct* cache;
+extern cache_struct* cache;     // L1, the top of the hierarchy
+extern cache_struct* icache;    // L1I, its lower levels possibly shared with cache's
 
 
 void enable_cache(char* config_file_name);
 void disable_cache();
 void free_cache();
-void create_cache(int cache_size, int block_size, int associativity, int rep_policy, int write_policy);
+void enable_icache(char* config_file_name);
+void disable_icache();
+void free_icache();
+cache_struct* create_cache(int cache_size, int block_size, int associativity, int rep_policy, int write_policy);
 void output_cache_status();
 void output_cache_stats();
 void clear_cache();
-void open_cache_output_file(char* file_name);
 
 uint8_t *read_cache(uint32_t address);
 
 void write_cache(uint32_t address, uint64_t data, int size);
 
+void fetch_cache(uint32_t address);
+
 void cache_invalidate();
 
 int64_t get_data_for_register(uint32_t address, uint8_t funct3);
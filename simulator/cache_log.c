@@ -0,0 +1,191 @@
+#include "cache_log.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simulator.h"
+#include "utils.h"
+
+// The log is a header followed by fixed-size records. Records are collected in a buffer and
+// written out with one fwrite when it fills up or when a command finishes. Nothing is logged
+// until `cache_sim log on`; `cache_sim log text` turns a log into the text of one line per access.
+#define CACHE_LOG_MAGIC "GULMCLG"
+
+typedef struct cache_log_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} cache_log_header;
+
+static cache_log_record log_buffer[CACHE_LOG_BUFFER_RECORDS];
+static size_t log_used = 0;
+static FILE* log_file = NULL;
+static char* log_path = NULL;       // of the log being written, or the last one
+static _Bool logging = false;
+
+// file_name with extension in place of its own
+static char* replace_extension(const char* file_name, const char* extension) {
+    const char* slash = strrchr(file_name, '/');
+    const char* dot = strrchr(file_name, '.');
+    size_t length = (dot != NULL && (slash == NULL || dot > slash)) ? (size_t)(dot - file_name) : strlen(file_name);
+
+    char* name = malloc(length + strlen(extension) + 1);
+    if (name == NULL) {
+        red("Memory allocation failed while naming the cache log!\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(name, file_name, length);
+    strcpy(name + length, extension);
+    return name;
+}
+
+void cache_log_flush() {
+    if (log_file != NULL) {
+        fwrite(log_buffer, sizeof(cache_log_record), log_used, log_file);
+        fflush(log_file);
+    }
+    log_used = 0;
+}
+
+static void close_cache_log() {
+    cache_log_flush();
+    if (log_file != NULL) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+}
+
+// Starts the log of the program in program_name afresh, if logging is on
+void start_cache_log(const char* program_name) {
+    close_cache_log();
+    if (!logging) {
+        return;
+    }
+
+    free(log_path);
+    log_path = replace_extension(program_name, CACHE_LOG_EXTENSION);
+    log_file = fopen(log_path, "wb");
+    if (log_file == NULL) {
+        red("Error opening cache log %s\n", log_path);
+        return;
+    }
+
+    cache_log_header header = {.magic = CACHE_LOG_MAGIC, .version = CACHE_LOG_VERSION, .record_size = sizeof(cache_log_record)};
+    fwrite(&header, sizeof(header), 1, log_file);
+}
+
+// Turns logging on, for the program loaded now and the ones loaded later, or off
+_Bool set_cache_logging(_Bool enabled) {
+    logging = enabled;
+    if (!enabled) {
+        close_cache_log();
+    } else if (log_file == NULL && current_file_name != NULL) {
+        start_cache_log(current_file_name);
+        return log_file != NULL;
+    }
+    return true;
+}
+
+_Bool cache_logging() {
+    return logging;
+}
+
+void log_cache_access(char access, uint32_t address, uint32_t set, uint32_t tag, _Bool hit, _Bool dirty) {
+    if (log_file == NULL) {
+        return;
+    }
+    if (log_used == CACHE_LOG_BUFFER_RECORDS) {
+        cache_log_flush();
+    }
+    log_buffer[log_used++] = (cache_log_record){address, set, tag, access, hit, dirty, 0};
+}
+
+// Writes the log in log_name (the last one written for NULL) out as text: the D-cache's accesses
+// to <log>.output and instruction fetches to <log>.ioutput, one line each
+_Bool write_cache_log_text(const char* log_name) {
+    cache_log_flush();
+    if (log_name == NULL) {
+        log_name = log_path;
+    }
+    if (log_name == NULL) {
+        red("No cache log has been written. Use cache_sim log on first.\n");
+        return false;
+    }
+
+    FILE* input = fopen(log_name, "rb");
+    if (input == NULL) {
+        red("Error opening cache log %s\n", log_name);
+        return false;
+    }
+
+    cache_log_header header;
+    if (fread(&header, sizeof(header), 1, input) != 1 || memcmp(header.magic, CACHE_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CACHE_LOG_VERSION || header.record_size != sizeof(cache_log_record)) {
+        red("%s is not a cache log.\n", log_name);
+        fclose(input);
+        return false;
+    }
+
+    char* data_name = replace_extension(log_name, ".output");
+    char* fetch_name = replace_extension(log_name, ".ioutput");
+    FILE* data_output = NULL;       // opened when the first record for it comes up
+    FILE* fetch_output = NULL;
+    size_t data_count = 0;
+    size_t fetch_count = 0;
+    _Bool ok = true;
+
+    cache_log_record records[1024];
+    size_t count;
+    while (ok && (count = fread(records, sizeof(cache_log_record), 1024, input)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            const cache_log_record* record = &records[i];
+            _Bool fetch = record->access == 'F';
+            FILE** output = fetch ? &fetch_output : &data_output;
+            if (*output == NULL) {
+                *output = fopen(fetch ? fetch_name : data_name, "w");
+                if (*output == NULL) {
+                    red("Error opening cache output file\n");
+                    ok = false;
+                    break;
+                }
+            }
+
+            fprintf(*output, "%c: Address: 0x%X, Set: 0x%X, %s, Tag: 0x%X, %s\n", record->access, record->address, record->set,
+                    record->hit ? "Hit" : "Miss", record->tag, record->dirty ? "Dirty" : "Clean");
+            if (fetch) {
+                fetch_count++;
+            } else {
+                data_count++;
+            }
+        }
+    }
+    if (ok && ferror(input)) {
+        red("Error reading cache log %s\n", log_name);
+        ok = false;
+    }
+
+    if (ok) {
+        printf("%zu data accesses", data_count);
+        if (data_output != NULL) {
+            printf(" written to %s", data_name);
+        }
+        printf(", %zu instruction fetches", fetch_count);
+        if (fetch_output != NULL) {
+            printf(" written to %s", fetch_name);
+        }
+        printf("\n");
+    }
+
+    if (data_output != NULL) {
+        fclose(data_output);
+    }
+    if (fetch_output != NULL) {
+        fclose(fetch_output);
+    }
+    free(data_name);
+    free(fetch_name);
+    fclose(input);
+    return ok;
+}
@@ -0,0 +1,28 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef CACHE_LOG
+#define CACHE_LOG
+
+#define CACHE_LOG_EXTENSION ".cachelog"
+#define CACHE_LOG_VERSION 1
+#define CACHE_LOG_BUFFER_RECORDS (1 << 16)
+
+// One access of the D-cache or I-cache's L1, as logged
+typedef struct cache_log_record {
+    uint32_t address;
+    uint32_t set;
+    uint32_t tag;
+    char access;            // 'R', 'W' or 'F' for an instruction fetch
+    uint8_t hit;
+    uint8_t dirty;          // of the line accessed, or replaced by a miss
+    uint8_t reserved;
+} cache_log_record;
+
+_Bool set_cache_logging(_Bool enabled);
+_Bool cache_logging();
+void start_cache_log(const char* program_name);
+void log_cache_access(char access, uint32_t address, uint32_t set, uint32_t tag, _Bool hit, _Bool dirty);
+void cache_log_flush();
+_Bool write_cache_log_text(const char* log_name);
+#endif
@@ -0,0 +1,97 @@
+#include "callstack.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+stack_frame* call_stack = NULL;
+size_t call_stack_depth = 0;
+static size_t call_stack_capacity = 0;
+
+static symbol_slot* symbol_slots = NULL;
+static size_t symbol_mask = 0;      // slot count - 1, the count is a power of two
+
+void push_to_stack(const char* function_name, int line_num) {
+    if (call_stack_depth == call_stack_capacity) {
+        call_stack_capacity = call_stack_capacity ? call_stack_capacity * 2 : 64;
+        call_stack = realloc(call_stack, call_stack_capacity * sizeof(stack_frame));
+        if (call_stack == NULL) {
+            red("Memory allocation failed while expanding call stack!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    call_stack[call_stack_depth].function_name = function_name;
+    call_stack[call_stack_depth].line_num = line_num;
+    call_stack_depth++;
+}
+
+// can call pop even for main
+void pop_from_stack() {
+    if (call_stack_depth > 0) {
+        call_stack_depth--;
+    }
+}
+
+// Empty the stack but keep the array for the next run
+void free_stack() {
+    call_stack_depth = 0;
+}
+
+static size_t symbol_hash(uint32_t pc) {
+    return ((pc >> 2) * 2654435761u) & symbol_mask;
+}
+
+// Called once label_array is complete. When several labels name the same instruction the
+// last one wins, as with the scan this replaces.
+void build_symbol_index() {
+    free_symbol_index();
+
+    size_t slots = 16;
+    while (slots < (size_t)label_count * 2) {
+        slots *= 2;
+    }
+    symbol_slots = malloc(slots * sizeof(symbol_slot));
+    if (symbol_slots == NULL) {
+        red("Memory allocation failed while indexing labels!\n");
+        exit(EXIT_FAILURE);
+    }
+    symbol_mask = slots - 1;
+    for (size_t i = 0; i < slots; i++) {
+        symbol_slots[i].label_index = -1;
+    }
+
+    for (int i = 0; i < label_count; i++) {
+        uint32_t pc = (label_array[i].line_num - 1) * 4;
+        size_t slot = symbol_hash(pc);
+        while (symbol_slots[slot].label_index != -1 && symbol_slots[slot].pc != pc) {
+            slot = (slot + 1) & symbol_mask;
+        }
+        symbol_slots[slot].pc = pc;
+        symbol_slots[slot].label_index = i;
+    }
+}
+
+void free_symbol_index() {
+    free(symbol_slots);
+    symbol_slots = NULL;
+    symbol_mask = 0;
+}
+
+// Index into label_array of the label on the instruction at pc, or -1
+int find_symbol(uint32_t pc) {
+    if (symbol_slots == NULL) {
+        return -1;
+    }
+
+    size_t slot = symbol_hash(pc);
+    while (symbol_slots[slot].label_index != -1) {
+        if (symbol_slots[slot].pc == pc) {
+            return symbol_slots[slot].label_index;
+        }
+        slot = (slot + 1) & symbol_mask;
+    }
+    return -1;
+}
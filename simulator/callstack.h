@@ -0,0 +1,35 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef CALLSTACK
+#define CALLSTACK
+
+// Shadow call stack for show-stack: a growable array of frames, main at index 0.
+// Frames point at label names owned by label_array, so they stay valid until the next load.
+typedef struct stack_frame {
+    const char* function_name;
+    int line_num;       // file line of the last instruction run in this frame
+} stack_frame;
+
+// A label keyed by the pc of the instruction it names, for naming callees without a scan
+typedef struct symbol_slot {
+    uint32_t pc;
+    int label_index;    // into label_array, -1 for an empty slot
+} symbol_slot;
+
+extern stack_frame* call_stack;
+extern size_t call_stack_depth;
+
+void push_to_stack(const char* function_name, int line_num);
+void pop_from_stack();
+void free_stack();
+
+void build_symbol_index();
+void free_symbol_index();
+int find_symbol(uint32_t pc);
+
+// Innermost frame, NULL once main has returned
+static inline stack_frame* return_top_of_stack() {
+    return call_stack_depth ? &call_stack[call_stack_depth - 1] : NULL;
+}
+#endif
@@ -0,0 +1,442 @@
+#include "decode.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "callstack.h"
+#include "simulator.h"
+#include "utils.h"
+
+decoded_instruction* decoded_text = NULL;
+size_t decoded_count = 0;
+uint64_t text_generation = 0;
+
+// Handlers. Each one has the same effect as the matching case in execute_r/i/l/jr/s/b/u/j.
+
+static void op_nop(const decoded_instruction* d) {
+    (void)d;
+}
+
+static void op_add(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] + registers[d->rs2];
+}
+
+static void op_sub(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] - registers[d->rs2];
+}
+
+static void op_xor(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] ^ registers[d->rs2];
+}
+
+static void op_or(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] | registers[d->rs2];
+}
+
+static void op_and(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] & registers[d->rs2];
+}
+
+static void op_sll(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] << (registers[d->rs2] & 0x3F);
+}
+
+static void op_srl(const decoded_instruction* d) {
+    registers[d->rd] = (uint64_t)registers[d->rs1] >> (registers[d->rs2] & 0x3F);
+}
+
+static void op_sra(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] >> (registers[d->rs2] & 0x3F);
+}
+
+static void op_slt(const decoded_instruction* d) {
+    registers[d->rd] = (registers[d->rs1] < registers[d->rs2]) ? 1 : 0;
+}
+
+static void op_sltu(const decoded_instruction* d) {
+    registers[d->rd] = ((uint64_t)registers[d->rs1] < (uint64_t)registers[d->rs2]) ? 1 : 0;
+}
+
+static void op_addi(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] + d->imm;
+}
+
+static void op_xori(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] ^ d->imm;
+}
+
+static void op_ori(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] | d->imm;
+}
+
+static void op_andi(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] & d->imm;
+}
+
+static void op_slli(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] << d->imm;
+}
+
+static void op_srli(const decoded_instruction* d) {
+    registers[d->rd] = (uint64_t)registers[d->rs1] >> d->imm;
+}
+
+static void op_srai(const decoded_instruction* d) {
+    registers[d->rd] = registers[d->rs1] >> d->imm;
+}
+
+// With the cache enabled every load goes through it, even one into x0
+static void load_through_cache(const decoded_instruction* d, uint8_t funct3) {
+    uint32_t address = (uint64_t)(registers[d->rs1] + d->imm);
+    registers[d->rd] = get_data_for_register(address, funct3);
+    registers[0] = 0;
+}
+
+static void op_lb(const decoded_instruction* d) {
+    if (cache_enabled) {
+        load_through_cache(d, 0x0);
+    } else if (d->rd != 0) {
+        registers[d->rd] = (int64_t)((int8_t)read_memory_byte(registers[d->rs1] + d->imm));
+    }
+}
+
+static void op_lh(const decoded_instruction* d) {
+    if (cache_enabled) {
+        load_through_cache(d, 0x1);
+    } else if (d->rd != 0) {
+        registers[d->rd] = (int64_t)((int16_t)read_memory_half(registers[d->rs1] + d->imm));
+    }
+}
+
+static void op_lw(const decoded_instruction* d) {
+    if (cache_enabled) {
+        load_through_cache(d, 0x2);
+    } else if (d->rd != 0) {
+        registers[d->rd] = (int64_t)((int32_t)read_memory_word(registers[d->rs1] + d->imm));
+    }
+}
+
+static void op_ld(const decoded_instruction* d) {
+    if (cache_enabled) {
+        load_through_cache(d, 0x3);
+    } else if (d->rd != 0) {
+        registers[d->rd] = (int64_t)read_memory_dword(registers[d->rs1] + d->imm);
+    }
+}
+
+static void op_lbu(const decoded_instruction* d) {
+    if (cache_enabled) {
+        load_through_cache(d, 0x4);
+    } else if (d->rd != 0) {
+        registers[d->rd] = (uint64_t)read_memory_byte(registers[d->rs1] + d->imm);
+    }
+}
+
+static void op_lhu(const decoded_instruction* d) {
+    if (cache_enabled) {
+        load_through_cache(d, 0x5);
+    } else if (d->rd != 0) {
+        registers[d->rd] = (uint64_t)read_memory_half(registers[d->rs1] + d->imm);
+    }
+}
+
+static void op_lwu(const decoded_instruction* d) {
+    if (cache_enabled) {
+        load_through_cache(d, 0x6);
+    } else if (d->rd != 0) {
+        registers[d->rd] = (uint64_t)read_memory_word(registers[d->rs1] + d->imm);
+    }
+}
+
+static void op_jalr(const decoded_instruction* d) {
+    if (d->rd != 0) {
+        registers[d->rd] = pc + 4;  // linking
+    }
+
+    // d->imm already accounts for the pc increment after every instruction
+    int64_t target = d->imm + registers[d->rs1];
+    pc = target;
+    current_instruction = (target / 4) + 1;
+
+    pop_from_stack();
+}
+
+static void op_sb(const decoded_instruction* d) {
+    if (cache_enabled) {
+        write_cache(registers[d->rs1] + d->imm, registers[d->rs2], 1);
+    } else {
+        write_memory_byte(registers[d->rs1] + d->imm, registers[d->rs2]);
+    }
+}
+
+static void op_sh(const decoded_instruction* d) {
+    if (cache_enabled) {
+        write_cache(registers[d->rs1] + d->imm, registers[d->rs2], 2);
+    } else {
+        write_memory_half(registers[d->rs1] + d->imm, registers[d->rs2]);
+    }
+}
+
+static void op_sw(const decoded_instruction* d) {
+    if (cache_enabled) {
+        write_cache(registers[d->rs1] + d->imm, registers[d->rs2], 4);
+    } else {
+        write_memory_word(registers[d->rs1] + d->imm, registers[d->rs2]);
+    }
+}
+
+static void op_sd(const decoded_instruction* d) {
+    if (cache_enabled) {
+        write_cache(registers[d->rs1] + d->imm, registers[d->rs2], 8);
+    } else {
+        write_memory_dword(registers[d->rs1] + d->imm, registers[d->rs2]);
+    }
+}
+
+static inline void take_branch(const decoded_instruction* d) {
+    current_instruction += d->imm / 4;
+    pc += d->imm;
+}
+
+static void op_beq(const decoded_instruction* d) {
+    if (registers[d->rs1] == registers[d->rs2]) {
+        take_branch(d);
+    }
+}
+
+static void op_bne(const decoded_instruction* d) {
+    if (registers[d->rs1] != registers[d->rs2]) {
+        take_branch(d);
+    }
+}
+
+static void op_blt(const decoded_instruction* d) {
+    if (registers[d->rs1] < registers[d->rs2]) {
+        take_branch(d);
+    }
+}
+
+static void op_bge(const decoded_instruction* d) {
+    if (registers[d->rs1] >= registers[d->rs2]) {
+        take_branch(d);
+    }
+}
+
+static void op_bltu(const decoded_instruction* d) {
+    if ((uint64_t)registers[d->rs1] < (uint64_t)registers[d->rs2]) {
+        take_branch(d);
+    }
+}
+
+static void op_bgeu(const decoded_instruction* d) {
+    if ((uint64_t)registers[d->rs1] >= (uint64_t)registers[d->rs2]) {
+        take_branch(d);
+    }
+}
+
+static void op_lui(const decoded_instruction* d) {
+    registers[d->rd] = d->imm;
+}
+
+static void op_jal(const decoded_instruction* d) {
+    if (d->rd != 0) {
+        registers[d->rd] = pc + 4;  // linking
+    }
+
+    pc += d->imm;
+    current_instruction += d->imm / 4;
+    push_called_function();
+}
+
+static const instruction_handler handlers[OP_COUNT] = {
+    [OP_NOP] = op_nop,
+    [OP_ADD] = op_add, [OP_SUB] = op_sub, [OP_XOR] = op_xor, [OP_OR] = op_or, [OP_AND] = op_and,
+    [OP_SLL] = op_sll, [OP_SRL] = op_srl, [OP_SRA] = op_sra, [OP_SLT] = op_slt, [OP_SLTU] = op_sltu,
+    [OP_ADDI] = op_addi, [OP_XORI] = op_xori, [OP_ORI] = op_ori, [OP_ANDI] = op_andi,
+    [OP_SLLI] = op_slli, [OP_SRLI] = op_srli, [OP_SRAI] = op_srai,
+    [OP_LB] = op_lb, [OP_LH] = op_lh, [OP_LW] = op_lw, [OP_LD] = op_ld,
+    [OP_LBU] = op_lbu, [OP_LHU] = op_lhu, [OP_LWU] = op_lwu,
+    [OP_JALR] = op_jalr,
+    [OP_SB] = op_sb, [OP_SH] = op_sh, [OP_SW] = op_sw, [OP_SD] = op_sd,
+    [OP_BEQ] = op_beq, [OP_BNE] = op_bne, [OP_BLT] = op_blt, [OP_BGE] = op_bge,
+    [OP_BLTU] = op_bltu, [OP_BGEU] = op_bgeu,
+    [OP_LUI] = op_lui,
+    [OP_JAL] = op_jal,
+};
+
+static decoded_op decode_r(uint8_t funct3, uint8_t funct7) {
+    switch (funct7) {
+        case 0x0:
+            switch (funct3) {
+                case 0x0: return OP_ADD;
+                case 0x4: return OP_XOR;
+                case 0x6: return OP_OR;
+                case 0x7: return OP_AND;
+                case 0x1: return OP_SLL;
+                case 0x5: return OP_SRL;
+                case 0x2: return OP_SLT;
+                case 0x3: return OP_SLTU;
+                default: break;
+            }
+            break;
+        case 0x20:
+            switch (funct3) {
+                case 0x0: return OP_SUB;
+                case 0x5: return OP_SRA;
+                default: break;
+            }
+            break;
+        default:
+            break;
+    }
+    return OP_NOP;
+}
+
+static decoded_op decode_i(uint8_t funct3, uint8_t funct6) {
+    switch (funct3) {
+        case 0x0: return OP_ADDI;
+        case 0x4: return OP_XORI;
+        case 0x6: return OP_ORI;
+        case 0x7: return OP_ANDI;
+        case 0x1: return funct6 == 0x0 ? OP_SLLI : OP_NOP;
+        case 0x5:
+            if (funct6 == 0x00) {
+                return OP_SRLI;
+            } else if (funct6 == 0x10) {
+                return OP_SRAI;
+            }
+            break;
+        default:
+            break;
+    }
+    return OP_NOP;
+}
+
+// Extract everything execute() would work out from the instruction word at address
+void decode_instruction(uint32_t instruction, uint32_t address, decoded_instruction* decoded) {
+    uint8_t rd = (instruction >> 7) & 0b11111;
+    uint8_t funct3 = (instruction >> 12) & 0b111;
+    uint8_t rs1 = (instruction >> 15) & 0b11111;
+    uint8_t rs2 = (instruction >> 20) & 0b11111;
+    decoded_op op = OP_NOP;
+    int64_t imm = 0;
+
+    switch (decode_type(instruction)) {
+        case 10:  // R-type instruction
+            op = decode_r(funct3, (instruction >> 25) & 0b111111);
+            if (rd == 0) {
+                op = OP_NOP;
+            }
+            break;
+
+        case 20:  // I-type instruction (excluding jalr and load)
+            op = decode_i(funct3, (instruction >> 26) & 0b111111);
+            if (op == OP_SLLI || op == OP_SRLI || op == OP_SRAI) {
+                imm = (instruction >> 20) & 0b111111;
+            } else {
+                imm = sign_extend_12bit((instruction >> 20) & 0b111111111111);
+            }
+            if (rd == 0) {
+                op = OP_NOP;
+            }
+            break;
+
+        case 21: {  // load instruction
+            static const decoded_op loads[8] = {OP_LB, OP_LH, OP_LW, OP_LD, OP_LBU, OP_LHU, OP_LWU, OP_NOP};
+            op = loads[funct3];
+            imm = sign_extend_12bit((instruction >> 20) & 0b111111111111);
+            break;
+        }
+
+        case 22:  // jalr instruction
+            op = OP_JALR;
+            imm = sign_extend_12bit((instruction >> 20) & 0b111111111111) - 4;
+            break;
+
+        case 30: {  // S-type instruction
+            static const decoded_op stores[8] = {OP_SB, OP_SH, OP_SW, OP_SD, OP_NOP, OP_NOP, OP_NOP, OP_NOP};
+            uint32_t raw = ((instruction >> 7) & 0b11111) | ((instruction >> 25) << 5);
+            op = stores[funct3];
+            imm = sign_extend_12bit(raw);
+            break;
+        }
+
+        case 40: {  // B-type instruction
+            static const decoded_op branches[8] = {OP_BEQ, OP_BNE, OP_NOP, OP_NOP, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU};
+            uint32_t raw = ((instruction >> 8) & 0b1111) << 1;
+            raw |= ((instruction >> 25) & 0b0111111) << 5;
+            raw |= ((instruction >> 7) & 0b1) << 11;
+            raw |= (instruction >> 31) << 12;
+            op = branches[funct3];
+            imm = (sign_extend_12bit(raw >> 1) << 1) - 4;
+            break;
+        }
+
+        case 50:  // U-type instruction
+            op = rd == 0 ? OP_NOP : OP_LUI;
+            imm = (int64_t)((int32_t)(instruction >> 12) << 12);
+            break;
+
+        case 60: {  // J-type instruction
+            uint32_t raw = (((instruction << 1) >> 22) << 1);
+            raw += ((instruction >> 20) & 0b1) << 11;
+            raw += ((instruction >> 12) & 0b11111111) << 12;
+            raw += (instruction >> 31) << 20;
+            op = OP_JAL;
+            imm = (int64_t)((int32_t)(raw << 11) >> 11) - 4;
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    decoded->handler = handlers[op];
+    decoded->op = op;
+    decoded->rd = rd;
+    decoded->rs1 = rs1;
+    decoded->rs2 = rs2;
+    decoded->imm = imm;
+    decoded->target = address + 4 + imm;   // only meaningful for branches and jal
+}
+
+// Decode the whole text segment, and watch it so stores into it force a re-decode
+void build_decoded_text(size_t instruction_count) {
+    free_decoded_text();
+
+    decoded_text = malloc((instruction_count + 1) * sizeof(decoded_instruction));
+    if (decoded_text == NULL) {
+        red("Memory allocation failed while decoding the program!\n");
+        exit(EXIT_FAILURE);
+    }
+    decoded_count = instruction_count;
+
+    for (size_t i = 0; i < instruction_count; i++) {
+        decode_instruction(read_memory_word(i * 4), i * 4, &decoded_text[i]);
+    }
+
+    watch_code_region(instruction_count * 4, invalidate_decoded_text);
+    text_generation++;
+}
+
+// Called by the memory module for every write below the end of the text segment
+void invalidate_decoded_text(uint64_t address, size_t length) {
+    size_t first = address / 4;
+    size_t last = (address + length - 1) / 4;
+
+    for (size_t i = first; i <= last && i < decoded_count; i++) {
+        decoded_text[i].handler = NULL;
+    }
+    text_generation++;
+}
+
+void free_decoded_text() {
+    free(decoded_text);
+    decoded_text = NULL;
+    decoded_count = 0;
+    watch_code_region(0, NULL);
+    text_generation++;
+}
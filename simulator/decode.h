@@ -0,0 +1,60 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "memory.h"
+
+#ifndef DECODE
+#define DECODE
+
+// One operation per concrete instruction. OP_NOP covers writes to x0 and unknown encodings.
+typedef enum decoded_op {
+    OP_NOP,
+    OP_ADD, OP_SUB, OP_XOR, OP_OR, OP_AND, OP_SLL, OP_SRL, OP_SRA, OP_SLT, OP_SLTU,
+    OP_ADDI, OP_XORI, OP_ORI, OP_ANDI, OP_SLLI, OP_SRLI, OP_SRAI,
+    OP_LB, OP_LH, OP_LW, OP_LD, OP_LBU, OP_LHU, OP_LWU,
+    OP_JALR,
+    OP_SB, OP_SH, OP_SW, OP_SD,
+    OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+    OP_LUI,
+    OP_JAL,
+    OP_COUNT
+} decoded_op;
+
+typedef struct decoded_instruction decoded_instruction;
+typedef void (*instruction_handler)(const decoded_instruction*);
+
+// An instruction word with its fields already extracted. handler is NULL while the entry
+// needs (re)decoding, e.g. after a store into the text segment.
+struct decoded_instruction {
+    instruction_handler handler;
+    int64_t imm;            // sign extended immediate, shift amount, or (branch/jump offset - 4)
+    uint32_t target;        // branch/jal target pc
+    uint8_t op;             // decoded_op
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+};
+
+extern decoded_instruction* decoded_text;   // indexed by pc / 4
+extern size_t decoded_count;
+extern uint64_t text_generation;      // bumped whenever the decoded text is rebuilt or invalidated
+
+void decode_instruction(uint32_t instruction, uint32_t address, decoded_instruction* decoded);
+void build_decoded_text(size_t instruction_count);
+void invalidate_decoded_text(uint64_t address, size_t length);
+void free_decoded_text();
+
+// Decoded form of the instruction at pc, or NULL if pc is outside the text segment
+static inline decoded_instruction* fetch_decoded(uint32_t pc) {
+    size_t index = pc >> 2;
+    if ((pc & 3) != 0 || index >= decoded_count) {
+        return NULL;
+    }
+
+    decoded_instruction* decoded = &decoded_text[index];
+    if (decoded->handler == NULL) {
+        decode_instruction(read_memory_word(pc), pc, decoded);
+    }
+    return decoded;
+}
+#endif
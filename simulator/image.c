@@ -0,0 +1,405 @@
+#include "image.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "assembler.h"
+#include "linker.h"
+#include "memory.h"
+#include "utils.h"
+
+// A program image is a loaded program ready to run: the guest memory pages the load filled, and
+// what step, break and the call stack need to show it. Loading one maps the file and points guest
+// memory at its pages, so nothing is assembled or copied. Offsets are from the start of the file.
+// The tables are 8 byte aligned, the strings end with at least one zero byte, and the pages come
+// last, MEMORY_PAGE_SIZE aligned.
+#define IMAGE_MAGIC "GULMIMG"
+
+typedef struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t file_count;
+    uint64_t instruction_count;
+    uint64_t label_count;
+    uint64_t page_count;
+    uint64_t files_offset;          // image_source[file_count]
+    uint64_t lines_offset;          // instruction_line[instruction_count], text offsets from the file start
+    uint64_t labels_offset;         // image_label[label_count]
+    uint64_t page_numbers_offset;   // uint64_t[page_count], guest address >> MEMORY_PAGE_BITS
+    uint64_t strings_offset;        // file names, label names and instruction texts
+    uint64_t pages_offset;
+} image_header;
+
+typedef struct image_source {
+    uint64_t name_offset;
+    uint64_t size;
+    uint64_t hash;                  // hash_bytes() of the file
+    uint64_t first_instruction;
+    uint64_t instruction_count;
+    uint64_t data_address;
+    uint64_t data_size;
+} image_source;
+
+typedef struct image_label {
+    uint64_t name_offset;
+    int32_t line_num;
+    int32_t file_line_num;
+} image_label;
+
+_Bool is_image_name(const char* file_name) {
+    size_t length = strlen(file_name);
+    size_t extension = strlen(IMAGE_EXTENSION);
+    return length > extension && strcmp(file_name + length - extension, IMAGE_EXTENSION) == 0;
+}
+
+// The image a load of source_name is cached in: source_name.gimg
+static char* cached_image_name(const char* source_name) {
+    char* image_name = malloc(strlen(source_name) + sizeof(IMAGE_EXTENSION));
+    if (image_name == NULL) {
+        red("Memory allocation failed while naming the program image!\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(image_name, source_name);
+    strcat(image_name, IMAGE_EXTENSION);
+    return image_name;
+}
+
+// count entries of entry_size from offset, aligned, end before end
+static bool table_fits(uint64_t offset, uint64_t count, size_t entry_size, uint64_t end) {
+    return offset % 8 == 0 && offset <= end && count <= (end - offset) / entry_size;
+}
+
+static bool string_fits(const image_header* header, uint64_t offset) {
+    return offset >= header->strings_offset && offset < header->pages_offset;
+}
+
+// Everything install_image() follows must point inside the file
+static bool image_is_valid(const image_header* header, size_t size) {
+    const char* base = (const char*)header;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 || header->version != IMAGE_VERSION || header->file_count == 0) {
+        return false;
+    }
+    if (header->pages_offset % MEMORY_PAGE_SIZE != 0 || header->pages_offset > size ||
+        header->page_count != (size - header->pages_offset) / MEMORY_PAGE_SIZE ||
+        header->strings_offset >= header->pages_offset || base[header->pages_offset - 1] != '\0') {
+        return false;
+    }
+    if (!table_fits(header->files_offset, header->file_count, sizeof(image_source), header->strings_offset) ||
+        !table_fits(header->lines_offset, header->instruction_count, sizeof(instruction_line), header->strings_offset) ||
+        !table_fits(header->labels_offset, header->label_count, sizeof(image_label), header->strings_offset) ||
+        !table_fits(header->page_numbers_offset, header->page_count, sizeof(uint64_t), header->strings_offset)) {
+        return false;
+    }
+
+    const image_source* sources = (const image_source*)(base + header->files_offset);
+    uint64_t next_instruction = 1;
+    for (uint32_t i = 0; i < header->file_count; i++) {
+        if (!string_fits(header, sources[i].name_offset) || sources[i].first_instruction != next_instruction) {
+            return false;
+        }
+        next_instruction += sources[i].instruction_count;
+    }
+    if (next_instruction != header->instruction_count + 1) {
+        return false;
+    }
+
+    const instruction_line* lines = (const instruction_line*)(base + header->lines_offset);
+    for (uint64_t i = 0; i < header->instruction_count; i++) {
+        if (!string_fits(header, lines[i].text_offset)) {
+            return false;
+        }
+    }
+    const image_label* labels = (const image_label*)(base + header->labels_offset);
+    for (uint64_t i = 0; i < header->label_count; i++) {
+        if (!string_fits(header, labels[i].name_offset)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Map an image privately, NULL if it can't be read or isn't a valid one
+static image_header* map_image(const char* image_name, size_t* size) {
+    int fd = open(image_name, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    // instruction texts are 32-bit offsets into the mapping
+    struct stat info;
+    image_header* header = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(image_header) && (uint64_t)info.st_size <= UINT32_MAX) {
+        header = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (header == MAP_FAILED) {
+        return NULL;
+    }
+
+    *size = info.st_size;
+    if (!image_is_valid(header, *size)) {
+        munmap(header, *size);
+        return NULL;
+    }
+    return header;
+}
+
+// Leave the mapped image loaded the way load_objects() leaves an assembled program: guest memory
+// backed by the image's pages, source_text the image itself, and an object per source file
+static void install_image(image_header* header, size_t size) {
+    char* base = (char*)header;
+    const image_source* sources = (const image_source*)(base + header->files_offset);
+    const instruction_line* lines = (const instruction_line*)(base + header->lines_offset);
+    const image_label* labels = (const image_label*)(base + header->labels_offset);
+    const uint64_t* page_numbers = (const uint64_t*)(base + header->page_numbers_offset);
+
+    for (uint64_t i = 0; i < header->page_count; i++) {
+        share_memory_page(page_numbers[i] << MEMORY_PAGE_BITS, (uint8_t*)base + header->pages_offset + i * MEMORY_PAGE_SIZE);
+    }
+
+    free_objects();
+    objects = malloc(header->file_count * sizeof(object_file));
+    label_array = malloc((header->label_count + 1) * sizeof(label));
+    if (objects == NULL || label_array == NULL) {
+        red("Memory allocation failed while loading the program image!\n");
+        exit(EXIT_FAILURE);
+    }
+    object_count = header->file_count;
+    for (size_t i = 0; i < object_count; i++) {
+        object_file* object = &objects[i];
+        init_object(object, base + sources[i].name_offset, NULL, 0);
+        object->source_size = sources[i].size;
+        object->source_hash = sources[i].hash;
+        object->first_instruction = sources[i].first_instruction;
+        object->data_address = sources[i].data_address;
+        object->data_size = sources[i].data_size;
+        for (size_t j = 0; j < sources[i].instruction_count; j++) {
+            size_t instruction = object->first_instruction + j;
+            const instruction_line* line = &lines[instruction - 1];
+            add_object_instruction(object, read_memory_word((instruction - 1) * 4), line->text_offset, line->file_line_num);
+            add_instruction_line(line->text_offset, line->file_line_num);
+            max_instructions++;
+        }
+    }
+
+    for (uint64_t i = 0; i < header->label_count; i++) {
+        label_array[label_count].label_name = base + labels[i].name_offset;
+        label_array[label_count].line_num = labels[i].line_num;
+        label_array[label_count].file_line_num = labels[i].file_line_num;
+        label_count++;
+    }
+
+    use_source_mapping(base, size);
+}
+
+// Load a program image named on its own. Reports why if it can't.
+_Bool load_image(const char* image_name) {
+    if (access(image_name, R_OK) != 0) {
+        red("File \"%s\" not found.\n", image_name);
+        return false;
+    }
+
+    size_t size;
+    image_header* header = map_image(image_name, &size);
+    if (header == NULL) {
+        red("\"%s\" is not a program image this version can load.\n", image_name);
+        return false;
+    }
+    install_image(header, size);
+    return true;
+}
+
+// Load the image cached next to the first of file_names if it was made from these files as they
+// are now. Returns false, having loaded nothing, if there's no such image.
+_Bool load_cached_image(char* const* file_names, size_t file_count) {
+    char* image_name = cached_image_name(file_names[0]);
+    size_t size;
+    image_header* header = map_image(image_name, &size);
+    free(image_name);
+    if (header == NULL) {
+        return false;
+    }
+
+    const char* base = (const char*)header;
+    const image_source* sources = (const image_source*)(base + header->files_offset);
+    bool current = header->file_count == file_count;
+    for (size_t i = 0; current && i < file_count; i++) {
+        current = strcmp(base + sources[i].name_offset, file_names[i]) == 0;
+    }
+
+    size_t* offsets = malloc(file_count * sizeof(size_t));
+    size_t* sizes = malloc(file_count * sizeof(size_t));
+    if (offsets == NULL || sizes == NULL) {
+        red("Memory allocation failed while loading!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (current) {
+        current = map_source_files(file_names, file_count, offsets, sizes) == file_count;
+    }
+    for (size_t i = 0; current && i < file_count; i++) {
+        current = sizes[i] == sources[i].size && hash_bytes(source_text + offsets[i], sizes[i]) == sources[i].hash;
+    }
+    free(offsets);
+    free(sizes);
+
+    if (!current) {
+        munmap(header, size);
+        return false;
+    }
+    install_image(header, size);
+    return true;
+}
+
+// Offset of a table or string of `size` bytes placed at *end, which moves past it
+static uint64_t place(uint64_t* end, uint64_t size, uint64_t alignment) {
+    uint64_t offset = (*end + alignment - 1) & ~(alignment - 1);
+    *end = offset + size;
+    return offset;
+}
+
+// Page numbers of [start, start + length) not already in page_numbers, which is sorted. Pages
+// nothing was written to, such as most of a .space, read as zeros without being in the image.
+static size_t add_page_range(uint64_t* page_numbers, size_t count, uint64_t start, uint64_t length) {
+    if (length == 0) {
+        return count;
+    }
+    for (uint64_t page = start >> MEMORY_PAGE_BITS; page <= (start + length - 1) >> MEMORY_PAGE_BITS; page++) {
+        if ((count == 0 || page_numbers[count - 1] < page) && memory_page_resident(page << MEMORY_PAGE_BITS)) {
+            page_numbers[count++] = page;
+        }
+    }
+    return count;
+}
+
+// Write the loaded program as an image. Written under a temporary name first, so a load never
+// sees half an image. Returns false if the file can't be written.
+_Bool write_image(const char* image_name) {
+    uint64_t text_bytes = max_instructions * 4;
+    uint64_t data_bytes = objects[object_count - 1].data_address + objects[object_count - 1].data_size - DATA_SECTION_START;
+    uint64_t string_bytes = 1;
+    for (size_t i = 0; i < object_count; i++) {
+        string_bytes += strlen(objects[i].file_name) + 1;
+    }
+    for (int i = 0; i < label_count; i++) {
+        string_bytes += strlen(label_array[i].label_name) + 1;
+    }
+    for (size_t i = 1; i <= max_instructions; i++) {
+        string_bytes += strlen(instruction_text(i)) + 1;
+    }
+
+    // the text from 0 and the data from DATA_SECTION_START, which it may run into
+    size_t page_capacity = (text_bytes + data_bytes) / MEMORY_PAGE_SIZE + 4;
+    uint64_t* page_numbers = malloc(page_capacity * sizeof(uint64_t));
+    if (page_numbers == NULL) {
+        red("Memory allocation failed while writing the program image!\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t page_count = add_page_range(page_numbers, 0, 0, text_bytes);
+    page_count = add_page_range(page_numbers, page_count, DATA_SECTION_START, data_bytes);
+
+    image_header layout = {.magic = IMAGE_MAGIC, .version = IMAGE_VERSION};
+    uint64_t end = sizeof(image_header);
+    layout.file_count = object_count;
+    layout.instruction_count = max_instructions;
+    layout.label_count = label_count;
+    layout.page_count = page_count;
+    layout.files_offset = place(&end, object_count * sizeof(image_source), 8);
+    layout.lines_offset = place(&end, max_instructions * sizeof(instruction_line), 8);
+    layout.labels_offset = place(&end, label_count * sizeof(image_label), 8);
+    layout.page_numbers_offset = place(&end, page_count * sizeof(uint64_t), 8);
+    layout.strings_offset = place(&end, string_bytes, 8);
+    layout.pages_offset = place(&end, page_count * MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE);
+    if (end > UINT32_MAX) {
+        free(page_numbers);
+        return false;
+    }
+
+    // everything before the pages is put together here, zero filled so the padding is
+    char* front = calloc(layout.pages_offset, 1);
+    if (front == NULL) {
+        red("Memory allocation failed while writing the program image!\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(front, &layout, sizeof(layout));
+    image_source* sources = (image_source*)(front + layout.files_offset);
+    instruction_line* lines = (instruction_line*)(front + layout.lines_offset);
+    image_label* labels = (image_label*)(front + layout.labels_offset);
+    memcpy(front + layout.page_numbers_offset, page_numbers, page_count * sizeof(uint64_t));
+
+    uint64_t string_end = layout.strings_offset;
+    for (size_t i = 0; i < object_count; i++) {
+        const object_file* object = &objects[i];
+        sources[i].name_offset = place(&string_end, strlen(object->file_name) + 1, 1);
+        strcpy(front + sources[i].name_offset, object->file_name);
+        sources[i].size = object->source_size;
+        sources[i].hash = object->source_hash;
+        sources[i].first_instruction = object->first_instruction;
+        sources[i].instruction_count = object->text_count;
+        sources[i].data_address = object->data_address;
+        sources[i].data_size = object->data_size;
+    }
+    for (int i = 0; i < label_count; i++) {
+        labels[i].name_offset = place(&string_end, strlen(label_array[i].label_name) + 1, 1);
+        strcpy(front + labels[i].name_offset, label_array[i].label_name);
+        labels[i].line_num = label_array[i].line_num;
+        labels[i].file_line_num = label_array[i].file_line_num;
+    }
+    for (size_t i = 1; i <= max_instructions; i++) {
+        const char* text = instruction_text(i);
+        lines[i - 1].text_offset = place(&string_end, strlen(text) + 1, 1);
+        lines[i - 1].file_line_num = instructions_array[i].file_line_num;
+        strcpy(front + lines[i - 1].text_offset, text);
+    }
+
+    char* temporary_name = malloc(strlen(image_name) + 8);
+    if (temporary_name == NULL) {
+        red("Memory allocation failed while writing the program image!\n");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(temporary_name, "%s.tmp", image_name);
+
+    FILE* out = fopen(temporary_name, "wb");
+    bool written = out != NULL && fwrite(front, 1, layout.pages_offset, out) == layout.pages_offset;
+    uint8_t page[MEMORY_PAGE_SIZE];
+    for (size_t i = 0; written && i < page_count; i++) {
+        read_memory_block(page_numbers[i] << MEMORY_PAGE_BITS, page, MEMORY_PAGE_SIZE);
+        written = fwrite(page, 1, MEMORY_PAGE_SIZE, out) == MEMORY_PAGE_SIZE;
+    }
+    if (out != NULL && fclose(out) != 0) {
+        written = false;
+    }
+    if (written) {
+        written = rename(temporary_name, image_name) == 0;
+    } else if (out != NULL) {
+        remove(temporary_name);
+    }
+
+    free(temporary_name);
+    free(front);
+    free(page_numbers);
+    return written;
+}
+
+// After a load from source, cache its image next to the first file. A directory that can't be
+// written to just means no cache. Neither does .incbin: the image couldn't tell when the files
+// it included change.
+void write_loaded_image(char* const* file_names) {
+    for (size_t i = 0; i < object_count; i++) {
+        for (size_t j = 0; j < objects[i].fill_count; j++) {
+            if (objects[i].fills[j].contents != NULL) {
+                return;
+            }
+        }
+    }
+
+    char* image_name = cached_image_name(file_names[0]);
+    write_image(image_name);
+    free(image_name);
+}
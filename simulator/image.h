@@ -0,0 +1,14 @@
+#include <stddef.h>
+
+#ifndef IMAGE
+#define IMAGE
+
+#define IMAGE_EXTENSION ".gimg"
+#define IMAGE_VERSION 2
+
+_Bool is_image_name(const char* file_name);
+_Bool load_image(const char* image_name);
+_Bool load_cached_image(char* const* file_names, size_t file_count);
+_Bool write_image(const char* image_name);
+void write_loaded_image(char* const* file_names);
+#endif
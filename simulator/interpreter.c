@@ -0,0 +1,185 @@
+#include "interpreter.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "decode.h"
+#include "simulator.h"
+#include "utils.h"
+
+#if defined(THREADED_DISPATCH) && defined(__GNUC__)
+
+// Direct threaded interpreter: every operation has its own label and ends by jumping straight
+// to the label of the next instruction, so there is one indirect branch per guest instruction.
+// Returns the number of instructions executed; stops at the end of the program, at a
+// breakpoint, or after `limit` instructions.
+size_t run_instructions(size_t limit) {
+    static void* const labels[OP_COUNT] = {
+        [OP_NOP] = &&do_nop,
+        [OP_ADD] = &&do_add, [OP_SUB] = &&do_sub, [OP_XOR] = &&do_xor, [OP_OR] = &&do_or, [OP_AND] = &&do_and,
+        [OP_SLL] = &&do_sll, [OP_SRL] = &&do_srl, [OP_SRA] = &&do_sra, [OP_SLT] = &&do_slt, [OP_SLTU] = &&do_sltu,
+        [OP_ADDI] = &&do_addi, [OP_XORI] = &&do_xori, [OP_ORI] = &&do_ori, [OP_ANDI] = &&do_andi,
+        [OP_SLLI] = &&do_slli, [OP_SRLI] = &&do_srli, [OP_SRAI] = &&do_srai,
+        [OP_LB] = &&do_lb, [OP_LH] = &&do_lh, [OP_LW] = &&do_lw, [OP_LD] = &&do_ld,
+        [OP_LBU] = &&do_lbu, [OP_LHU] = &&do_lhu, [OP_LWU] = &&do_lwu,
+        [OP_JALR] = &&do_jalr,
+        [OP_SB] = &&do_sb, [OP_SH] = &&do_sh, [OP_SW] = &&do_sw, [OP_SD] = &&do_sd,
+        [OP_BEQ] = &&do_beq, [OP_BNE] = &&do_bne, [OP_BLT] = &&do_blt, [OP_BGE] = &&do_bge,
+        [OP_BLTU] = &&do_bltu, [OP_BGEU] = &&do_bgeu,
+        [OP_LUI] = &&do_lui,
+        [OP_JAL] = &&do_jal,
+    };
+
+    size_t executed = 0;
+    const decoded_instruction* d = NULL;
+
+#define DISPATCH()                                                                   \
+    do {                                                                             \
+        if (executed == limit || current_instruction > max_instructions || !begin_step()) { \
+            return executed;                                                         \
+        }                                                                            \
+        d = fetch_decoded(pc);                                                       \
+        if (d == NULL) {                                                             \
+            goto do_undecoded;                                                       \
+        }                                                                            \
+        goto *labels[d->op];                                                         \
+    } while (0)
+
+#define NEXT()              \
+    do {                    \
+        finish_step();      \
+        executed++;         \
+        DISPATCH();         \
+    } while (0)
+
+#define BRANCH_IF(condition)                  \
+    do {                                      \
+        if (condition) {                      \
+            current_instruction += d->imm / 4; \
+            pc += d->imm;                     \
+        }                                     \
+        NEXT();                               \
+    } while (0)
+
+    DISPATCH();
+
+do_nop:
+    NEXT();
+
+do_add:
+    registers[d->rd] = registers[d->rs1] + registers[d->rs2];
+    NEXT();
+do_sub:
+    registers[d->rd] = registers[d->rs1] - registers[d->rs2];
+    NEXT();
+do_xor:
+    registers[d->rd] = registers[d->rs1] ^ registers[d->rs2];
+    NEXT();
+do_or:
+    registers[d->rd] = registers[d->rs1] | registers[d->rs2];
+    NEXT();
+do_and:
+    registers[d->rd] = registers[d->rs1] & registers[d->rs2];
+    NEXT();
+do_sll:
+    registers[d->rd] = registers[d->rs1] << (registers[d->rs2] & 0x3F);
+    NEXT();
+do_srl:
+    registers[d->rd] = (uint64_t)registers[d->rs1] >> (registers[d->rs2] & 0x3F);
+    NEXT();
+do_sra:
+    registers[d->rd] = registers[d->rs1] >> (registers[d->rs2] & 0x3F);
+    NEXT();
+do_slt:
+    registers[d->rd] = (registers[d->rs1] < registers[d->rs2]) ? 1 : 0;
+    NEXT();
+do_sltu:
+    registers[d->rd] = ((uint64_t)registers[d->rs1] < (uint64_t)registers[d->rs2]) ? 1 : 0;
+    NEXT();
+
+do_addi:
+    registers[d->rd] = registers[d->rs1] + d->imm;
+    NEXT();
+do_xori:
+    registers[d->rd] = registers[d->rs1] ^ d->imm;
+    NEXT();
+do_ori:
+    registers[d->rd] = registers[d->rs1] | d->imm;
+    NEXT();
+do_andi:
+    registers[d->rd] = registers[d->rs1] & d->imm;
+    NEXT();
+do_slli:
+    registers[d->rd] = registers[d->rs1] << d->imm;
+    NEXT();
+do_srli:
+    registers[d->rd] = (uint64_t)registers[d->rs1] >> d->imm;
+    NEXT();
+do_srai:
+    registers[d->rd] = registers[d->rs1] >> d->imm;
+    NEXT();
+
+    // memory operations, jal and jalr go through the cache model / call stack, so reuse their handlers
+do_lb:
+do_lh:
+do_lw:
+do_ld:
+do_lbu:
+do_lhu:
+do_lwu:
+do_sb:
+do_sh:
+do_sw:
+do_sd:
+do_jalr:
+do_jal:
+    d->handler(d);
+    NEXT();
+
+do_beq:
+    BRANCH_IF(registers[d->rs1] == registers[d->rs2]);
+do_bne:
+    BRANCH_IF(registers[d->rs1] != registers[d->rs2]);
+do_blt:
+    BRANCH_IF(registers[d->rs1] < registers[d->rs2]);
+do_bge:
+    BRANCH_IF(registers[d->rs1] >= registers[d->rs2]);
+do_bltu:
+    BRANCH_IF((uint64_t)registers[d->rs1] < (uint64_t)registers[d->rs2]);
+do_bgeu:
+    BRANCH_IF((uint64_t)registers[d->rs1] >= (uint64_t)registers[d->rs2]);
+
+do_lui:
+    registers[d->rd] = d->imm;
+    NEXT();
+
+do_undecoded:
+    // pc left the text segment
+    execute(read_memory_word(pc));
+    NEXT();
+
+#undef DISPATCH
+#undef NEXT
+#undef BRANCH_IF
+}
+
+#else
+
+// Portable fallback and baseline for comparisons: fetch and decode_type() switch on every instruction
+size_t run_instructions(size_t limit) {
+    size_t executed = 0;
+
+    while (executed < limit && current_instruction <= max_instructions) {
+        if (!begin_step()) {
+            break;
+        }
+
+        execute(read_memory_word(pc));
+        finish_step();
+        executed++;
+    }
+    return executed;
+}
+
+#endif
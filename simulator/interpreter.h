@@ -0,0 +1,14 @@
+#include <stddef.h>
+
+#ifndef INTERPRETER
+#define INTERPRETER
+
+// Name of the dispatch loop compiled in, for reports
+#if defined(THREADED_DISPATCH) && defined(__GNUC__)
+#define DISPATCH_NAME "threaded"
+#else
+#define DISPATCH_NAME "switch"
+#endif
+
+size_t run_instructions(size_t limit);
+#endif
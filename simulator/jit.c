@@ -0,0 +1,415 @@
+#define _DEFAULT_SOURCE     // MAP_ANONYMOUS
+
+#include "jit.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "decode.h"
+#include "native.h"
+#include "utils.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+// Host registers, by x86-64 encoding number
+#define RAX 0
+#define RCX 1
+#define RBX 3       // guest register file
+#define RBP 5       // self-loop iteration count
+#define RSI 6
+#define RDI 7
+#define HOT_REGISTERS 4     // r12-r15 hold the most used guest registers of a block
+
+static uint8_t* code_buffer = NULL;     // RX while running, flipped to RW while a block is emitted
+static size_t code_used = 0;
+static bool code_unavailable = false;
+static bool code_full = false;
+
+static uint8_t* emit_pointer;
+static const translated_block* emit_block;
+static int8_t host_register[32];        // guest register -> r12-r15, or -1 when it lives in memory
+static uint8_t cached_guest[HOT_REGISTERS];
+static size_t cached_count;
+
+static void emit_byte(uint8_t byte) {
+    *emit_pointer++ = byte;
+}
+
+static void emit_bytes(const uint8_t* bytes, size_t count) {
+    memcpy(emit_pointer, bytes, count);
+    emit_pointer += count;
+}
+
+static void emit_u32(uint32_t value) {
+    memcpy(emit_pointer, &value, 4);
+    emit_pointer += 4;
+}
+
+static void emit_u64(uint64_t value) {
+    memcpy(emit_pointer, &value, 8);
+    emit_pointer += 8;
+}
+
+// Returns where the rel32 goes, for patch_jump()
+static uint8_t* emit_jump(uint8_t condition) {
+    if (condition) {
+        emit_byte(0x0F);
+        emit_byte(condition);
+    } else {
+        emit_byte(0xE9);
+    }
+    uint8_t* field = emit_pointer;
+    emit_u32(0);
+    return field;
+}
+
+static void patch_jump(uint8_t* field, const uint8_t* target) {
+    int32_t offset = target - (field + 4);
+    memcpy(field, &offset, 4);
+}
+
+static void emit_jump_to(uint8_t condition, const uint8_t* target) {
+    patch_jump(emit_jump(condition), target);
+}
+
+// mov dst, src (64-bit)
+static void emit_move(int dst, int src) {
+    emit_byte(0x48 | (src >= 8 ? 0x04 : 0) | (dst >= 8 ? 0x01 : 0));
+    emit_byte(0x89);
+    emit_byte(0xC0 | (src & 7) << 3 | (dst & 7));
+}
+
+// host <- guest register
+static void emit_get(int host, uint8_t guest) {
+    if (guest == 0) {
+        if (host >= 8) {
+            emit_byte(0x45);
+        }
+        emit_byte(0x31);    // xor host32, host32
+        emit_byte(0xC0 | (host & 7) << 3 | (host & 7));
+    } else if (host_register[guest] >= 0) {
+        emit_move(host, host_register[guest]);
+    } else {
+        emit_byte(0x48 | (host >= 8 ? 0x04 : 0));
+        emit_byte(0x8B);    // mov host, [rbx + disp32]
+        emit_byte(0x80 | (host & 7) << 3 | RBX);
+        emit_u32(guest * 8);
+    }
+}
+
+// guest register <- host
+static void emit_put(uint8_t guest, int host) {
+    if (guest == 0) {
+        return;
+    }
+    if (host_register[guest] >= 0) {
+        emit_move(host_register[guest], host);
+    } else {
+        emit_byte(0x48 | (host >= 8 ? 0x04 : 0));
+        emit_byte(0x89);    // mov [rbx + disp32], host
+        emit_byte(0x80 | (host & 7) << 3 | RBX);
+        emit_u32(guest * 8);
+    }
+}
+
+// op rax, imm32 (sign extended), with the short rax form of add/or/and/xor
+static void emit_rax_immediate(uint8_t opcode, int64_t imm) {
+    emit_byte(0x48);
+    emit_byte(opcode);
+    emit_u32((uint32_t)imm);
+}
+
+static void emit_call(void* function) {
+    emit_bytes((const uint8_t[]){0x48, 0xB8}, 2);     // movabs rax, function
+    emit_u64((uint64_t)(uintptr_t)function);
+    emit_bytes((const uint8_t[]){0xFF, 0xD0}, 2);     // call rax
+}
+
+// Write the cached registers back and return (iterations * length + retired) << 32 | next_pc
+static void emit_exit(uint32_t retired, uint32_t next_pc) {
+    for (size_t i = 0; i < cached_count; i++) {
+        uint8_t guest = cached_guest[i];
+        emit_byte(0x4C);
+        emit_byte(0x89);
+        emit_byte(0x80 | (host_register[guest] & 7) << 3 | RBX);
+        emit_u32(guest * 8);
+    }
+
+    emit_bytes((const uint8_t[]){0x48, 0x69, 0xC5}, 3);     // imul rax, rbp, length
+    emit_u32(emit_block->length);
+    emit_rax_immediate(0x05, retired);                       // add rax, retired
+    emit_bytes((const uint8_t[]){0x48, 0xC1, 0xE0, 0x20}, 4);   // shl rax, 32
+    emit_byte(0xB9);                                         // mov ecx, next_pc
+    emit_u32(next_pc);
+    emit_bytes((const uint8_t[]){0x48, 0x09, 0xC8}, 3);     // or rax, rcx
+
+    static const uint8_t epilogue[] = {
+        0x48, 0x83, 0xC4, 0x08,     // add rsp, 8
+        0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C,     // pop r15, r14, r13, r12
+        0x5D, 0x5B,                 // pop rbp, rbx
+        0xC3,
+    };
+    emit_bytes(epilogue, sizeof(epilogue));
+}
+
+static bool reads_rs1(uint8_t op) {
+    return op != OP_NOP && op != OP_LUI && op != OP_JAL;
+}
+
+static bool reads_rs2(uint8_t op) {
+    return (op >= OP_ADD && op <= OP_SLTU) || (op >= OP_SB && op <= OP_SD) || (op >= OP_BEQ && op <= OP_BGEU);
+}
+
+static bool writes_rd(uint8_t op) {
+    return (op >= OP_ADD && op <= OP_LWU) || op == OP_LUI;
+}
+
+// Keep the most used guest registers of the block in r12-r15
+static void assign_host_registers(size_t count) {
+    unsigned uses[32] = {0};
+    for (size_t i = 0; i < count; i++) {
+        const decoded_instruction* d = &emit_block->ops[i];
+        if (reads_rs1(d->op)) {
+            uses[d->rs1]++;
+        }
+        if (reads_rs2(d->op)) {
+            uses[d->rs2]++;
+        }
+        if (writes_rd(d->op)) {
+            uses[d->rd]++;
+        }
+    }
+    uses[0] = 0;
+
+    memset(host_register, -1, sizeof(host_register));
+    for (cached_count = 0; cached_count < HOT_REGISTERS; cached_count++) {
+        uint8_t best = 0;
+        for (uint8_t r = 1; r < 32; r++) {
+            if (host_register[r] < 0 && uses[r] > uses[best]) {
+                best = r;
+            }
+        }
+        if (best == 0) {
+            break;
+        }
+        host_register[best] = 12 + cached_count;
+        cached_guest[cached_count] = best;
+    }
+}
+
+static void emit_alu(const decoded_instruction* d) {
+    static const uint8_t register_opcodes[] = {
+        [OP_ADD] = 0x01, [OP_SUB] = 0x29, [OP_XOR] = 0x31, [OP_OR] = 0x09, [OP_AND] = 0x21,
+    };
+    static const uint8_t immediate_opcodes[] = {
+        [OP_ADDI] = 0x05, [OP_XORI] = 0x35, [OP_ORI] = 0x0D, [OP_ANDI] = 0x25,
+    };
+    static const uint8_t shift_modrm[] = {
+        [OP_SLL] = 0xE0, [OP_SRL] = 0xE8, [OP_SRA] = 0xF8,
+        [OP_SLLI] = 0xE0, [OP_SRLI] = 0xE8, [OP_SRAI] = 0xF8,
+    };
+
+    switch (d->op) {
+        case OP_ADD: case OP_SUB: case OP_XOR: case OP_OR: case OP_AND:
+            emit_get(RAX, d->rs1);
+            emit_get(RCX, d->rs2);
+            emit_bytes((const uint8_t[]){0x48, register_opcodes[d->op], 0xC8}, 3);  // op rax, rcx
+            break;
+        case OP_SLL: case OP_SRL: case OP_SRA:
+            // x86 masks a 64-bit shift count to 6 bits, like the & 0x3F in the interpreter
+            emit_get(RAX, d->rs1);
+            emit_get(RCX, d->rs2);
+            emit_bytes((const uint8_t[]){0x48, 0xD3, shift_modrm[d->op]}, 3);        // shift rax, cl
+            break;
+        case OP_SLT: case OP_SLTU:
+            emit_get(RAX, d->rs1);
+            emit_get(RCX, d->rs2);
+            emit_bytes((const uint8_t[]){0x48, 0x39, 0xC8}, 3);                      // cmp rax, rcx
+            emit_bytes((const uint8_t[]){0x0F, d->op == OP_SLT ? 0x9C : 0x92, 0xC0}, 3);  // setl/setb al
+            emit_bytes((const uint8_t[]){0x0F, 0xB6, 0xC0}, 3);                      // movzx eax, al
+            break;
+        case OP_ADDI: case OP_XORI: case OP_ORI: case OP_ANDI:
+            emit_get(RAX, d->rs1);
+            emit_rax_immediate(immediate_opcodes[d->op], d->imm);
+            break;
+        case OP_SLLI: case OP_SRLI: case OP_SRAI:
+            emit_get(RAX, d->rs1);
+            emit_bytes((const uint8_t[]){0x48, 0xC1, shift_modrm[d->op], (uint8_t)d->imm}, 4);
+            break;
+        case OP_LUI:
+            emit_bytes((const uint8_t[]){0x48, 0xB8}, 2);   // movabs rax, imm
+            emit_u64(d->imm);
+            break;
+    }
+    emit_put(d->rd, RAX);
+}
+
+static void emit_load(const decoded_instruction* d) {
+    void* const helpers[] = {
+        [OP_LB] = guest_runtime.load_byte, [OP_LH] = guest_runtime.load_half,
+        [OP_LW] = guest_runtime.load_word, [OP_LD] = guest_runtime.load_dword,
+        [OP_LBU] = guest_runtime.load_byte_unsigned, [OP_LHU] = guest_runtime.load_half_unsigned,
+        [OP_LWU] = guest_runtime.load_word_unsigned,
+    };
+
+    // a load into x0 is still made, the cache model counts it
+    emit_get(RAX, d->rs1);
+    emit_rax_immediate(0x05, d->imm);
+    emit_move(RDI, RAX);
+    emit_call(helpers[d->op]);
+    if (d->rd != 0) {
+        emit_put(d->rd, RAX);
+    }
+}
+
+static void emit_store(const decoded_instruction* d, size_t index) {
+    void* const helpers[] = {
+        [OP_SB] = guest_runtime.store_byte, [OP_SH] = guest_runtime.store_half,
+        [OP_SW] = guest_runtime.store_word, [OP_SD] = guest_runtime.store_dword,
+    };
+
+    emit_get(RAX, d->rs1);
+    emit_rax_immediate(0x05, d->imm);
+    emit_move(RDI, RAX);
+    emit_get(RSI, d->rs2);
+    emit_call(helpers[d->op]);
+
+    // self-modifying code: leave right after the store
+    emit_bytes((const uint8_t[]){0x48, 0x85, 0xC0}, 3);     // test rax, rax
+    uint8_t* skip = emit_jump(0x84);                        // jz
+    emit_exit(index + 1, emit_block->start_pc + (index + 1) * 4);
+    patch_jump(skip, emit_pointer);
+}
+
+static void emit_branch(const decoded_instruction* d, const uint8_t* loop_start) {
+    static const uint8_t conditions[] = {
+        [OP_BEQ] = 0x84, [OP_BNE] = 0x85, [OP_BLT] = 0x8C, [OP_BGE] = 0x8D, [OP_BLTU] = 0x82, [OP_BGEU] = 0x83,
+    };
+
+    emit_get(RAX, d->rs1);
+    emit_get(RCX, d->rs2);
+    emit_bytes((const uint8_t[]){0x48, 0x39, 0xC8}, 3);     // cmp rax, rcx
+    uint8_t* taken = emit_jump(conditions[d->op]);
+    emit_exit(emit_block->length, emit_block->fallthrough_pc);
+
+    patch_jump(taken, emit_pointer);
+    if (d->target == emit_block->start_pc) {
+        // loop in place, bounded so the caller's instruction budget still holds
+        emit_bytes((const uint8_t[]){0x48, 0xFF, 0xC5}, 3);             // inc rbp
+        emit_bytes((const uint8_t[]){0x48, 0x3B, 0x2C, 0x24}, 4);       // cmp rbp, [rsp]
+        emit_jump_to(0x82, loop_start);                                 // jb
+        emit_exit(0, emit_block->start_pc);
+    } else {
+        emit_exit(emit_block->length, d->target);
+    }
+}
+
+static bool reserve_code_buffer() {
+    if (code_buffer == NULL && !code_unavailable) {
+        code_buffer = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code_buffer == MAP_FAILED) {
+            code_buffer = NULL;
+            code_unavailable = true;
+            yellow("Warning: JIT disabled, executable memory not available.\n");
+        }
+    }
+    return code_buffer != NULL;
+}
+
+// Compile a translated block. Returns NULL if there is nothing worth compiling, no executable
+// memory, or the code buffer is full (see jit_out_of_space()).
+native_block jit_compile(const translated_block* block) {
+    const decoded_instruction* last = &block->ops[block->length - 1];
+    bool ends_in_jump = last->op == OP_JAL || last->op == OP_JALR;
+    size_t body = ends_in_jump ? block->length - 1 : block->length;
+
+    if (body == 0 || !reserve_code_buffer()) {
+        return NULL;
+    }
+
+    // generous upper bound on the code for one instruction, including a store's exit path
+    size_t worst_case = 256 + block->length * 160;
+    if (code_used + worst_case > JIT_CODE_SIZE) {
+        code_full = true;
+        return NULL;
+    }
+
+    if (mprotect(code_buffer, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        return NULL;
+    }
+
+    uint8_t* start = code_buffer + code_used;
+    emit_pointer = start;
+    emit_block = block;
+    assign_host_registers(body);
+
+    static const uint8_t prologue[] = {
+        0x53, 0x55,                 // push rbx, rbp
+        0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,     // push r12, r13, r14, r15
+        0x48, 0x83, 0xEC, 0x08,     // sub rsp, 8 (keeps calls 16-byte aligned)
+        0x48, 0x89, 0xFB,           // mov rbx, rdi
+        0x48, 0x89, 0x34, 0x24,     // mov [rsp], rsi
+        0x31, 0xED,                 // xor ebp, ebp
+    };
+    emit_bytes(prologue, sizeof(prologue));
+    for (size_t i = 0; i < cached_count; i++) {
+        uint8_t guest = cached_guest[i];
+        emit_byte(0x4C);
+        emit_byte(0x8B);
+        emit_byte(0x80 | (host_register[guest] & 7) << 3 | RBX);
+        emit_u32(guest * 8);
+    }
+    const uint8_t* loop_start = emit_pointer;
+
+    for (size_t i = 0; i < body; i++) {
+        const decoded_instruction* d = &block->ops[i];
+        if (d->op >= OP_LB && d->op <= OP_LWU) {
+            emit_load(d);
+        } else if (d->op >= OP_SB && d->op <= OP_SD) {
+            emit_store(d, i);
+        } else if (d->op >= OP_BEQ && d->op <= OP_BGEU) {
+            emit_branch(d, loop_start);     // only ever the last instruction
+        } else if (d->op != OP_NOP) {
+            emit_alu(d);
+        }
+    }
+
+    if (ends_in_jump) {
+        emit_exit(body, block->start_pc + body * 4);
+    } else if (!(last->op >= OP_BEQ && last->op <= OP_BGEU)) {
+        emit_exit(block->length, block->fallthrough_pc);
+    }
+
+    code_used = (emit_pointer - code_buffer + 15) & ~(size_t)15;
+    mprotect(code_buffer, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+    return (native_block)(uintptr_t)start;
+}
+
+_Bool jit_out_of_space() {
+    return code_full;
+}
+
+// Forget all compiled code; the translated blocks pointing at it must be dropped too
+void jit_reset() {
+    code_used = 0;
+    code_full = false;
+}
+
+#else
+
+native_block jit_compile(const translated_block* block) {
+    (void)block;
+    return NULL;
+}
+
+_Bool jit_out_of_space() {
+    return false;
+}
+
+void jit_reset() {
+}
+
+#endif
@@ -0,0 +1,22 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "blocks.h"
+
+#ifndef JIT
+#define JIT
+
+#define JIT_THRESHOLD 64                    // block executions before it is compiled
+#define JIT_CODE_SIZE (16 << 20)            // bytes of host code kept before the buffer is recycled
+#define JIT_MAX_ITERATIONS (1 << 20)        // cap on self-loop iterations per call, keeps retired counts in 32 bits
+
+#if defined(__x86_64__)
+#define JIT_AVAILABLE 1
+#else
+#define JIT_AVAILABLE 0
+#endif
+
+native_block jit_compile(const translated_block* block);
+_Bool jit_out_of_space();
+void jit_reset();
+#endif
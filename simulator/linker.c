@@ -0,0 +1,357 @@
+#include "linker.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "simulator.h"
+#include "utils.h"
+
+object_file* objects = NULL;
+size_t object_count = 0;
+
+// Files are handed to the assembler threads one at a time, so one big file doesn't hold up the rest
+typedef struct assembly_queue {
+    object_file* objects;
+    size_t count;
+    atomic_size_t next;
+} assembly_queue;
+
+static void* assemble_queued_objects(void* argument) {
+    assembly_queue* queue = argument;
+    size_t index;
+    while ((index = atomic_fetch_add(&queue->next, 1)) < queue->count) {
+        assemble_source(&queue->objects[index]);
+    }
+    return NULL;
+}
+
+// Assemble every object, on up to one thread per core. The calling thread takes part, so a
+// single file is assembled without starting any thread.
+static void assemble_objects() {
+    assembly_queue queue = {.objects = objects, .count = object_count};
+    atomic_init(&queue.next, 0);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t thread_count = object_count;
+    if (cores > 0 && (size_t)cores < thread_count) {
+        thread_count = cores;
+    }
+    if (thread_count > MAX_ASSEMBLER_THREADS) {
+        thread_count = MAX_ASSEMBLER_THREADS;
+    }
+
+    // the mnemonic and register tables are built on first use, which must not happen on two threads
+    build_lookup_tables();
+
+    pthread_t threads[MAX_ASSEMBLER_THREADS];
+    size_t started = 0;
+    while (started + 1 < thread_count && pthread_create(&threads[started], NULL, assemble_queued_objects, &queue) == 0) {
+        started++;
+    }
+    assemble_queued_objects(&queue);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static void report_error(const object_file* object, int line, const char* text, int code) {
+    red("\n\033[4m%s:%d\033[0m: %s", object->file_name, line, text);
+    red("Error: ");
+    printf("%s", get_error_string(code));
+}
+
+// Show the error of every file that failed, in load order. error_code becomes the first one.
+static bool report_object_errors() {
+    error_code = 0;
+    for (size_t i = 0; i < object_count; i++) {
+        const object_file* object = &objects[i];
+        if (object->error_code != 0 && object->error_text != NULL) {
+            report_error(object, object->error_line, object->error_text, object->error_code);
+        }
+        if (error_code == 0) {
+            error_code = object->error_code;
+        }
+    }
+    return error_code == 0;
+}
+
+// Labels declared .globl, by name, with line_num their instruction in the linked program
+static label_table exports;
+static arena export_names;
+static size_t* export_owners = NULL;    // object defining each export
+
+static bool collect_exports() {
+    size_t global_count = 0;
+    for (size_t i = 0; i < object_count; i++) {
+        global_count += objects[i].global_count;
+    }
+    export_owners = realloc(export_owners, (global_count + 1) * sizeof(size_t));
+    if (export_owners == NULL) {
+        red("Memory allocation failed while linking!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < object_count; i++) {
+        const object_file* object = &objects[i];
+        for (size_t j = 0; j < object->global_count; j++) {
+            const char* name = object->globals[j];
+            size_t length = strlen(name);
+
+            // a .globl without a definition only says the label is in another file
+            int defined = find_label(&object->labels, name, length);
+            if (defined == -1) {
+                continue;
+            }
+            const label* definition = &object->labels.labels[defined];
+
+            int existing = find_label(&exports, name, length);
+            if (existing != -1) {
+                if (export_owners[existing] == i) {
+                    continue;   // declared twice in the same file
+                }
+                printf("%s:%d: Global label '%s' is also defined in %s at line %d.\n", object->file_name, definition->file_line_num, name,
+                       objects[export_owners[existing]].file_name, exports.labels[existing].file_line_num);
+                error_code = 200;
+                return false;
+            }
+
+            export_owners[exports.count] = i;
+            add_label(&exports, name, length, object->first_instruction + definition->line_num - 1, definition->file_line_num);
+        }
+    }
+    return true;
+}
+
+// Patch the branches and jumps each file makes to labels of other files
+static bool resolve_external_fixups() {
+    for (size_t i = 0; i < object_count; i++) {
+        object_file* object = &objects[i];
+        for (size_t j = 0; j < object->fixup_count; j++) {
+            const label_fixup* fixup = &object->fixups[j];
+            const char* text = source_text + object->lines[fixup->instruction - 1].text_offset;
+
+            int target = find_label(&exports, fixup->label_name, strlen(fixup->label_name));
+            if (target == -1) {
+                // 109 is label not found
+                error_code = 109;
+                report_error(object, fixup->file_line_num, text, error_code);
+                return false;
+            }
+
+            long int instruction = object->first_instruction + fixup->instruction - 1;
+            long int num_bytes_to_jump = (exports.labels[target].line_num - instruction) * 4;
+            if (!apply_fixup(object, fixup, num_bytes_to_jump)) {
+                report_error(object, fixup->file_line_num, text, error_code);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// A page holding the fill's pattern at the offsets it has in every page of the run
+static uint8_t* fill_pattern_page(data_fill* fill, uint64_t address) {
+    if (fill->page == NULL) {
+        fill->page = aligned_alloc(MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE);
+        if (fill->page == NULL) {
+            red("Memory allocation failed while linking!\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < MEMORY_PAGE_SIZE; i++) {
+            size_t shift = (i - address) % fill->pattern_size;
+            fill->page[i] = (fill->pattern >> (shift * 8)) & 0xFF;
+        }
+    }
+    return fill->page;
+}
+
+// Write a fill from address a page at a time. Whole pages are shared, not copied, when the
+// bytes for them start a host page too: always for a pattern, and for .incbin when the fill
+// starts a guest page.
+static void write_data_fill(data_fill* fill, uint64_t address) {
+    if (fill->contents == NULL && fill->pattern == 0) {
+        return;     // untouched memory reads as zero
+    }
+    const uint8_t* pattern = fill->contents == NULL ? fill_pattern_page(fill, address) : NULL;
+
+    uint64_t end = address + fill->size;
+    for (uint64_t page = address; page < end;) {
+        uint64_t next = (page | MEMORY_PAGE_MASK) + 1;
+        if (next > end) {
+            next = end;
+        }
+        const uint8_t* bytes = pattern ? pattern + (page & MEMORY_PAGE_MASK) : fill->contents + (page - address);
+        if (next - page == MEMORY_PAGE_SIZE && ((uintptr_t)bytes & MEMORY_PAGE_MASK) == 0) {
+            share_memory_page(page, (uint8_t*)bytes);
+        } else {
+            write_memory_block(page, bytes, next - page);
+        }
+        page = next;
+    }
+}
+
+// Write an object's .data section: its values as they are, with its fills in between
+static void write_object_data(object_file* object) {
+    uint64_t address = object->data_address;
+    size_t written = 0;
+    for (size_t i = 0; i < object->fill_count; i++) {
+        data_fill* fill = &object->fills[i];
+        write_memory_block(address, object->data + written, fill->data_offset - written);
+        address += fill->data_offset - written;
+        written = fill->data_offset;
+
+        write_data_fill(fill, address);
+        address += fill->size;
+    }
+    write_memory_block(address, object->data + written, object->data_length - written);
+}
+
+// Place the text of every object one after another from address 0 and the data from
+// DATA_SECTION_START, resolve the branches between files, and gather every label into label_array
+static bool link_objects() {
+    size_t next_instruction = 1;
+    int total_labels = 0;
+    for (size_t i = 0; i < object_count; i++) {
+        objects[i].first_instruction = next_instruction;
+        next_instruction += objects[i].text_count;
+        total_labels += objects[i].labels.count;
+    }
+
+    arena_init(&export_names, 4096, 16);
+    exports.names = &export_names;
+    bool linked = collect_exports() && resolve_external_fixups();
+    free_label_table(&exports);
+    arena_release(&export_names);
+    free(export_owners);
+    export_owners = NULL;
+    if (!linked) {
+        return false;
+    }
+
+    uint64_t data_address = DATA_SECTION_START;
+    for (size_t i = 0; i < object_count; i++) {
+        object_file* object = &objects[i];
+        for (size_t j = 0; j < object->text_count; j++) {
+            write_memory_word((object->first_instruction + j - 1) * 4, object->text[j]);
+            add_instruction_line(object->lines[j].text_offset, object->lines[j].file_line_num);
+            max_instructions++;
+        }
+
+        // .align counts from the start of the file's section, which must then be aligned as well
+        if (object->data_alignment > 1) {
+            data_address = (data_address + object->data_alignment - 1) & ~(uint64_t)(object->data_alignment - 1);
+        }
+        object->data_address = data_address;
+        write_object_data(object);
+        data_address += object->data_size;
+    }
+
+    label_array = malloc((total_labels + 1) * sizeof(label));
+    if (label_array == NULL) {
+        red("Memory allocation failed while linking!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < object_count; i++) {
+        const object_file* object = &objects[i];
+        for (int j = 0; j < object->labels.count; j++) {
+            label_array[label_count] = object->labels.labels[j];
+            label_array[label_count].line_num += object->first_instruction - 1;
+            label_count++;
+        }
+    }
+    return true;
+}
+
+// Map, assemble and link the program made of the given files. Returns false if a file can't be
+// read; assembly and link errors are reported and left in error_code.
+_Bool load_objects(char* const* file_names, size_t count) {
+    size_t* offsets = malloc(count * sizeof(size_t));
+    size_t* sizes = malloc(count * sizeof(size_t));
+    if (offsets == NULL || sizes == NULL) {
+        red("Memory allocation failed while loading!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t mapped = map_source_files(file_names, count, offsets, sizes);
+    if (mapped != count) {
+        red("File \"%s\" not found.\n", file_names[mapped]);
+        free_objects();
+        free(offsets);
+        free(sizes);
+        return false;
+    }
+
+    object_file* loaded = malloc(count * sizeof(object_file));
+    if (loaded == NULL) {
+        red("Memory allocation failed while loading!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count; i++) {
+        init_object(&loaded[i], file_names[i], source_text + offsets[i], sizes[i]);
+
+        // a file loaded before brings the lines it assembled to, so only what changed is assembled
+        size_t previous = find_object(file_names[i]);
+        if (previous != object_count && objects[previous].known_lines.source != NULL) {
+            free_line_cache(&loaded[i].known_lines);
+            loaded[i].known_lines = objects[previous].known_lines;
+            memset(&objects[previous].known_lines, 0, sizeof(line_cache));
+        }
+    }
+    free(offsets);
+    free(sizes);
+
+    free_objects();
+    objects = loaded;
+    object_count = count;
+
+    assemble_objects();
+    if (report_object_errors()) {
+        link_objects();
+    }
+    return true;
+}
+
+// Objects stay around after linking: label names and error texts point into them
+void free_objects() {
+    for (size_t i = 0; i < object_count; i++) {
+        free_object(&objects[i]);
+    }
+    free(objects);
+    objects = NULL;
+    object_count = 0;
+}
+
+// Index of the object loaded from file_name, or object_count
+size_t find_object(const char* file_name) {
+    for (size_t i = 0; i < object_count; i++) {
+        if (strcmp(objects[i].file_name, file_name) == 0) {
+            return i;
+        }
+    }
+    return object_count;
+}
+
+// Index of the object holding an instruction
+size_t object_of_instruction(size_t instruction) {
+    size_t low = 0;
+    size_t high = object_count;
+    while (high - low > 1) {
+        size_t middle = (low + high) / 2;
+        if (objects[middle].first_instruction <= instruction) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+const char* instruction_file_name(size_t instruction) {
+    return object_count ? objects[object_of_instruction(instruction)].file_name : current_file_name;
+}
@@ -0,0 +1,22 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "assembler.h"
+
+#ifndef LINKER
+#define LINKER
+
+#define DATA_SECTION_START 0x10000      // the .data sections of all files follow each other from here
+#define MAX_ASSEMBLER_THREADS 64
+
+// The files of the loaded program, in load order. Their text follows each other from address 0,
+// so the first file's first instruction is where execution starts.
+extern object_file* objects;
+extern size_t object_count;
+
+_Bool load_objects(char* const* file_names, size_t count);
+void free_objects();
+size_t find_object(const char* file_name);
+size_t object_of_instruction(size_t instruction);
+const char* instruction_file_name(size_t instruction);
+#endif
@@ -0,0 +1,421 @@
+#include "memory.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "utils.h"
+
+static memory_directory memory_root;                       // top level directory, never freed
+static memory_tlb_entry memory_read_tlb[MEMORY_TLB_SIZE];   // recently read pages, direct mapped by page number
+static memory_tlb_entry memory_write_tlb[MEMORY_TLB_SIZE];  // recently written pages, never shared with a snapshot
+
+// Pages and directories are carved from one arena, so dropping guest memory is a reset, not a walk
+static arena memory_arena;
+static _Bool memory_arena_ready = false;
+static size_t resident_pages = 0;
+static size_t directory_bytes = 0;
+static size_t shared_pages = 0;         // resident pages that aren't from the arena, see share_memory_page()
+static size_t shared_host_pages = 0;    // distinct host pages behind them: a .fill shares one for all its pages
+static uint8_t* last_shared_page = NULL;
+static uint8_t* free_pages = NULL;      // pages given back by a snapshot restore, linked through their first bytes
+
+// Snapshot state. A page belongs to the snapshot when its epoch is older than memory_epoch;
+// the first write to such a page copies it and logs the original so it can be put back.
+static uint32_t memory_epoch = 0;
+#define SHARED_PAGE_EPOCH UINT32_MAX    // epoch of pages owned by someone else, never current
+static _Bool snapshot_taken = false;
+static memory_dirty_page* dirty_pages = NULL;
+static size_t dirty_page_count = 0;
+static size_t dirty_page_capacity = 0;
+
+// Writes into [0, code_region_end) are reported so decoded instructions can be dropped
+static uint64_t code_region_end = 0;
+static code_write_callback code_region_callback = NULL;
+
+static inline void check_code_write(uint64_t address, size_t length) {
+    if (address < code_region_end) {
+        code_region_callback(address, length);
+    }
+}
+
+// Zero filled page or directory from the arena
+static void* allocate_guest_storage(size_t size) {
+    if (!memory_arena_ready) {
+        arena_init(&memory_arena, MEMORY_ARENA_CHUNK_SIZE, MEMORY_PAGE_SIZE);
+        memory_arena_ready = true;
+    }
+
+    void* storage = arena_alloc(&memory_arena, size, MEMORY_PAGE_SIZE);
+    memset(storage, 0, size);   // chunks are recycled across loads
+    return storage;
+}
+
+static uint8_t* allocate_page() {
+    resident_pages++;
+    if (free_pages != NULL) {
+        uint8_t* page = free_pages;
+        memcpy(&free_pages, page, sizeof(uint8_t*));
+        memset(page, 0, MEMORY_PAGE_SIZE);
+        return page;
+    }
+    return allocate_guest_storage(MEMORY_PAGE_SIZE);
+}
+
+static void recycle_page(uint8_t* page) {
+    resident_pages--;
+    memcpy(page, &free_pages, sizeof(uint8_t*));
+    free_pages = page;
+}
+
+// index into the directory at the given level (0 is the root)
+static inline size_t directory_index(uint64_t page_number, int level) {
+    return (page_number >> (MEMORY_LEVEL_BITS * (MEMORY_LEVELS - 1 - level))) & (MEMORY_LEVEL_SIZE - 1);
+}
+
+// Walk the directories down to the leaf holding page_number. Returns NULL if it doesn't
+// exist yet, unless allocate is set, in which case missing levels are created zero filled.
+static memory_leaf* find_leaf(uint64_t page_number, _Bool allocate) {
+    memory_directory* directory = &memory_root;
+
+    for (int level = 0; level < MEMORY_LEVELS - 1; level++) {
+        void** entry = &directory->entries[directory_index(page_number, level)];
+        if (*entry == NULL) {
+            if (!allocate) {
+                return NULL;
+            }
+            size_t size = (level == MEMORY_LEVELS - 2) ? sizeof(memory_leaf) : sizeof(memory_directory);
+            *entry = allocate_guest_storage(size);
+            directory_bytes += size;
+        }
+        directory = *entry;
+    }
+    return (memory_leaf*)directory;
+}
+
+static void log_dirty_page(uint64_t page_number, memory_leaf* leaf, size_t index) {
+    if (dirty_page_count == dirty_page_capacity) {
+        dirty_page_capacity = dirty_page_capacity ? dirty_page_capacity * 2 : 64;
+        dirty_pages = realloc(dirty_pages, dirty_page_capacity * sizeof(memory_dirty_page));
+        if (dirty_pages == NULL) {
+            red("Memory allocation failed while logging dirty pages!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memory_dirty_page* dirty = &dirty_pages[dirty_page_count++];
+    dirty->page_number = page_number;
+    dirty->leaf = leaf;
+    dirty->index = index;
+    dirty->page = leaf->pages[index];
+    dirty->epoch = leaf->epochs[index];
+}
+
+static inline uint8_t* find_page(uint64_t address) {
+    uint64_t page_number = address >> MEMORY_PAGE_BITS;
+    memory_tlb_entry* tlb = &memory_read_tlb[page_number % MEMORY_TLB_SIZE];
+
+    if (tlb->page != NULL && tlb->page_number == page_number) {
+        return tlb->page;
+    }
+
+    memory_leaf* leaf = find_leaf(page_number, false);
+    if (leaf == NULL) {
+        return NULL;
+    }
+
+    uint8_t* page = leaf->pages[directory_index(page_number, MEMORY_LEVELS - 1)];
+    if (page != NULL) {
+        tlb->page_number = page_number;
+        tlb->page = page;
+    }
+    return page;
+}
+
+// Page that may be written: allocated on first touch, copied first if the snapshot still owns it
+static inline uint8_t* find_writable_page(uint64_t address) {
+    uint64_t page_number = address >> MEMORY_PAGE_BITS;
+    memory_tlb_entry* tlb = &memory_write_tlb[page_number % MEMORY_TLB_SIZE];
+
+    if (tlb->page != NULL && tlb->page_number == page_number) {
+        return tlb->page;
+    }
+
+    memory_leaf* leaf = find_leaf(page_number, true);
+    size_t index = directory_index(page_number, MEMORY_LEVELS - 1);
+
+    if (leaf->pages[index] == NULL) {
+        if (snapshot_taken) {
+            log_dirty_page(page_number, leaf, index);
+        }
+        leaf->pages[index] = allocate_page();
+        leaf->epochs[index] = memory_epoch;
+
+    } else if (leaf->epochs[index] != memory_epoch) {
+        // copy on write
+        log_dirty_page(page_number, leaf, index);
+        uint8_t* copy = allocate_page();
+        memcpy(copy, leaf->pages[index], MEMORY_PAGE_SIZE);
+        leaf->pages[index] = copy;
+        leaf->epochs[index] = memory_epoch;
+    }
+
+    uint8_t* page = leaf->pages[index];
+    tlb->page_number = page_number;
+    tlb->page = page;
+
+    // the read TLB may still point at the snapshot's copy
+    memory_tlb_entry* read_tlb = &memory_read_tlb[page_number % MEMORY_TLB_SIZE];
+    read_tlb->page_number = page_number;
+    read_tlb->page = page;
+    return page;
+}
+
+// Read `size` bytes (at most 8) as a little endian value
+static inline uint64_t read_memory_value(uint64_t address, int size) {
+    uint64_t offset = address & MEMORY_PAGE_MASK;
+    uint64_t value = 0;
+
+    // fast path: the access lies within a single page
+    if (offset + size <= MEMORY_PAGE_SIZE) {
+        uint8_t* page = find_page(address);
+        if (page == NULL) {
+            return 0;   // untouched memory reads as zero
+        }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(&value, page + offset, size);
+#else
+        for (int i = 0; i < size; i++) {
+            value |= (uint64_t)page[offset + i] << (i * 8);
+        }
+#endif
+        return value;
+    }
+
+    // access straddles two pages
+    for (int i = 0; i < size; i++) {
+        value |= (uint64_t)read_memory_byte(address + i) << (i * 8);
+    }
+    return value;
+}
+
+// Write the low `size` bytes (at most 8) of value, little endian
+static inline void write_memory_value(uint64_t address, uint64_t value, int size) {
+    uint64_t offset = address & MEMORY_PAGE_MASK;
+    check_code_write(address, size);
+
+    if (offset + size <= MEMORY_PAGE_SIZE) {
+        uint8_t* page = find_writable_page(address);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(page + offset, &value, size);
+#else
+        for (int i = 0; i < size; i++) {
+            page[offset + i] = (value >> (i * 8)) & 0xFF;
+        }
+#endif
+        return;
+    }
+
+    for (int i = 0; i < size; i++) {
+        write_memory_byte(address + i, (value >> (i * 8)) & 0xFF);
+    }
+}
+
+uint8_t read_memory_byte(uint64_t address) {
+    uint8_t* page = find_page(address);
+    if (page == NULL) {
+        return 0x0;   // default for uninitialized memory
+    }
+    return page[address & MEMORY_PAGE_MASK];
+}
+
+uint16_t read_memory_half(uint64_t address) {
+    return (uint16_t)read_memory_value(address, 2);
+}
+
+uint32_t read_memory_word(uint64_t address) {
+    return (uint32_t)read_memory_value(address, 4);
+}
+
+uint64_t read_memory_dword(uint64_t address) {
+    return read_memory_value(address, 8);
+}
+
+void write_memory_byte(uint64_t address, uint8_t value) {
+    check_code_write(address, 1);
+    uint8_t* page = find_writable_page(address);
+    page[address & MEMORY_PAGE_MASK] = value;
+}
+
+void write_memory_half(uint64_t address, uint16_t value) {
+    write_memory_value(address, value, 2);
+}
+
+void write_memory_word(uint64_t address, uint32_t value) {
+    write_memory_value(address, value, 4);
+}
+
+void write_memory_dword(uint64_t address, uint64_t value) {
+    write_memory_value(address, value, 8);
+}
+
+// Copy `length` bytes of guest memory starting at address into destination, a page at a time
+void read_memory_block(uint64_t address, void* destination, size_t length) {
+    uint8_t* dst = destination;
+
+    while (length > 0) {
+        size_t offset = address & MEMORY_PAGE_MASK;
+        size_t chunk = MEMORY_PAGE_SIZE - offset;
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        uint8_t* page = find_page(address);
+        if (page == NULL) {
+            memset(dst, 0, chunk);
+        } else {
+            memcpy(dst, page + offset, chunk);
+        }
+
+        address += chunk;
+        dst += chunk;
+        length -= chunk;
+    }
+}
+
+// Copy `length` bytes from source into guest memory starting at address
+void write_memory_block(uint64_t address, const void* source, size_t length) {
+    const uint8_t* src = source;
+    if (length > 0) {
+        check_code_write(address, length);
+    }
+
+    while (length > 0) {
+        size_t offset = address & MEMORY_PAGE_MASK;
+        size_t chunk = MEMORY_PAGE_SIZE - offset;
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        memcpy(find_writable_page(address) + offset, src, chunk);
+
+        address += chunk;
+        src += chunk;
+        length -= chunk;
+    }
+}
+
+// Set `length` bytes of guest memory to value. Filling untouched pages with zero allocates nothing.
+void fill_memory(uint64_t address, uint8_t value, size_t length) {
+    if (length > 0) {
+        check_code_write(address, length);
+    }
+    while (length > 0) {
+        size_t offset = address & MEMORY_PAGE_MASK;
+        size_t chunk = MEMORY_PAGE_SIZE - offset;
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        // zeroing a page nobody has touched is a no-op
+        if (value != 0 || find_page(address) != NULL) {
+            memset(find_writable_page(address) + offset, value, chunk);
+        }
+
+        address += chunk;
+        length -= chunk;
+    }
+}
+
+// Drop every guest page in O(1): the arena keeps its chunks for the next program
+void clean_memory() {
+    if (memory_arena_ready) {
+        arena_reset(&memory_arena);
+    }
+    memset(&memory_root, 0, sizeof(memory_root));
+    memset(memory_read_tlb, 0, sizeof(memory_read_tlb));
+    memset(memory_write_tlb, 0, sizeof(memory_write_tlb));
+    resident_pages = 0;
+    directory_bytes = 0;
+    shared_pages = 0;
+    shared_host_pages = 0;
+    last_shared_page = NULL;
+    free_pages = NULL;
+
+    memory_epoch = 0;
+    snapshot_taken = false;
+    dirty_page_count = 0;
+}
+
+// Back the guest page at address with a page the caller owns, such as part of a mapped file, until
+// the next clean_memory(). It is never written: like a snapshot page, it is copied on its first write.
+// A page shared by several guest pages is passed for them one after another.
+void share_memory_page(uint64_t address, uint8_t* page) {
+    uint64_t page_number = address >> MEMORY_PAGE_BITS;
+    memory_leaf* leaf = find_leaf(page_number, true);
+    size_t index = directory_index(page_number, MEMORY_LEVELS - 1);
+    if (leaf->pages[index] == NULL) {
+        resident_pages++;
+        shared_pages++;
+    }
+    if (page != last_shared_page) {
+        shared_host_pages++;
+        last_shared_page = page;
+    }
+    leaf->pages[index] = page;
+    leaf->epochs[index] = SHARED_PAGE_EPOCH;
+
+    memset(&memory_read_tlb[page_number % MEMORY_TLB_SIZE], 0, sizeof(memory_tlb_entry));
+    memset(&memory_write_tlb[page_number % MEMORY_TLB_SIZE], 0, sizeof(memory_tlb_entry));
+}
+
+// false for a page nothing has been written to, which reads as zeros
+_Bool memory_page_resident(uint64_t address) {
+    return find_page(address) != NULL;
+}
+
+void watch_code_region(uint64_t end, code_write_callback callback) {
+    code_region_end = callback != NULL ? end : 0;
+    code_region_callback = callback;
+}
+
+// Freeze the current contents of guest memory. Nothing is copied now;
+// pages are copied on their first write after the snapshot.
+void snapshot_memory() {
+    memory_epoch++;
+    snapshot_taken = true;
+    dirty_page_count = 0;
+    memset(memory_write_tlb, 0, sizeof(memory_write_tlb));
+}
+
+// Put back every page written since snapshot_memory(). Returns the number of pages restored.
+size_t restore_memory_snapshot() {
+    if (!snapshot_taken) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < dirty_page_count; i++) {
+        memory_dirty_page* dirty = &dirty_pages[i];
+        recycle_page(dirty->leaf->pages[dirty->index]);
+        dirty->leaf->pages[dirty->index] = dirty->page;
+        dirty->leaf->epochs[dirty->index] = dirty->epoch;
+        check_code_write(dirty->page_number << MEMORY_PAGE_BITS, MEMORY_PAGE_SIZE);
+    }
+
+    size_t restored = dirty_page_count;
+    dirty_page_count = 0;
+    memset(memory_read_tlb, 0, sizeof(memory_read_tlb));
+    memset(memory_write_tlb, 0, sizeof(memory_write_tlb));
+    return restored;
+}
+
+void get_memory_stats(memory_stats* stats) {
+    stats->resident_pages = resident_pages;
+    stats->resident_bytes = resident_pages * MEMORY_PAGE_SIZE;
+    stats->page_table_bytes = sizeof(memory_root) + directory_bytes;
+    stats->reserved_bytes = sizeof(memory_root) + memory_arena.reserved + shared_host_pages * MEMORY_PAGE_SIZE;
+    stats->overhead_bytes = stats->reserved_bytes - (resident_pages - shared_pages + shared_host_pages) * MEMORY_PAGE_SIZE;
+    stats->peak_bytes = sizeof(memory_root) + memory_arena.peak_reserved + shared_host_pages * MEMORY_PAGE_SIZE;
+}
@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef MEMORY
+#define MEMORY
+
+// Guest memory is a sparse, paged, flat 64-bit address space.
+// A page number (address >> MEMORY_PAGE_BITS) is split into MEMORY_LEVELS indices
+// of MEMORY_LEVEL_BITS each; the last level (a leaf) points at the page itself.
+// Pages are allocated (zero filled) on the first write, reads of untouched memory return 0.
+// After snapshot_memory() pages are shared with the snapshot and copied on their first write.
+#define MEMORY_PAGE_BITS 12
+#define MEMORY_PAGE_SIZE (1u << MEMORY_PAGE_BITS)
+#define MEMORY_PAGE_MASK (MEMORY_PAGE_SIZE - 1)
+
+#define MEMORY_LEVELS 4
+#define MEMORY_LEVEL_BITS 13
+#define MEMORY_LEVEL_SIZE (1u << MEMORY_LEVEL_BITS)
+
+#define MEMORY_TLB_SIZE 64
+#define MEMORY_ARENA_CHUNK_SIZE (1u << 20)
+
+typedef struct memory_directory {
+    void* entries[MEMORY_LEVEL_SIZE];   // child directories, or leaves at the last level
+} memory_directory;
+
+// Last level of the page table. epochs[i] is the snapshot epoch pages[i] was created in.
+typedef struct memory_leaf {
+    uint8_t* pages[MEMORY_LEVEL_SIZE];
+    uint32_t epochs[MEMORY_LEVEL_SIZE];
+} memory_leaf;
+
+// A page written after the snapshot, and what the leaf held before
+typedef struct memory_dirty_page {
+    uint64_t page_number;
+    memory_leaf* leaf;
+    size_t index;
+    uint8_t* page;
+    uint32_t epoch;
+} memory_dirty_page;
+
+typedef struct memory_tlb_entry {
+    uint64_t page_number;
+    uint8_t* page;
+} memory_tlb_entry;
+
+typedef struct memory_stats {
+    size_t resident_pages;
+    size_t resident_bytes;      // guest bytes backed by a page
+    size_t page_table_bytes;    // directories, including the root
+    size_t reserved_bytes;      // everything held by the allocator
+    size_t overhead_bytes;      // reserved_bytes not holding guest pages, a shared page counted once
+    size_t peak_bytes;          // largest reserved_bytes seen
+} memory_stats;
+
+// Called with the range of every write that starts below the watched code region's end
+typedef void (*code_write_callback)(uint64_t address, size_t length);
+
+uint8_t read_memory_byte(uint64_t address);
+uint16_t read_memory_half(uint64_t address);
+uint32_t read_memory_word(uint64_t address);
+uint64_t read_memory_dword(uint64_t address);
+
+void write_memory_byte(uint64_t address, uint8_t value);
+void write_memory_half(uint64_t address, uint16_t value);
+void write_memory_word(uint64_t address, uint32_t value);
+void write_memory_dword(uint64_t address, uint64_t value);
+
+void read_memory_block(uint64_t address, void* destination, size_t length);
+void write_memory_block(uint64_t address, const void* source, size_t length);
+void fill_memory(uint64_t address, uint8_t value, size_t length);
+
+void clean_memory();
+void share_memory_page(uint64_t address, uint8_t* page);
+_Bool memory_page_resident(uint64_t address);
+void get_memory_stats(memory_stats* stats);
+
+void watch_code_region(uint64_t end, code_write_callback callback);
+
+void snapshot_memory();
+size_t restore_memory_snapshot();
+#endif
@@ -0,0 +1,109 @@
+#include "native.h"
+
+#include "cache.h"
+#include "decode.h"
+#include "memory.h"
+
+// With the cache simulator on, accesses go through it just as the interpreter's do (decode.c)
+static uint64_t load_byte(uint64_t address) {
+    if (cache_enabled) {
+        return get_data_for_register(address, 0x0);
+    }
+    return (int64_t)(int8_t)read_memory_byte(address);
+}
+
+static uint64_t load_half(uint64_t address) {
+    if (cache_enabled) {
+        return get_data_for_register(address, 0x1);
+    }
+    return (int64_t)(int16_t)read_memory_half(address);
+}
+
+static uint64_t load_word(uint64_t address) {
+    if (cache_enabled) {
+        return get_data_for_register(address, 0x2);
+    }
+    return (int64_t)(int32_t)read_memory_word(address);
+}
+
+static uint64_t load_dword(uint64_t address) {
+    if (cache_enabled) {
+        return get_data_for_register(address, 0x3);
+    }
+    return read_memory_dword(address);
+}
+
+static uint64_t load_byte_unsigned(uint64_t address) {
+    if (cache_enabled) {
+        return get_data_for_register(address, 0x4);
+    }
+    return read_memory_byte(address);
+}
+
+static uint64_t load_half_unsigned(uint64_t address) {
+    if (cache_enabled) {
+        return get_data_for_register(address, 0x5);
+    }
+    return read_memory_half(address);
+}
+
+static uint64_t load_word_unsigned(uint64_t address) {
+    if (cache_enabled) {
+        return get_data_for_register(address, 0x6);
+    }
+    return read_memory_word(address);
+}
+
+static uint64_t store_byte(uint64_t address, uint64_t value) {
+    uint64_t generation = text_generation;
+    if (cache_enabled) {
+        write_cache(address, value, 1);
+    } else {
+        write_memory_byte(address, value);
+    }
+    return text_generation != generation;
+}
+
+static uint64_t store_half(uint64_t address, uint64_t value) {
+    uint64_t generation = text_generation;
+    if (cache_enabled) {
+        write_cache(address, value, 2);
+    } else {
+        write_memory_half(address, value);
+    }
+    return text_generation != generation;
+}
+
+static uint64_t store_word(uint64_t address, uint64_t value) {
+    uint64_t generation = text_generation;
+    if (cache_enabled) {
+        write_cache(address, value, 4);
+    } else {
+        write_memory_word(address, value);
+    }
+    return text_generation != generation;
+}
+
+static uint64_t store_dword(uint64_t address, uint64_t value) {
+    uint64_t generation = text_generation;
+    if (cache_enabled) {
+        write_cache(address, value, 8);
+    } else {
+        write_memory_dword(address, value);
+    }
+    return text_generation != generation;
+}
+
+const native_runtime guest_runtime = {
+    .load_byte = load_byte,
+    .load_half = load_half,
+    .load_word = load_word,
+    .load_dword = load_dword,
+    .load_byte_unsigned = load_byte_unsigned,
+    .load_half_unsigned = load_half_unsigned,
+    .load_word_unsigned = load_word_unsigned,
+    .store_byte = store_byte,
+    .store_half = store_half,
+    .store_word = store_word,
+    .store_dword = store_dword,
+};
@@ -0,0 +1,28 @@
+#include <stdint.h>
+
+#ifndef NATIVE
+#define NATIVE
+
+// Bumped whenever the layout below changes; compiled programs built against another version are refused
+#define NATIVE_RUNTIME_VERSION 1
+
+// Guest memory access for code generated at run time (jit.c) or ahead of time (aot.c).
+// Arguments and results are full 64-bit values so callers never rely on how narrow types
+// are extended; loads return the value already sign or zero extended. Stores return
+// non-zero when they wrote into the text segment, so the caller can stop right there.
+typedef struct native_runtime {
+    uint64_t (*load_byte)(uint64_t address);
+    uint64_t (*load_half)(uint64_t address);
+    uint64_t (*load_word)(uint64_t address);
+    uint64_t (*load_dword)(uint64_t address);
+    uint64_t (*load_byte_unsigned)(uint64_t address);
+    uint64_t (*load_half_unsigned)(uint64_t address);
+    uint64_t (*load_word_unsigned)(uint64_t address);
+    uint64_t (*store_byte)(uint64_t address, uint64_t value);
+    uint64_t (*store_half)(uint64_t address, uint64_t value);
+    uint64_t (*store_word)(uint64_t address, uint64_t value);
+    uint64_t (*store_dword)(uint64_t address, uint64_t value);
+} native_runtime;
+
+extern const native_runtime guest_runtime;
+#endif
@@ -1,148 +1,134 @@
+#define _DEFAULT_SOURCE     // strtok_r
 #include "./simulator.h"
 
+#include <fcntl.h>
+#include <signal.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "./assembler.h"
 #include "./utils.h"
 #include "./cache.h"
-
-void load_data();
-
-uint32_t data_memory_pointer = 0x10000;
-
-_Bool load_file(char* file_name) {
+#include "./cache_log.h"
+#include "./callstack.h"
+#include "./decode.h"
+#include "./aot.h"
+#include "./trace.h"
+#include "./blocks.h"
+#include "./breakpoints.h"
+#include "./linker.h"
+#include "./image.h"
+
+program_snapshot load_snapshot;     // machine state right after the last successful load
+
+_Bool load_file(char* const* file_names, size_t file_count) {
     free_label_array();
+    free_symbol_index();
     free_stack();
+    aot_unload();
+    free_decoded_text();
     clean_memory();
     error_code = 0;
     text_line_num = 1;
     file_line_num = 1;
 
     // Reset critical variables
-    data_memory_pointer = 0x10000;
     pc = 0;
     current_instruction = 1;
     max_instructions = 0;
+    free_breakpoint_index();
 
-    if (file_name == NULL) {
+    if (file_count == 0) {
         red("Error: Missing file name after 'load' command.\n");
         return false;
     }
 
-    // Close any previously opened file
-    if (input_file != NULL) {
-        fclose(input_file);
-    }
-    input_file = fopen(file_name, "r");
-    if (input_file == NULL) {
-        red("File \"%s\" not found.\n", file_name);
-    } else {
-        initialise_data_memory();
-
-        // After initialise_data_memory, file_line_num points to the first line in the .text section, excluding .text
-        if (error_code == 0) {
-            initialise_registers();
-            if (error_code == 0) {
-                create_label_array(input_file);
-                debug_enabled("Created label array %s\n", file_name);
-                initialise_text_memory();
-                if (error_code == 0) {
-                    //cyan("Loaded file %s\n", file_name);
-
-                    // Initialize stack
-                    main_node = malloc(sizeof(stack_node));
-                    main_node->function_name = malloc(sizeof("main"));
-                    strcpy(main_node->function_name, "main");
-                    main_node->line_num = instructions_array[1].file_line_num - 1;
-                    main_node->next = NULL;
-
-                    // Initialize cache
-                    if(cache_enabled) {
-                        clear_cache();
-                        open_cache_output_file(file_name);
-                    }
-
-                    return true;
-                } else {
-                    red("Text memory initialization failed.\n");
-                }
-
-            } else {
-                red("Compilation error in %s\n", file_name);
-            }
+    initialise_registers();
 
-        } else {
-            fclose(input_file);
-            red("%s", get_error_string(error_code));
-            red("Input file was not loaded\n");
+    // a program image, named or cached from an earlier load of the same sources, needs no assembly
+    bool from_image = false;
+    if (is_image_name(file_names[0])) {
+        if (file_count > 1) {
+            red("A program image is loaded on its own.\n");
+            return false;
         }
+        if (!load_image(file_names[0])) {
+            return false;
+        }
+        from_image = true;
+    } else {
+        from_image = load_cached_image(file_names, file_count);
     }
-    return false;
-}
-
-void initialise_registers() {
-    for (size_t i = 0; i < 32; i++) {
-        registers[i] = 0;
+    if (!from_image && !load_objects(file_names, file_count)) {
+        return false;
     }
-    debug_enabled("Initialised all registers to 0x%llx\n", registers[0]);
-    return;
-}
-
-// Read memory at an address
-uint8_t read_memory_byte(uint32_t address) {
-    unsigned int index = hash(address);  // Get the index using hash function
-    memory_node* current = memory_table[index];
+    if (error_code == 0) {
+        build_symbol_index();
+        initialise_stack();
+        build_decoded_text(max_instructions);
+        build_breakpoint_index(max_instructions);
+
+        // Initialize cache
+        if(cache_enabled || icache_enabled) {
+            clear_cache();
+        }
+        start_cache_log(file_names[0]);
 
-    // Traverse the chain at this index to find the memory address
-    while (current != NULL) {
-        if (current->address == address) {
-            return current->value;  // Return the value if address found
+        if (!from_image) {
+            write_loaded_image(file_names);
         }
-        current = current->next;
+        take_snapshot();
+        return true;
+    } else if (error_code >= 400) {
+        // data section errors
+        red("%s", get_error_string(error_code));
+        red("Input file was not loaded\n");
+    } else {
+        red("Text memory initialization failed.\n");
     }
+    return false;
+}
 
-    // Address not found, return 0x0 (default for uninitialized memory)
-    return 0x0;
+void initialise_stack() {
+    push_to_stack("main", max_instructions ? instructions_array[1].file_line_num - 1 : -1);
 }
 
-// Read 32-bit word from memory starting at the given address
-uint32_t read_memory_word(uint32_t address) {
-    uint32_t word = 0;
+// Remember registers and PC, and freeze guest memory so 'reset' can bring them back
+void take_snapshot() {
+    memcpy(load_snapshot.registers, registers, sizeof(registers));
+    load_snapshot.pc = pc;
+    load_snapshot.current_instruction = current_instruction;
+    snapshot_memory();
+}
 
-    // Read four consecutive bytes from memory, starting from the given address
-    for (int i = 0; i < 4; i++) {
-        uint8_t byte = read_memory_byte(address + i);  // Read each byte
-        word |= ((uint32_t)byte << (i * 8));                     // Shift and combine into the word
-    }
+// Return to the state captured by take_snapshot(), in time proportional to the pages written since
+void restore_snapshot() {
+    size_t restored_pages = restore_memory_snapshot();
 
-    return word;
-}
+    memcpy(registers, load_snapshot.registers, sizeof(registers));
+    pc = load_snapshot.pc;
+    current_instruction = load_snapshot.current_instruction;
+    break_line_found = false;
 
-// Read 16-bit word from memory starting at the given address
-uint16_t read_memory_half(uint32_t address) {
-    uint16_t word = 0;
+    free_stack();
+    initialise_stack();
 
-    // Read four consecutive bytes from memory, starting from the given address
-    for (int i = 0; i < 2; i++) {
-        uint8_t byte = read_memory_byte(address + i);  // Read each byte
-        word |= ((uint16_t)byte << (i * 8));                     // Shift and combine into the word
+    if(cache_enabled || icache_enabled) {
+        clear_cache();
     }
+    start_cache_log(current_file_name);
 
-    return word;
+    printf("Reset %s (%zu pages restored)\n", current_file_name, restored_pages);
 }
 
-// Read 64-bit word from memory starting at the given address
-uint64_t read_memory_dword(uint32_t address) {
-    uint64_t word = 0;
-
-    // Read four consecutive bytes from memory, starting from the given address
-    for (int i = 0; i < 8; i++) {
-        uint8_t byte = read_memory_byte(address + i);  // Read each byte
-        word |= ((uint64_t)byte << (i * 8));                     // Shift and combine into the word
+void initialise_registers() {
+    for (size_t i = 0; i < 32; i++) {
+        registers[i] = 0;
     }
-
-    return word;
+    debug_enabled("Initialised all registers to 0x%llx\n", registers[0]);
+    return;
 }
 
 // Display a range of memory addresses
@@ -158,189 +144,284 @@ void display_memory(uint32_t start_address, size_t num_bytes) {
 void display_memory_table() {
 }
 
-// initialise data segment and text segment by reading input file until you find .text
-void initialise_data_memory() {
-    char* line = NULL;  // Pointer to hold the line
-    size_t len = 0;
-    bool found_data_section = 0;
-    while (getline(&line, &len, input_file) != -1) {
-        format_input(line);
-        if (line != NULL && strcmp(line, ".data\n") == 0) {
-            found_data_section = 1;
-            file_line_num++;
-            load_data();
-            break;
-        }
-        file_line_num++;        // increment file line number
-    }
-    if (!found_data_section) {
-        debug_enabled("No data section was found in the input file\n");
-        // if data section wasn't found, set file_line_num to line after .text
-        fseek(input_file, 0, SEEK_SET); 
-        file_line_num = 1;
-        int found_text_section = 0;
-        while(getline(&line, &len, input_file) != -1) {
-            format_input(line);
-            if(line!=NULL && strcmp(line, ".text\n") == 0) {
-                file_line_num++;
-                found_text_section = 1;
-                break;
-            }
-            file_line_num++;
-        }
+void display_memory_stats() {
+    memory_stats stats;
+    get_memory_stats(&stats);
 
-        if(!found_text_section) {
-            file_line_num = 1;      // if .text wasn't found at all, and since .data was also not found, set it to 1
-        }
+    printf("Resident guest memory: %zu bytes (%zu pages)\n", stats.resident_bytes, stats.resident_pages);
+    printf("Page table: %zu bytes\n", stats.page_table_bytes);
+    printf("Allocator overhead: %zu bytes\n", stats.overhead_bytes);
+    printf("Footprint: %zu bytes, peak %zu bytes\n", stats.reserved_bytes, stats.peak_bytes);
+}
 
+// What step/run print for a text line: spaces tidied, label dropped, comments kept. Tidies the
+// line in place.
+static char* instruction_display_text(char* line) {
+    replace_tabs_with_spaces(line);
+    remove_extra_spaces(line, 0);
+    if (check_has_label(line)) {
+        line += strcspn(line, " ");
+        line += strspn(line, " ");
     }
+    return line;
+}
 
-    free(line);
-    return;
+// A text line the previous load assembled without error: define its label and add its instruction,
+// with the label offset worked out again. Returns false for a duplicate label.
+static bool reuse_assembled_line(object_file* object, const assembled_line* known, char* start) {
+    if (known->label != NULL && !define_label(&object->labels, known->label, text_line_num)) {
+        return false;
+    }
+    if (known->word == 0) {
+        return true;
+    }
+
+    uint32_t word = known->word;
+    if (known->target_type != 0) {
+        word |= label_offset_bits(object, known->target_type, known->target, strlen(known->target));
+    }
+    char* text = known->tidy ? start + known->text_start : instruction_display_text(start);
+    add_object_instruction(object, word, text - source_text, file_line_num);
+    text_line_num++;
+    return true;
 }
 
-void initialise_text_memory() {
-    uint32_t mem = 0;
-    char* line = NULL;
-    char* linecpy = NULL;
-    size_t len = 0;
-    int temp = file_line_num;
-    while (getline(&line, &len, input_file) != -1) {
+// Assemble one mapped source file in a single pass, into its object. .data and .text switch
+// sections; lines before either are text. Branches to labels further down are patched by
+// resolve_local_fixups() at the end, and those to other files are left for the linker. Runs on
+// the assembler threads, so everything it touches is the object's or thread local.
+//
+// Text lines the previous load of the file assembled are taken from known_lines rather than
+// assembled again. Every line of this load goes into new_lines for the next one.
+void assemble_source(object_file* object) {
+    enum { SECTION_TEXT, SECTION_DATA } section = SECTION_TEXT;
+    char* line = NULL;      // formatted copy of the current line, from the object's arena
+    size_t capacity = 0;
 
-        linecpy = (char*)malloc(strlen(line) + 1);  // Create a copy of the line
-        strcpy(linecpy, line);
-        replace_tabs_with_spaces(linecpy);
-        remove_extra_spaces(linecpy, 0);
-        if (check_has_label(linecpy)) {     // to store line without label
-            // remove label
-            strtok(linecpy, " ");
-            linecpy = strtok(NULL, "\n");
+    error_code = 0;
+    text_line_num = 1;
+    file_line_num = 1;
+    object->source_hash = hash_bytes(object->source, object->source_size);
+    rewind_line_cache(&object->known_lines);
+    begin_line_cache(&object->new_lines, object->source, object->source_size, object->known_lines.count);
+
+    size_t offset = 0;
+    while (offset < object->source_size && error_code == 0) {
+        char* start = object->source + offset;
+        char* end = memchr(start, '\n', object->source_size - offset);
+        size_t length = end ? (size_t)(end - start) : object->source_size - offset;
+        offset += length + 1;
+        start[length] = '\0';      // the source line becomes the printable instruction text
+
+        const assembled_line* known = find_assembled_line(&object->known_lines, start, length);
+        if (known != NULL && known->reusable && section == SECTION_TEXT) {
+            add_assembled_line(&object->new_lines, start - object->source, length, known);
+            if (!reuse_assembled_line(object, known, start)) {
+                break;
+            }
+            file_line_num++;
+            continue;
         }
+        assembled_line* assembled = add_assembled_line(&object->new_lines, start - object->source, length, NULL);
 
+        // room for the newline format_input() appends
+        if (length + 2 > capacity) {
+            capacity = (length + 2) * 2;
+            line = arena_alloc(&object->scratch, capacity, 1);
+        }
+        memcpy(line, start, length + 1);
         format_input(line);
-        int32_t reponse = assemble(line);
+        size_t word = strcspn(line, " \n");
+
+        if (strcmp(line, ".data\n") == 0) {
+            section = SECTION_DATA;
+        } else if (strcmp(line, ".text\n") == 0) {
+            section = SECTION_TEXT;
+        } else if ((word == 6 && strncmp(line, ".globl", 6) == 0) || (word == 7 && strncmp(line, ".global", 7) == 0)) {
+            // labels of this file other files may branch to, in either section
+            const char* names = line + word;
+            size_t name_count = 0;
+            while (*(names += strspn(names, " \n")) != '\0') {
+                size_t name_length = strcspn(names, " \n");
+                add_object_global(object, names, name_length);
+                names += name_length;
+                name_count++;
+            }
+            if (name_count == 0) {
+                error_code = 113;
+                object->error_line = file_line_num;
+                object->error_text = start;
+            }
+        } else if (section == SECTION_TEXT && word == 6 && strncmp(line, ".align", 6) == 0) {
+            // instructions are 4 byte aligned already; more would need padding the text
+            char* end;
+            long power = strtol(line + word, &end, 0);
+            if (end == line + word || *end != '\n' || power < 0 || power > 2) {
+                error_code = 114;
+                object->error_line = file_line_num;
+                object->error_text = start;
+            }
+        } else if (section == SECTION_DATA) {
+            line[strlen(line) - 1] = '\0';
+            load_data_line(object, line);
+        } else {
+            bool has_label = check_has_label(line);
+            if (has_label && !define_label(&object->labels, line, text_line_num)) {
+                break;
+            }
 
+            int32_t reponse = assemble(object, line);
+            if (reponse == -1) {
+                // reported once every file is assembled
+                object->error_line = file_line_num;
+                object->error_text = instruction_display_text(start);
+                break;
+            }
 
-        if (reponse == -1) {
-            red("\n\033[4m%s:%d\033[0m: %s", current_file_name, file_line_num, linecpy);
-            red("Error: ");
-            printf("%s", get_error_string(error_code));
-            file_line_num++;
-            text_line_num++;
-            return;
-        } else if (reponse == 0) {
-            file_line_num++;
-            // empty line/line with just a label encountered, do nothing
+            if (object->line_reusable) {
+                assembled->reusable = true;
+                if (has_label) {
+                    assembled->label = copy_line_string(&object->new_lines, line, strcspn(line, ":"));
+                }
+                if (object->target != NULL) {
+                    assembled->target_type = object->target_type;
+                    assembled->target = copy_line_string(&object->new_lines, object->target, object->target_length);
+                }
+                assembled->word = reponse & ~(object->target != NULL ? label_offset_mask(object->target_type) : 0);
+            }
+            if (reponse == 0) {
+                // empty line/line with just a label encountered, do nothing
+                file_line_num++;
+                continue;
+            }
 
-        } else {
-            write_memory_word(mem, reponse);
-
-            // save the instruction in an array, and set break_point to false
-            instructions_array[max_instructions + 1].instruction = (char*)malloc(strlen(linecpy) + 1);
-            strcpy(instructions_array[max_instructions + 1].instruction, linecpy);
-            instructions_array[max_instructions + 1].file_line_num = file_line_num;
-            instructions_array[max_instructions + 1].break_point = false;
-            max_instructions += 1;
-            mem += 4;
+            char* text = instruction_display_text(start);
+            if (assembled->reusable) {
+                // most lines only lose their indentation or label: then the display text is the
+                // end of the line as it is, and needn't be tidied when the line is reused
+                size_t text_length = strlen(text);
+                const char* original = object->new_lines.source + (start - object->source);
+                assembled->text_start = length - text_length;
+                assembled->tidy = text_length <= length && memcmp(original + assembled->text_start, text, text_length) == 0;
+            }
+            add_object_instruction(object, reponse, text - source_text, file_line_num);
             text_line_num++;
-            file_line_num++;
         }
+        file_line_num++;
     }
 
-    file_line_num = temp;   // equals to the line next to .text
-    rewind(input_file);
-    for (size_t i = 1; i < file_line_num; i++) {
-        getline(&line, &len, input_file);
+    if (error_code == 0) {
+        resolve_local_fixups(object);
     }
-
+    object->error_code = error_code;
     text_line_num = 1;
-}
 
-void load_data() {
-    char* line = NULL;
-    size_t len = 0;
-    char* current_directive = NULL;  // Tracks the active directive
+    // after an error the next load is better off with the lines of the last good one
+    if (object->error_code == 0) {
+        free_line_cache(&object->known_lines);
+        object->known_lines = object->new_lines;
+        memset(&object->new_lines, 0, sizeof(line_cache));
+    } else {
+        free_line_cache(&object->new_lines);
+    }
+}
 
-    while (getline(&line, &len, input_file) != -1) {
-        format_input_no_newline(line);  // Remove extra spaces/newlines
+// One line of the .data section: an optional directive followed by values of its size.
+// Lines without a directive continue the previous one. The bulk directives .space, .zero,
+// .fill, .align and .incbin take a size rather than values, and aren't continued.
+void load_data_line(object_file* object, char* line) {
+    if (strcmp(line, "") == 0) {
+        return;  // Skip empty lines
+    }
 
-        if (strcmp(line, "") == 0) {
-            file_line_num++;
-            continue;  // Skip empty lines
+    size_t length = strcspn(line, " ");
+    char* data = line;
+    if (line[0] == '.' && (length == 5 || length == 6 || length == 7)) {
+        bool bulk = true;
+        if (strncmp(line, ".space", length) == 0 && length == 6) {
+            load_data_space(object, line + length, false);
+        } else if (strncmp(line, ".zero", length) == 0 && length == 5) {
+            load_data_space(object, line + length, true);
+        } else if (strncmp(line, ".fill", length) == 0 && length == 5) {
+            load_data_fill(object, line + length);
+        } else if (strncmp(line, ".align", length) == 0 && length == 6) {
+            load_data_align(object, line + length);
+        } else if (strncmp(line, ".incbin", length) == 0 && length == 7) {
+            load_data_incbin(object, line + length);
+        } else {
+            bulk = false;
         }
-
-        if (strcmp(line, ".text") == 0) {
-            file_line_num++;
-            break;  // Stop on .text
+        if (bulk) {
+            object->data_directive_size = 0;
+            return;
         }
+    }
 
-        char* linecpy = strdup(line);  // Create a copy of the line
+    if (strncmp(line, ".byte", length) == 0 && length == 5) {
+        object->data_directive_size = 1;
+    } else if (strncmp(line, ".half", length) == 0 && length == 5) {
+        object->data_directive_size = 2;
+    } else if (strncmp(line, ".word", length) == 0 && length == 5) {
+        object->data_directive_size = 4;
+    } else if (strncmp(line, ".dword", length) == 0 && length == 6) {
+        object->data_directive_size = 8;
+    } else if (object->data_directive_size == 0) {
+        red("Error: Data values provided without a directive at line %d.\n", file_line_num);
+        error_code = 402;
+        return;
+    } else {
+        length = 0;
+    }
 
-        char* token = strtok(line, " ");  // Get the first token
+    // The rest of the line after the directive, if any
+    if (length > 0) {
+        data = line[length] == ' ' ? line + length + 1 : line + length;
+    }
+    if (strcmp(data, "") == 0) {
+        return;
+    }
 
-        if (token == NULL) {
-            file_line_num++;
-            free(linecpy);
-            continue;  // Skip lines without tokens
-        }
+    switch (object->data_directive_size) {
+        case 1:
+            load_data_byte(object, data);
+            break;
+        case 2:
+            load_data_half(object, data);
+            break;
+        case 4:
+            load_data_word(object, data);
+            break;
+        case 8:
+            load_data_dword(object, data);
+            break;
+    }
+}
 
-        // Check if the token is a directive
-        if (strcmp(token, ".byte") == 0 || strcmp(token, ".half") == 0 ||
-            strcmp(token, ".word") == 0 || strcmp(token, ".dword") == 0) {
-            // Update current directive
-            if (current_directive != NULL) {
-                free(current_directive);
-            }
-            current_directive = strdup(token);
-
-            // Get the remaining data on the same line, if any
-            char* data = strtok(NULL, "");  // The rest of the line after the directive
-
-            // Process data if present
-            if (data != NULL && strcmp(data, "") != 0) {
-                if (strcmp(current_directive, ".byte") == 0) {
-                    load_data_byte(data);
-                } else if (strcmp(current_directive, ".half") == 0) {
-                    load_data_half(data);
-                } else if (strcmp(current_directive, ".word") == 0) {
-                    load_data_word(data);
-                } else if (strcmp(current_directive, ".dword") == 0) {
-                    load_data_dword(data);
-                }
-            }
-        } else {
-            // Process data line using the current directive
-            if (current_directive != NULL) {
-                if (strcmp(current_directive, ".byte") == 0) {
-                    load_data_byte(linecpy);
-                } else if (strcmp(current_directive, ".half") == 0) {
-                    load_data_half(linecpy);
-                } else if (strcmp(current_directive, ".word") == 0) {
-                    load_data_word(linecpy);
-                } else if (strcmp(current_directive, ".dword") == 0) {
-                    load_data_dword(linecpy);
-                }
-            } else {
-                red("Error: Data values provided without a directive at line %d.\n", file_line_num);
-                error_code = 402;
-                free(linecpy);
-                free(line);
-                return;
-            }
-        }
+// Values parsed from a data line are staged here and added to the object's data as one block
+typedef struct data_buffer {
+    object_file* object;
+    uint8_t bytes[512];
+    size_t length;
+} data_buffer;
 
-        free(linecpy);  // Free the line copy after processing
-        file_line_num++;
-    }
+static void flush_data_buffer(data_buffer* buffer) {
+    add_object_data(buffer->object, buffer->bytes, buffer->length);
+    buffer->length = 0;
+}
 
-    if (current_directive != NULL) {
-        free(current_directive);
+static void buffer_data_value(data_buffer* buffer, uint64_t value, int size) {
+    if (buffer->length + size > sizeof(buffer->bytes)) {
+        flush_data_buffer(buffer);
+    }
+    for (int i = 0; i < size; i++) {
+        buffer->bytes[buffer->length++] = (value >> (i * 8)) & 0xFF;
     }
-    free(line);  // Free the allocated line buffer
 }
 
-void load_data_byte(char* string) {
-    char* token = strtok(string, " ");
+void load_data_byte(object_file* object, char* string) {
+    data_buffer buffer = {.object = object, .length = 0};
+    char* save = NULL;
+    char* token = strtok_r(string, " ", &save);
     while (token != NULL) {
         // Convert token to uint8_t (byte)
         long num = strtol(token, NULL, 0);  // Use long for range checking
@@ -349,16 +430,18 @@ void load_data_byte(char* string) {
         if (num < -128 || num > 255) {
             red("Error: byte value \"%ld\" in line %d not in range (-128 - 127).\n", num, file_line_num);
         } else {
-            write_memory_byte(data_memory_pointer, (uint8_t)num);  // Write byte to memory
-            data_memory_pointer += 1;                              // Move to the next memory address
+            buffer_data_value(&buffer, (uint8_t)num, 1);
         }
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
     }
+    flush_data_buffer(&buffer);
 }
 
-void load_data_half(char* string) {
-    char* token = strtok(string, " ");
+void load_data_half(object_file* object, char* string) {
+    data_buffer buffer = {.object = object, .length = 0};
+    char* save = NULL;
+    char* token = strtok_r(string, " ", &save);
     while (token != NULL) {
         // Convert token to uint16_t (halfword)
         long num = strtol(token, NULL, 0);
@@ -367,16 +450,18 @@ void load_data_half(char* string) {
         if (num < -32768 || num > 65535) {
             printf("Error: halfword value \"%ld\" in line %d not in range (0-65535).\n", num, text_line_num);
         } else {
-            write_memory_half(data_memory_pointer, (uint16_t)num);  // Write halfword to memory
-            data_memory_pointer += 2;                               // Move to the next memory address
+            buffer_data_value(&buffer, (uint16_t)num, 2);
         }
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
     }
+    flush_data_buffer(&buffer);
 }
 
-void load_data_word(char* string) {
-    char* token = strtok(string, " ");
+void load_data_word(object_file* object, char* string) {
+    data_buffer buffer = {.object = object, .length = 0};
+    char* save = NULL;
+    char* token = strtok_r(string, " ", &save);
     while (token != NULL) {
         // Convert token to uint32_t (word)
         long num = strtol(token, NULL, 0);  // strtol for 32-bit range
@@ -385,16 +470,18 @@ void load_data_word(char* string) {
         if (num < -2147483648L || num > 4294967295L) {
             printf("Error: word value \"%ld\" in line %d not in range (0-4294967295).\n", num, text_line_num);
         } else {
-            write_memory_word(data_memory_pointer, (uint32_t)num);  // Write word to memory
-            data_memory_pointer += 4;                               // Move to the next memory address
+            buffer_data_value(&buffer, (uint32_t)num, 4);
         }
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
     }
+    flush_data_buffer(&buffer);
 }
 
-void load_data_dword(char* string) {
-    char* token = strtok(string, " ");
+void load_data_dword(object_file* object, char* string) {
+    data_buffer buffer = {.object = object, .length = 0};
+    char* save = NULL;
+    char* token = strtok_r(string, " ", &save);
     while (token != NULL) {
         // Convert token to uint64_t (dword)
         unsigned long long num = (int64_t)strtoll(token, NULL, 0);  // strtoll for 64-bit range
@@ -403,12 +490,180 @@ void load_data_dword(char* string) {
         if (num > 18446744073709551615ULL) {
             printf("Error: dword value \"%lld\" in line %d not in range (0-18446744073709551615).\n", num, text_line_num);
         } else {
-            write_memory_dword(data_memory_pointer, num);  // Write dword to memory
-            data_memory_pointer += 8;                                // Move to the next memory address
+            buffer_data_value(&buffer, num, 8);
+        }
+
+        token = strtok_r(NULL, " ", &save);
+    }
+    flush_data_buffer(&buffer);
+}
+
+// Numbers after a bulk directive. Returns how many there were, at most max_count, or -1 if there
+// are more or one isn't a number.
+static int parse_data_operands(const char* operands, int64_t* values, int max_count) {
+    int count = 0;
+    while (*(operands += strspn(operands, " ")) != '\0') {
+        char* end;
+        if (count == max_count) {
+            return -1;
+        }
+        values[count] = strtoll(operands, &end, 0);
+        if (end == operands || (*end != ' ' && *end != '\0')) {
+            return -1;
+        }
+        count++;
+        operands = end;
+    }
+    return count;
+}
+
+static void data_operand_error(const char* directive) {
+    red("Error: Invalid operands for %s at line %zu.\n", directive, file_line_num);
+    error_code = 403;
+}
+
+// .space size[, byte] and .zero size. Reserved, not written: see add_object_fill().
+void load_data_space(object_file* object, char* string, _Bool zero) {
+    int64_t values[2] = {0, 0};
+    int count = parse_data_operands(string, values, zero ? 1 : 2);
+    if (count < 1 || values[0] < 0 || (uint64_t)values[0] > MAX_DATA_FILL_SIZE || values[1] < -128 || values[1] > 255) {
+        data_operand_error(zero ? ".zero" : ".space");
+        return;
+    }
+    add_object_fill(object, values[0], (uint8_t)values[1], 1);
+}
+
+// .fill repeat[, size[, value]]: repeat values of size 1, 2, 4 or 8 bytes, 1 and 0 if left out
+void load_data_fill(object_file* object, char* string) {
+    int64_t values[3] = {0, 1, 0};
+    int count = parse_data_operands(string, values, 3);
+    int64_t size = values[1];
+    if (count < 1 || values[0] < 0 || (size != 1 && size != 2 && size != 4 && size != 8) ||
+        (uint64_t)values[0] > MAX_DATA_FILL_SIZE / size) {
+        data_operand_error(".fill");
+        return;
+    }
+    uint64_t pattern = size == 8 ? (uint64_t)values[2] : (uint64_t)values[2] & ((1ull << (size * 8)) - 1);
+    add_object_fill(object, values[0] * size, pattern, size);
+}
+
+// .align n: pad with zeros to a multiple of 2^n bytes
+void load_data_align(object_file* object, char* string) {
+    int64_t power;
+    if (parse_data_operands(string, &power, 1) != 1 || power < 0 || power > MAX_DATA_ALIGN_POWER) {
+        data_operand_error(".align");
+        return;
+    }
+    align_object_data(object, (size_t)1 << power);
+}
+
+// .incbin "file"[, skip[, count]]: the file's bytes from skip on, read into pages of their own so
+// the linker can share them with the data section rather than copy them. Later changes to the
+// file don't reach the loaded program.
+void load_data_incbin(object_file* object, char* string) {
+    char* name = string + strspn(string, " ");
+    char* name_end = *name == '"' ? strchr(++name, '"') : name + strcspn(name, " ");
+    if (name_end == NULL || name_end == name) {
+        data_operand_error(".incbin");
+        return;
+    }
+    char* operands = *name_end == '"' ? name_end + 1 : name_end;
+    char saved = *name_end;
+    *name_end = '\0';
+
+    int64_t values[2] = {0, -1};
+    int count = parse_data_operands(operands, values, 2);
+    struct stat info;
+    int fd = count >= 0 ? open(name, O_RDONLY) : -1;
+    if (count < 0 || values[0] < 0 || values[1] < -1) {
+        data_operand_error(".incbin");
+    } else if (fd == -1 || fstat(fd, &info) != 0) {
+        red("Error: Cannot read \"%s\" of .incbin at line %zu.\n", name, file_line_num);
+        error_code = 404;
+    } else if ((uint64_t)values[0] > (uint64_t)info.st_size ||
+               (values[1] != -1 && (uint64_t)values[1] > (uint64_t)info.st_size - values[0])) {
+        data_operand_error(".incbin");
+    } else {
+        size_t size = values[1] == -1 ? (size_t)(info.st_size - values[0]) : (size_t)values[1];
+        size_t mapping_size = (size + MEMORY_PAGE_MASK) & ~(size_t)MEMORY_PAGE_MASK;
+        void* mapping = size ? mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : NULL;
+        size_t done = 0;
+        while (mapping != NULL && mapping != MAP_FAILED && done < size) {
+            ssize_t got = pread(fd, (uint8_t*)mapping + done, size - done, values[0] + done);
+            if (got <= 0) {
+                break;
+            }
+            done += got;
+        }
+
+        if (mapping == MAP_FAILED || done < size) {
+            red("Error: Cannot read \"%s\" of .incbin at line %zu.\n", name, file_line_num);
+            error_code = 404;
+            if (mapping != MAP_FAILED) {
+                munmap(mapping, mapping_size);
+            }
+        } else if (size) {
+            add_object_file_data(object, (const uint8_t*)mapping, size, mapping, mapping_size);
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    *name_end = saved;
+}
+
+static volatile sig_atomic_t run_interrupted = 0;
+
+static void interrupt_run(int signal_number) {
+    (void)signal_number;
+    run_interrupted = 1;
+}
+
+// Runs until the program ends, a breakpoint, `budget` instructions (0 for no limit), `time_limit`
+// seconds of host time (0 for none) or Ctrl-C. The limits and the interrupt flag are only looked
+// at between chunks of RUN_CHUNK_SIZE instructions, so they cost nothing per instruction.
+run_result run_program(size_t budget, double time_limit) {
+    run_result result = {0, 0, RUN_FINISHED};
+    if (budget == 0) {
+        budget = SIZE_MAX;
+    }
+
+    run_interrupted = 0;
+    void (*previous_handler)(int) = signal(SIGINT, interrupt_run);
+    double start_time = host_seconds();
+
+    while (current_instruction <= max_instructions) {
+        if (result.executed == budget) {
+            result.stop = RUN_BUDGET;
+            break;
+        }
+        if (run_interrupted) {
+            result.stop = RUN_INTERRUPTED;
+            break;
+        }
+        if (time_limit > 0 && host_seconds() - start_time >= time_limit) {
+            result.stop = RUN_TIME_LIMIT;
+            break;
         }
 
-        token = strtok(NULL, " ");
+        size_t chunk = budget - result.executed < RUN_CHUNK_SIZE ? budget - result.executed : RUN_CHUNK_SIZE;
+        size_t executed = run_blocks(chunk);
+        result.executed += executed;
+        if (executed < chunk && current_instruction <= max_instructions) {
+            result.stop = RUN_BREAKPOINT;
+            break;
+        }
     }
+
+    result.elapsed = host_seconds() - start_time;
+    signal(SIGINT, previous_handler == SIG_ERR ? SIG_DFL : previous_handler);
+    return result;
+}
+
+// Throughput of the last run, so the execution engines can be compared
+void report_run_speed(size_t executed, double elapsed, const char* engine) {
+    double mips = elapsed > 0 ? executed / elapsed / 1e6 : 0;
+    printf("Executed %zu instructions in %.3f s (%.2f MIPS, %s)\n", executed, elapsed, mips, engine);
 }
 
 void display_registers() {
@@ -420,37 +675,60 @@ void display_registers() {
     return;
 }
 
-void step() {
-    uint32_t instruction = read_memory_word(pc);
-    if(!break_line_found && instructions_array[current_instruction].break_point) {
+// Breakpoint check, call stack bookkeeping and trace done before every instruction.
+// Returns false when execution has to stop at a breakpoint instead.
+_Bool begin_step() {
+    if(!break_line_found && breakpoint_at(pc)) {
         //cyan("Execution stopped at break point.\n");
+        trace_flush();
         printf("Execution stopped at breakpoint\n");
         //green("Next: ");
         //cyan("\033[4m%s:%d\033[0m %s", current_file_name, instructions_array[current_instruction].file_line_num, instructions_array[current_instruction].instruction);
         break_line_found = true;
-        return;
+        return false;
     }
 
     break_line_found = false;
     //stack handling
-    stack_node* function = return_top_of_stack();
+    stack_frame* function = return_top_of_stack();
     if(function != NULL) {
         function->line_num = instructions_array[current_instruction].file_line_num;
     }
 
     //cyan("Executed \033[4m%s:%d\033[0m %s", current_file_name, instructions_array[current_instruction].file_line_num, instructions_array[current_instruction].instruction);
     //green("PC:\033[0m 0x%08X\n\n", pc);
-    printf("Executed %s; PC=0x%08X\n", instructions_array[current_instruction].instruction, pc);
+    if(trace_verbosity == TRACE_INSTRUCTIONS) {
+        trace_instruction(current_instruction, pc);
+    }
+    if(icache_enabled) {
+        fetch_cache(pc);
+    }
+    return true;
+}
 
-    execute(instruction);
+// Move past the instruction just executed
+void finish_step() {
     current_instruction += 1;
     pc += 4;
 
     if(current_instruction > max_instructions) {
         pop_from_stack();
     }
-    return;
-};
+}
+
+void step() {
+    if(!begin_step()) {
+        return;
+    }
+
+    decoded_instruction* decoded = fetch_decoded(pc);
+    if(decoded != NULL) {
+        decoded->handler(decoded);
+    } else {
+        execute(read_memory_word(pc));
+    }
+    finish_step();
+}
 
 void execute(uint32_t instruction) {
     int type = decode_type(instruction);
@@ -846,24 +1124,23 @@ void execute_j(uint32_t instruction) {
     pc += result;   // unconditional branch
     current_instruction += result/4;
 
-    int temp = 0;
-    char jump_location_label[50] = {};
-    for(int i = 0; i < label_count; i++) {
-        if(label_array[i].line_num == ((int)current_instruction)+1){
-            strcpy(jump_location_label, label_array[i].label_name);
-            temp = label_array[i].file_line_num - 1;
-        }
-    }
-
-    push_to_stack(jump_location_label, temp);
-    // 0 cause first instruction in the called function hasn't been executed yet. 
+    push_called_function();
+}
 
+// Called after a jal has moved pc: name the callee after the label on its first instruction
+void push_called_function() {
+    // pc is 4 short of the target until finish_step()
+    int callee = find_symbol(pc + 4);
+    if(callee == -1) {
+        push_to_stack("", 0);
+    } else {
+        // the line before the label, since the callee's first instruction hasn't run yet
+        push_to_stack(label_array[callee].label_name, label_array[callee].file_line_num - 1);
+    }
 }
 
 void show_stack() {
-    stack_node* current = main_node;
-
-    if(current == NULL) {
+    if(call_stack_depth == 0) {
         if(current_instruction > max_instructions) {
             //cyan("Stack empty. Execution complete.\n");
             printf("Empty Call Stack: Execution complete\n");
@@ -876,50 +1153,47 @@ void show_stack() {
         printf("Call Stack:\n");
     }
 
-    while(current != NULL) {
-        //blue("%s: %d\n", current->function_name, current->line_num);
-        printf("%s:%d\n", current->function_name, current->line_num);
-        current = current->next;
+    for(size_t i = 0; i < call_stack_depth; i++) {
+        //blue("%s: %d\n", call_stack[i].function_name, call_stack[i].line_num);
+        printf("%s:%d\n", call_stack[i].function_name, call_stack[i].line_num);
     }
 
 }
 
-void insert_break(int break_line) {
-    int line_found = false;
-    for(size_t i = 1; i <= max_instructions; i++) {
-        if(instructions_array[i].file_line_num == break_line) {
-            instructions_array[i].break_point = true;
-            //cyan("Break point added on line %d.\n", break_line);
-            printf("Breakpoint set at line %d\n", break_line);
-            line_found = true;
-            break;
-        }
+// Instruction on a line of one of the loaded files, the first for NULL, or 0 after saying why not
+static size_t break_instruction(const char* file_name, int break_line) {
+    size_t object = file_name ? find_object(file_name) : 0;
+    if (object == object_count) {
+        red("\"%s\" is not one of the loaded files.\n", file_name);
+        return 0;
     }
 
-    if(!line_found) {
+    size_t instruction = find_line_instruction(object, break_line);
+    if(instruction == 0) {
         red("No instruction on this line.\n");
     }
-    return;
+    return instruction;
 }
 
-void delete_break(int break_line) {
-    int line_found = false;
-    for(size_t i = 1; i <= max_instructions; i++) {
-        if(instructions_array[i].file_line_num == break_line) {
-            if(instructions_array[i].break_point) {
-                instructions_array[i].break_point = false;
-                cyan("Break point removed from line %d.\n", break_line);
-            } else {
-                red("Line %d doesn't have a break point.\n", break_line);
-            }
-
-            line_found = true;
-            break;
-        }
-
+void insert_break(const char* file_name, int break_line) {
+    size_t instruction = break_instruction(file_name, break_line);
+    if(instruction == 0) {
+        return;
     }
 
-    if(!line_found) {
-        red("No instruction on this line.\n");
+    set_breakpoint(instruction, true);
+    //cyan("Break point added on line %d.\n", break_line);
+    printf("Breakpoint set at line %d\n", break_line);
+}
+
+void delete_break(const char* file_name, int break_line) {
+    size_t instruction = break_instruction(file_name, break_line);
+    if(instruction == 0) {
+        return;
+    } else if(has_breakpoint(instruction)) {
+        set_breakpoint(instruction, false);
+        cyan("Break point removed from line %d.\n", break_line);
+    } else {
+        red("Line %d doesn't have a break point.\n", break_line);
     }
-}
\ No newline at end of file
+}
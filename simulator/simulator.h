@@ -3,36 +3,71 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <unistd.h>
+
+#include "assembler.h"
+#include "memory.h"
+
 #ifndef SIMULATOR
 #define SIMULATOR
 
-extern FILE* input_file;
 extern int64_t registers[32];
 extern char* current_file_name;
 
-_Bool load_file(char* file_name);
+typedef struct program_snapshot {
+    int64_t registers[32];
+    uint32_t pc;
+    size_t current_instruction;
+} program_snapshot;
+
+#define RUN_CHUNK_SIZE (1 << 16)    // instructions between checks of the run limits
+#define MAX_DATA_FILL_SIZE (1ull << 32)     // bytes one .space, .zero or .fill may reserve
+#define MAX_DATA_ALIGN_POWER 16
+
+typedef enum run_stop {
+    RUN_FINISHED,
+    RUN_BREAKPOINT,
+    RUN_BUDGET,
+    RUN_TIME_LIMIT,
+    RUN_INTERRUPTED,
+} run_stop;
+
+typedef struct run_result {
+    size_t executed;
+    double elapsed;         // host seconds
+    run_stop stop;
+} run_result;
+
+_Bool load_file(char* const* file_names, size_t file_count);
 void initialise_registers();
+void initialise_stack();
+void take_snapshot();
+void restore_snapshot();
 ssize_t getline(char**, size_t*, FILE*);
 
-void initialise_data_memory();
-void initialise_text_memory();
-void write_memory_byte(uint32_t address, uint8_t value);
-uint8_t read_memory_byte(uint32_t address);
-uint32_t read_memory_word(uint32_t address);
+void assemble_source(object_file* object);
 void display_memory(uint32_t start_address, size_t num_bytes);
 void display_memory_table();
-void load_data();
-void load_data_byte(char* string);
-void load_data_word(char* string);
-void load_data_half(char* string);
-void load_data_dword(char* string);
+void display_memory_stats();
+void load_data_line(object_file* object, char* line);
+void load_data_byte(object_file* object, char* string);
+void load_data_word(object_file* object, char* string);
+void load_data_half(object_file* object, char* string);
+void load_data_dword(object_file* object, char* string);
+void load_data_space(object_file* object, char* string, _Bool zero);
+void load_data_fill(object_file* object, char* string);
+void load_data_align(object_file* object, char* string);
+void load_data_incbin(object_file* object, char* string);
 
 void display_registers();
+run_result run_program(size_t budget, double time_limit);
+void report_run_speed(size_t executed, double elapsed, const char* engine);
 void show_stack();
-void insert_break(int break_line);
-void delete_break(int break_line);
+void insert_break(const char* file_name, int break_line);
+void delete_break(const char* file_name, int break_line);
 
 void step();
+_Bool begin_step();
+void finish_step();
 
 void execute(uint32_t instruction);
 void execute_r(uint32_t instruction);
@@ -43,4 +78,5 @@ void execute_s(uint32_t instruction);
 void execute_b(uint32_t instruction);
 void execute_u(uint32_t instruction);
 void execute_j(uint32_t instruction);
+void push_called_function();
 #endif
\ No newline at end of file
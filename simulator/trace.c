@@ -0,0 +1,78 @@
+#include "trace.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+trace_level trace_verbosity = TRACE_INSTRUCTIONS;
+
+// Instruction lines are formatted by hand into one large buffer and written out with a single
+// fwrite when it fills up or when a command finishes, instead of one printf per instruction
+static char trace_buffer[TRACE_BUFFER_SIZE];
+static size_t trace_used = 0;
+static FILE* trace_file = NULL;     // NULL means stdout
+static char* trace_path = NULL;
+
+void trace_flush() {
+    if (trace_used > 0) {
+        fwrite(trace_buffer, 1, trace_used, trace_file ? trace_file : stdout);
+        trace_used = 0;
+    }
+    fflush(trace_file ? trace_file : stdout);
+}
+
+static void trace_append(const char* text, size_t length) {
+    if (trace_used + length > TRACE_BUFFER_SIZE) {
+        trace_flush();
+    }
+    if (length > TRACE_BUFFER_SIZE) {
+        fwrite(text, 1, length, trace_file ? trace_file : stdout);
+        return;
+    }
+    memcpy(trace_buffer + trace_used, text, length);
+    trace_used += length;
+}
+
+// "Executed <instruction>; PC=0x%08X\n"
+void trace_instruction(size_t instruction, uint32_t address) {
+    static const char digits[] = "0123456789ABCDEF";
+    const char* text = instruction_text(instruction);
+    size_t length = strlen(text);
+
+    char pc_text[] = "; PC=0x00000000\n";
+    for (int i = 0; i < 8; i++) {
+        pc_text[14 - i] = digits[(address >> (4 * i)) & 0xF];
+    }
+
+    trace_append("Executed ", 9);
+    trace_append(text, length);
+    trace_append(pc_text, sizeof(pc_text) - 1);
+}
+
+// Send instruction lines to `path`, or back to stdout for NULL or "-"
+_Bool set_trace_file(const char* path) {
+    trace_flush();
+
+    FILE* file = NULL;
+    if (path != NULL && strcmp(path, "-") != 0) {
+        file = fopen(path, "w");
+        if (file == NULL) {
+            red("Cannot open trace file \"%s\".\n", path);
+            return false;
+        }
+    }
+
+    if (trace_file != NULL) {
+        fclose(trace_file);
+    }
+    free(trace_path);
+    trace_file = file;
+    trace_path = file ? strdup(path) : NULL;
+    return true;
+}
+
+const char* trace_file_name() {
+    return trace_path ? trace_path : "stdout";
+}
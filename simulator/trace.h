@@ -0,0 +1,23 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifndef TRACE
+#define TRACE
+
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+// How much run/step print
+typedef enum trace_level {
+    TRACE_SILENT,           // nothing but breakpoint stops and errors
+    TRACE_SUMMARY,          // one line per run: instruction count, time, engine
+    TRACE_INSTRUCTIONS,     // plus one "Executed ..." line per instruction
+} trace_level;
+
+extern trace_level trace_verbosity;
+
+void trace_instruction(size_t instruction, uint32_t address);
+void trace_flush();
+_Bool set_trace_file(const char* path);
+const char* trace_file_name();
+#endif
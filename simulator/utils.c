@@ -1,9 +1,17 @@
+#define _DEFAULT_SOURCE     // MAP_ANONYMOUS
 #include "utils.h"
 
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arena.h"
 
 // addi, andi, ori, xori, slli, srli, srai, ld, lw, lh, lb, lwu, lhu, lbu, jalr
 //  sd, sw, sh, sb, beq, bne, blt, bge, bltu, bgeu, jal, lui
@@ -37,212 +45,135 @@ void format_input_no_newline(char* str) {
     remove_extra_spaces(str, 0);
 }
 
-char identify_type(const char* string) {
-    char* string_copy = strdup(string);
-    if (string_copy == NULL) {
-        // error handling
-        printf("NULL string in identify_type.\n");
-        return 0;
+// FNV-1a over the first `length` characters of name
+uint32_t hash_name(const char* name, size_t length, uint32_t seed) {
+    uint32_t hash = seed;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
     }
+    return hash;
+}
 
-    char* str = strtok(string_copy, " ");
-    if (str == NULL) {
-        // error handling
-        printf("NULL string in identify_type.\n");
-        return 0;
+// 64-bit FNV-1a taking eight bytes at a time, for telling whether a file changed
+uint64_t hash_bytes(const void* bytes, size_t size) {
+    const uint8_t* data = bytes;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ull;
     }
+    for (; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash ^ size;
+}
 
-    char result = 0;
-    for (size_t i = 0; i < R_INSTRUCTIONS_SIZE; i++) {
-        if (strcmp(R_INSTRUCTIONS[i], str) == 0) {
-            result = 'r';
-            break;
-        }
+// Mnemonics and register names are looked up through perfect hashes: the seeds below were
+// searched for offline so that every name gets a slot of its own, and a lookup is one hash and
+// one string compare. The tables are filled from the arrays above on first use.
+#define MNEMONIC_HASH_BITS 7
+#define MNEMONIC_HASH_SEED 887u
+#define REGISTER_HASH_BITS 8
+#define REGISTER_HASH_SEED 249u
+
+static mnemonic_info mnemonic_slots[1 << MNEMONIC_HASH_BITS];
+static struct {
+    const char* name;
+    uint32_t number;
+} register_slots[1 << REGISTER_HASH_BITS];
+static bool lookup_tables_ready = false;
+
+static const char* REGISTER_ABI_NAMES[32] = {
+    "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+    "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"};
+static char REGISTER_NUMBERED_NAMES[32][4];
+
+static void add_mnemonic(const char* name, char type, uint32_t funct3, uint32_t funct7, bool is_load) {
+    mnemonic_info* slot = &mnemonic_slots[hash_name(name, strlen(name), MNEMONIC_HASH_SEED) >> (32 - MNEMONIC_HASH_BITS)];
+    if (slot->name != NULL) {
+        red("Mnemonic hash collision between %s and %s!\n", slot->name, name);
+        exit(EXIT_FAILURE);
     }
+    slot->name = name;
+    slot->type = type;
+    slot->funct3 = funct3;
+    slot->funct7 = funct7;
+    slot->is_load = is_load;
+}
 
-    for (size_t i = 0; i < I_INSTRUCTIONS_SIZE; i++) {
-        if (strcmp(I_INSTRUCTIONS[i], str) == 0) {
-            result = 'i';
-            break;
-        }
+static void add_register(const char* name, uint32_t number) {
+    size_t index = hash_name(name, strlen(name), REGISTER_HASH_SEED) >> (32 - REGISTER_HASH_BITS);
+    if (register_slots[index].name != NULL) {
+        red("Register hash collision between %s and %s!\n", register_slots[index].name, name);
+        exit(EXIT_FAILURE);
     }
+    register_slots[index].name = name;
+    register_slots[index].number = number;
+}
 
+// Must run before files are assembled on more than one thread
+void build_lookup_tables() {
+    if (lookup_tables_ready) {
+        return;
+    }
+    for (size_t i = 0; i < R_INSTRUCTIONS_SIZE; i++) {
+        add_mnemonic(R_INSTRUCTIONS[i], 'r', R_FUNCT3[i], R_FUNCT7[i], false);
+    }
+    // I_INSTRUCTIONS has the loads from lb onwards, then jalr
+    for (size_t i = 0; i < I_INSTRUCTIONS_SIZE; i++) {
+        add_mnemonic(I_INSTRUCTIONS[i], 'i', I_FUNCT3[i], -1u, i >= 7 && i < I_INSTRUCTIONS_SIZE - 1);
+    }
     for (size_t i = 0; i < S_INSTRUCTIONS_SIZE; i++) {
-        if (strcmp(S_INSTRUCTIONS[i], str) == 0) {
-            result = 's';
-            break;
-        }
+        add_mnemonic(S_INSTRUCTIONS[i], 's', S_FUNCT3[i], -1u, false);
     }
-
     for (size_t i = 0; i < B_INSTRUCTIONS_SIZE; i++) {
-        if (strcmp(B_INSTRUCTIONS[i], str) == 0) {
-            result = 'b';
-            break;
-        }
+        add_mnemonic(B_INSTRUCTIONS[i], 'b', B_FUNCT3[i], -1u, false);
     }
+    add_mnemonic(U_INSTRUCTIONS[0], 'u', -1u, -1u, false);
+    add_mnemonic(J_INSTRUCTIONS[0], 'j', -1u, -1u, false);
 
-    if (strcmp(U_INSTRUCTIONS[0], str) == 0) {
-        result = 'u';
-    }
-
-    if (strcmp(J_INSTRUCTIONS[0], str) == 0) {
-        result = 'j';
-    }
-
-    free(string_copy);
-    return result;
-}
-
-uint32_t parse_register(char* token_string) {
-    char* token = strtok(token_string, "\n");
-
-    if (token == NULL) {
-        strcpy(token, token_string);
-    }
-
-    if (strcmp(token, "x0") == 0 || strcmp(token, "zero") == 0) {
-        return 0b00000;
-    } else if (strcmp(token, "x1") == 0 || strcmp(token, "ra") == 0) {
-        return 0b00001;
-    } else if (strcmp(token, "x2") == 0 || strcmp(token, "sp") == 0) {
-        return 0b00010;
-    } else if (strcmp(token, "x3") == 0 || strcmp(token, "gp") == 0) {
-        return 0b00011;
-    } else if (strcmp(token, "x4") == 0 || strcmp(token, "tp") == 0) {
-        return 0b00100;
-    } else if (strcmp(token, "x5") == 0 || strcmp(token, "t0") == 0) {
-        return 0b00101;
-    } else if (strcmp(token, "x6") == 0 || strcmp(token, "t1") == 0) {
-        return 0b00110;
-    } else if (strcmp(token, "x7") == 0 || strcmp(token, "t2") == 0) {
-        return 0b00111;
-    } else if (strcmp(token, "x8") == 0 || strcmp(token, "s0") == 0 || strcmp(token, "fp") == 0) {
-        return 0b01000;
-    } else if (strcmp(token, "x9") == 0 || strcmp(token, "s1") == 0) {
-        return 0b01001;
-    } else if (strcmp(token, "x10") == 0 || strcmp(token, "a0") == 0) {
-        return 0b01010;
-    } else if (strcmp(token, "x11") == 0 || strcmp(token, "a1") == 0) {
-        return 0b01011;
-    } else if (strcmp(token, "x12") == 0 || strcmp(token, "a2") == 0) {
-        return 0b01100;
-    } else if (strcmp(token, "x13") == 0 || strcmp(token, "a3") == 0) {
-        return 0b01101;
-    } else if (strcmp(token, "x14") == 0 || strcmp(token, "a4") == 0) {
-        return 0b01110;
-    } else if (strcmp(token, "x15") == 0 || strcmp(token, "a5") == 0) {
-        return 0b01111;
-    } else if (strcmp(token, "x16") == 0 || strcmp(token, "a6") == 0) {
-        return 0b10000;
-    } else if (strcmp(token, "x17") == 0 || strcmp(token, "a7") == 0) {
-        return 0b10001;
-    } else if (strcmp(token, "x18") == 0 || strcmp(token, "s2") == 0) {
-        return 0b10010;
-    } else if (strcmp(token, "x19") == 0 || strcmp(token, "s3") == 0) {
-        return 0b10011;
-    } else if (strcmp(token, "x20") == 0 || strcmp(token, "s4") == 0) {
-        return 0b10100;
-    } else if (strcmp(token, "x21") == 0 || strcmp(token, "s5") == 0) {
-        return 0b10101;
-    } else if (strcmp(token, "x22") == 0 || strcmp(token, "s6") == 0) {
-        return 0b10110;
-    } else if (strcmp(token, "x23") == 0 || strcmp(token, "s7") == 0) {
-        return 0b10111;
-    } else if (strcmp(token, "x24") == 0 || strcmp(token, "s8") == 0) {
-        return 0b11000;
-    } else if (strcmp(token, "x25") == 0 || strcmp(token, "s9") == 0) {
-        return 0b11001;
-    } else if (strcmp(token, "x26") == 0 || strcmp(token, "s10") == 0) {
-        return 0b11010;
-    } else if (strcmp(token, "x27") == 0 || strcmp(token, "s11") == 0) {
-        return 0b11011;
-    } else if (strcmp(token, "x28") == 0 || strcmp(token, "t3") == 0) {
-        return 0b11100;
-    } else if (strcmp(token, "x29") == 0 || strcmp(token, "t4") == 0) {
-        return 0b11101;
-    } else if (strcmp(token, "x30") == 0 || strcmp(token, "t5") == 0) {
-        return 0b11110;
-    } else if (strcmp(token, "x31") == 0 || strcmp(token, "t6") == 0) {
-        return 0b11111;
-    } else {
-        return -1;
+    for (uint32_t i = 0; i < 32; i++) {
+        snprintf(REGISTER_NUMBERED_NAMES[i], sizeof(REGISTER_NUMBERED_NAMES[i]), "x%u", i);
+        add_register(REGISTER_NUMBERED_NAMES[i], i);
+        add_register(REGISTER_ABI_NAMES[i], i);
     }
-}
+    add_register("fp", 8);
 
-uint32_t get_funct3(char type, char* str) {
-    switch (type) {
-        case 'r': {
-            for (int i = 0; i < R_INSTRUCTIONS_SIZE; i++) {
-                if (strcmp(R_INSTRUCTIONS[i], str) == 0) {
-                    return R_FUNCT3[i];
-                }
-            }
-            break;
-        }
-
-        case 'i': {
-            for (int i = 0; i < I_INSTRUCTIONS_SIZE; i++) {
-                if (strcmp(I_INSTRUCTIONS[i], str) == 0) {
-                    return I_FUNCT3[i];
-                }
-            }
-            break;
-        }
-
-        case 's': {
-            for (int i = 0; i < S_INSTRUCTIONS_SIZE; i++) {
-                if (strcmp(S_INSTRUCTIONS[i], str) == 0) {
-                    return S_FUNCT3[i];
-                }
-            }
-            break;
-        }
-
-        case 'b': {
-            for (int i = 0; i < B_INSTRUCTIONS_SIZE; i++) {
-                if (strcmp(B_INSTRUCTIONS[i], str) == 0) {
-                    return B_FUNCT3[i];
-                }
-            }
-            break;
-        }
-
-        default: {
-            return -1;
-            break;
-        }
-    }
-    return -1u;
+    lookup_tables_ready = true;
 }
 
-uint32_t get_funct7(char type, char* str) {
-    switch (type) {
-        case 'r': {
-            for (size_t i = 0; i < R_INSTRUCTIONS_SIZE; i++) {
-                if (strcmp(R_INSTRUCTIONS[i], str) == 0) {
-                    return R_FUNCT7[i];
-                }
-            }
-        }
-        default:
-            break;
+// The mnemonic spelled by the first `length` characters of name, or NULL
+const mnemonic_info* find_mnemonic(const char* name, size_t length) {
+    if (!lookup_tables_ready) {
+        build_lookup_tables();
     }
-    return -1;
+    const mnemonic_info* slot = &mnemonic_slots[hash_name(name, length, MNEMONIC_HASH_SEED) >> (32 - MNEMONIC_HASH_BITS)];
+    if (slot->name == NULL || strncmp(slot->name, name, length) != 0 || slot->name[length] != '\0') {
+        return NULL;
+    }
+    return slot;
 }
 
-// I instructions can have one of two opcodes
-_Bool check_load_or_not(char* str) {
-    int first_load_instruction_index = 7;
-    //-1 here to exclude "jalr"
-    for (int i = 0; i < I_INSTRUCTIONS_SIZE - 1; i++) {
-        if (strcmp(str, I_INSTRUCTIONS[i]) == 0) {
-            if (i >= first_load_instruction_index) {
-                return true;
-            }
-        }
+// Number of the register spelled by the first `length` characters of name, or -1
+uint32_t find_register(const char* name, size_t length) {
+    if (!lookup_tables_ready) {
+        build_lookup_tables();
     }
+    size_t index = hash_name(name, length, REGISTER_HASH_SEED) >> (32 - REGISTER_HASH_BITS);
+    const char* slot_name = register_slots[index].name;
+    if (slot_name == NULL || strncmp(slot_name, name, length) != 0 || slot_name[length] != '\0') {
+        return -1;
+    }
+    return register_slots[index].number;
+}
 
-    return false;
+char identify_type(const char* string) {
+    // the mnemonic is the first word
+    string += strspn(string, " ");
+    const mnemonic_info* mnemonic = find_mnemonic(string, strcspn(string, " \n"));
+    return mnemonic ? mnemonic->type : 0;
 }
 
 void replace_commas_with_spaces(char* str) {
@@ -314,7 +245,7 @@ void ignore_comments(char* str) {
     }
 }
 
-_Bool check_has_label(char* str) {
+_Bool check_has_label(const char* str) {
     int i = 0;
     while (str[i] != 0) {
         if (str[i] == ' ' || str[i] == ',') {
@@ -330,115 +261,103 @@ _Bool check_has_label(char* str) {
     return false;
 }
 
-void add_label(const char* label_name, int line_num) {
-    // increase label count by 1 and reallocate label_array
-    label_count++;
-    label_array = realloc(label_array, label_count * sizeof(label));
+// Labels are indexed by name in an open-addressing table of indices into the table's labels (-1
+// for an empty slot), kept at most half full, so defining and looking up a label are O(1)
+#define LABEL_HASH_SEED 2166136261u
 
-    // Error handling: exit program if memory allocation fails
-    if (label_array == NULL) {
-        red("Memory allocation failed while expanding label array!\n");
-        exit(EXIT_FAILURE);
+static size_t find_label_slot(const label_table* table, const char* name, size_t length) {
+    size_t slot = hash_name(name, length, LABEL_HASH_SEED) & table->slot_mask;
+    while (table->slots[slot] != -1) {
+        const char* label_name = table->labels[table->slots[slot]].label_name;
+        if (strncmp(label_name, name, length) == 0 && label_name[length] == '\0') {
+            break;
+        }
+        slot = (slot + 1) & table->slot_mask;
     }
-
-    // Allocate memory for the label name and copy it
-    label_array[label_count - 1].label_name = malloc(strlen(label_name) + 1);
-    strcpy(label_array[label_count - 1].label_name, label_name);
-    label_array[label_count - 1].line_num = line_num;
-    label_array[label_count - 1].file_line_num = file_line_num;
+    return slot;
 }
 
-void create_label_array(FILE* file_pointer) {
-    // error handling: check if the input file is NULL
-    if (file_pointer == NULL) {
-        red("Error: File pointer is NULL in create_label_array.\n");
-        return;
+static void grow_label_slots(label_table* table) {
+    size_t slot_count = table->slots ? (table->slot_mask + 1) * 2 : 1024;
+    free(table->slots);
+    table->slots = malloc(slot_count * sizeof(int));
+    if (table->slots == NULL) {
+        red("Memory allocation failed while expanding label table!\n");
+        exit(EXIT_FAILURE);
     }
+    table->slot_mask = slot_count - 1;
+    memset(table->slots, -1, slot_count * sizeof(int));
 
-    char line[256];                       // Buffer to hold each line (assuming no line is longer than 256 characters)
-    int start_text_line = file_line_num;  // save the line number of the line after to .text
-
-    // Ensure the file pointer is positioned at the start of the .text section
-    fseek(file_pointer, 0, SEEK_SET);  // Set the pointer to the beginning of the file
-
-    // Move the file pointer to where line after .text starts (first instruction/blank line/label) (skip .data section)
-    for (int i = 1; i < start_text_line; i++) {
-        if (fgets(line, sizeof(line), file_pointer) == NULL) {
-            printf("Error: Failed to find the .text section.\n");
-            return;
-        }
+    for (int i = 0; i < table->count; i++) {
+        const char* name = table->labels[i].label_name;
+        table->slots[find_label_slot(table, name, strlen(name))] = i;
     }
+}
 
-    // Process the file line by line, add label to the dynamic label array
-    while (fgets(line, sizeof(line), file_pointer) != NULL) {
-        // format input to remove spaces and append a new line at the end
-        format_input(line);
-
-        // if the line is empty, do nothing
-        // don't increment text_line_num since it doesn't account empty lines/ lines with just labels
-        if (strcmp(line, "\n") == 0) {
-            file_line_num++;
-            continue;
-        }
-
-        // if a non-empty line without a label is found, increment both counters
-        // don't worry about lines with just comments since formating is done
-        if (!check_has_label(line)) {
-            file_line_num++;
-            text_line_num++;
-            continue;
-        }
+// Index into table->labels of the label spelled by the first `length` characters of name, or -1
+int find_label(const label_table* table, const char* name, size_t length) {
+    if (table->slots == NULL) {
+        return -1;
+    }
+    return table->slots[find_label_slot(table, name, length)];
+}
 
-        // after above two conditions, line must have a label, with or without instruction
-        int is_just_label = false;
+void add_label(label_table* table, const char* label_name, size_t length, int line_num, int label_file_line_num) {
+    // grow the labels by doubling
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 256;
+        table->labels = realloc(table->labels, table->capacity * sizeof(label));
 
-        // Check if the line contains only the label
-        if (line[strlen(line) - 2] == ':') {
-            is_just_label = true;
+        // Error handling: exit program if memory allocation fails
+        if (table->labels == NULL) {
+            red("Memory allocation failed while expanding label array!\n");
+            exit(EXIT_FAILURE);
         }
+    }
+    if (table->slots == NULL || (size_t)(table->count + 1) * 2 > table->slot_mask + 1) {
+        grow_label_slots(table);
+    }
 
-        // Extract the label (before the colon)
-        char* label_str = strtok(line, ":");
-
-        // Check for duplicate labels in the array
-        if (label_str != NULL) {
-            for (int i = 0; i < label_count; i++) {
-                if (strcmp(label_array[i].label_name, label_str) == 0) {
-                    printf("Line %zu: Label '%s' already exists at line %d.\n", file_line_num, label_str, label_array[i].file_line_num);
-                    error_code = 200;
-                    return;
-                }
-            }
+    label* new_label = &table->labels[table->count];
+    new_label->label_name = arena_strndup(table->names, label_name, length);
+    new_label->line_num = line_num;
+    new_label->file_line_num = label_file_line_num;
 
-            // Add the label to the dynamic label array
-            add_label(label_str, text_line_num);
+    table->slots[find_label_slot(table, label_name, length)] = table->count;
+    table->count++;
+}
 
-            // conditionally increment text_line_num, if line has an instruction
-            if (!is_just_label) {
-                text_line_num++;
-            }
+// Record the label at the start of `line`, the formatted text of a line in the .text section.
+// line_num is the instruction the label names. Returns false for a duplicate.
+_Bool define_label(label_table* table, const char* line, int line_num) {
+    size_t length = strcspn(line, ":");
 
-            file_line_num++;
-        }
+    // Check for duplicate labels
+    int existing = find_label(table, line, length);
+    if (existing != -1) {
+        printf("Line %zu: Label '%.*s' already exists at line %d.\n", file_line_num, (int)length, line, table->labels[existing].file_line_num);
+        error_code = 200;
+        return false;
     }
-    text_line_num = 1;
 
-    // After creating the label array, rewind to the .text section (stored as start_text_line)
-    fseek(file_pointer, 0, SEEK_SET);  // Rewind the file to the beginning
-    for (int i = 1; i < start_text_line; i++) {
-        fgets(line, sizeof(line), file_pointer);  // Move back to the line after .text
-    }
+    add_label(table, line, length, line_num, file_line_num);
+    return true;
+}
 
-    file_line_num = start_text_line;  // Restore the file line number
-    return;
+// The names belong to the table's arena and are not freed here
+void free_label_table(label_table* table) {
+    free(table->labels);
+    free(table->slots);
+    table->labels = NULL;
+    table->slots = NULL;
+    table->count = 0;
+    table->capacity = 0;
+    table->slot_mask = 0;
 }
 
-// Cleanup function to free memory after processing
+// label_array is the linked program's labels; the names are in the objects' arenas
 void free_label_array() {
-    for (int i = 0; i < label_count; i++) {
-        free(label_array[i].label_name);  // Free each label's name
-    }
-    free(label_array);  // Free the entire array
+    free(label_array);
     label_array = NULL;
     label_count = 0;
 }
@@ -469,11 +388,21 @@ char* get_error_string(int error_code) {
             return "\tImmediate value doesn't fit in 21 bits.\n";
         case 112:
             return "\tThe format for 'jalr' is jalr rd, rs, imm.\n";
+        case 113:
+            return "\t.globl needs at least one label name.\n";
+        case 114:
+            return "\t.align in .text can't align to more than 4 bytes.\n";
         case 200:
             return "\nMultiple labels with same name found.\n";
         // Mem related
         case 401:
             return "\nUnknown directive in input file\n";
+        case 402:
+            return "\nData values without a directive\n";
+        case 403:
+            return "\nInvalid operands for a data directive\n";
+        case 404:
+            return "\nFile of an .incbin directive not readable\n";
         default:
             break;
     }
@@ -481,27 +410,6 @@ char* get_error_string(int error_code) {
     return 0;
 }
 
-int get_label_line_num(char* label) {
-    if (label == NULL) {
-        printf("Error: Null label passed to get_label_line_num.\n");
-        return -1;
-    }
-
-    // Iterate through the dynamically allocated label array
-    for (int i = 0; i < label_count; i++) {
-        // Check if the label matches
-        if (strcmp(label, label_array[i].label_name) == 0) {
-            // Return the relative line number in the `.text` section
-            // Subtract the starting line number of the .text section
-            return label_array[i].line_num;
-        }
-    }
-
-    // If the label is not found, return -1
-    red("Error: Label '%s' not found in get_label_line_num.\n", label);
-    return -1;
-}
-
 void debug_enabled(const char* format, ...) {
     if (debug_flag && format != NULL) {
         va_list args;
@@ -609,84 +517,6 @@ void clear_screen() {
     fflush(stdout);           // Ensure the output is flushed immediately
 }
 
-unsigned int hash(uint64_t address) {
-    return address % MEMORY_TABLE_SIZE;
-}
-
-void write_memory_byte(uint32_t address, uint8_t value) {
-    unsigned int index = hash(address);  // Get the index using hash function
-    memory_node* current = memory_table[index];
-
-    // Traverse the chain at this index to find the memory address
-    while (current != NULL && current->address != address) {
-        current = current->next;
-    }
-
-    if (current != NULL) {
-        // Address found, update its value
-        current->value = value;
-        return;
-    }
-
-    // If address is not found, create a new node and add it to the chain
-    memory_node* new_node = (memory_node*)malloc(sizeof(memory_node));
-    if (new_node == NULL) {
-        printf("Error: Memory allocation failed!\n");
-        return;
-    }
-
-    new_node->address = address;
-    new_node->value = value;
-    new_node->next = memory_table[index];  // Insert at the head of the chain
-    memory_table[index] = new_node;        // Update the head of the chain
-}
-
-void write_memory_half(uint32_t address, uint16_t value) {
-    // Break down the halfword (16 bits) into two 8-bit parts (bytes)
-    uint8_t byte1 = value & 0xFF;         // Lower 8 bits
-    uint8_t byte2 = (value >> 8) & 0xFF;  // Upper 8 bits
-
-    // Write the two bytes to consecutive memory locations
-    write_memory_byte(address, byte1);
-    write_memory_byte(address + 1, byte2);
-}
-
-void write_memory_word(uint32_t address, uint32_t value) {
-    // Break down the word (32 bits) into four 8-bit parts (bytes)
-    uint8_t byte1 = value & 0xFF;          // Lowest 8 bits
-    uint8_t byte2 = (value >> 8) & 0xFF;   // Next 8 bits
-    uint8_t byte3 = (value >> 16) & 0xFF;  // Next 8 bits
-    uint8_t byte4 = (value >> 24) & 0xFF;  // Highest 8 bits
-
-    // Write the four bytes to consecutive memory locations
-    write_memory_byte(address, byte1);
-    write_memory_byte(address + 1, byte2);
-    write_memory_byte(address + 2, byte3);
-    write_memory_byte(address + 3, byte4);
-}
-
-void write_memory_dword(uint32_t address, uint64_t value) {
-    // Break down the double word (64 bits) into eight 8-bit parts (bytes)
-    uint8_t byte1 = value & 0xFF;          // Lowest 8 bits
-    uint8_t byte2 = (value >> 8) & 0xFF;   // Next 8 bits
-    uint8_t byte3 = (value >> 16) & 0xFF;  // Next 8 bits
-    uint8_t byte4 = (value >> 24) & 0xFF;  // Next 8 bits
-    uint8_t byte5 = (value >> 32) & 0xFF;  // Next 8 bits
-    uint8_t byte6 = (value >> 40) & 0xFF;  // Next 8 bits
-    uint8_t byte7 = (value >> 48) & 0xFF;  // Next 8 bits
-    uint8_t byte8 = (value >> 56) & 0xFF;  // Highest 8 bits
-
-    // Write the eight bytes to consecutive memory locations
-    write_memory_byte(address, byte1);
-    write_memory_byte(address + 1, byte2);
-    write_memory_byte(address + 2, byte3);
-    write_memory_byte(address + 3, byte4);
-    write_memory_byte(address + 4, byte5);
-    write_memory_byte(address + 5, byte6);
-    write_memory_byte(address + 6, byte7);
-    write_memory_byte(address + 7, byte8);
-}
-
 // Decode instruction type from 32 bit instruction word
 int decode_type(uint32_t instruction) {
     int opcode = instruction & 0b1111111;
@@ -728,76 +558,123 @@ int64_t sign_extend_12bit(uint32_t value) {
     return (int64_t)((int32_t)(value << 20) >> 20);
 }
 
+static size_t instructions_capacity = 0;
+static size_t source_mapping_size = 0;
+
 void free_instructions_array() {
-    for (size_t i = 1; i <= max_instructions; i++) {
-        free(instructions_array[i].instruction);
+    free(instructions_array);
+    instructions_array = NULL;
+    instructions_capacity = 0;
+    unmap_source_text();
+}
+
+// Read the input files into one private region, one after another, so every instruction text is
+// an offset into source_text. The region is the simulator's own: nothing loaded changes when a
+// file is edited or truncated afterwards. Files are formatted in place, and each starts on a page
+// of its own with at least one zero byte after its end, so they can be assembled on different
+// threads and the last line is terminated even without a newline. Returns `count` on success, or
+// the index of the file that couldn't be read.
+size_t map_source_files(char* const* file_names, size_t count, size_t* offsets, size_t* sizes) {
+    unmap_source_text();
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t mapping_size = 0;
+    int* fds = malloc(count * sizeof(int));
+    if (fds == NULL) {
+        red("Memory allocation failed while mapping source files!\n");
+        exit(EXIT_FAILURE);
     }
-}
 
-void push_to_stack(char* function_name, int line_num) {
-    stack_node* new = malloc(sizeof(stack_node));
-
-    new->function_name = malloc(sizeof(function_name));
-    strcpy(new->function_name, function_name);
-    new->line_num = line_num;
-    new->next = NULL;
+    size_t failed = count;
+    for (size_t i = 0; i < count; i++) {
+        fds[i] = open(file_names[i], O_RDONLY);
+        struct stat info;
+        if (fds[i] == -1 || fstat(fds[i], &info) == -1) {
+            failed = i;
+            break;
+        }
 
-    stack_node* current = main_node;
-    while (current->next != NULL) {
-        current = current->next;
+        offsets[i] = mapping_size;
+        sizes[i] = info.st_size;
+        mapping_size += (sizes[i] + 1 + page_size - 1) & ~(page_size - 1);
+        if (mapping_size > UINT32_MAX) {
+            failed = i;
+            break;
+        }
     }
 
-    current->next = new;
-}
-
-// can call pop even for main
-void pop_from_stack() {
-    stack_node* current = main_node;
-    stack_node* last_but_one = NULL;
-
-    if (current == NULL) {
-        return;
+    // zero pages for the whole range, each file read over the front of its part
+    char* base = MAP_FAILED;
+    if (failed == count) {
+        base = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    for (size_t i = 0; base != MAP_FAILED && i < count; i++) {
+        size_t done = 0;
+        while (done < sizes[i]) {
+            ssize_t got = read(fds[i], base + offsets[i] + done, sizes[i] - done);
+            if (got <= 0) {
+                break;
+            }
+            done += got;
+        }
+        // a file that shrank since fstat ends early, after its zero bytes
+        sizes[i] = done;
     }
 
-    if (main_node->next == NULL) {
-        free(main_node->function_name);
-        free(main_node);
-        main_node = NULL;
-        return;
+    size_t opened = failed < count ? failed + 1 : count;
+    for (size_t i = 0; i < opened; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
     }
+    free(fds);
 
-    while (current->next != NULL) {
-        last_but_one = current;
-        current = current->next;
+    if (failed < count || base == MAP_FAILED) {
+        return failed < count ? failed : 0;
     }
 
-    free(current->function_name);
-    free(current);
-    last_but_one->next = NULL;
+    source_text = base;
+    source_text_size = mapping_size;
+    source_mapping_size = mapping_size;
+    return count;
 }
 
-void free_stack() {
-    while (main_node != NULL) {
-        pop_from_stack();
-    }
+// Make an existing mapping, such as a program image, source_text. It is unmapped with it.
+void use_source_mapping(char* base, size_t size) {
+    unmap_source_text();
+    source_text = base;
+    source_text_size = size;
+    source_mapping_size = size;
 }
 
-stack_node* return_top_of_stack() {
-    stack_node* current = main_node;
-
-    if (current == NULL) {
-        return NULL;
+void unmap_source_text() {
+    if (source_text != NULL) {
+        munmap(source_text, source_mapping_size);
     }
+    source_text = NULL;
+    source_text_size = 0;
+    source_mapping_size = 0;
+}
 
-    while (current->next != NULL) {
-        current = current->next;
+// Record instruction max_instructions + 1, whose text starts at text_offset in source_text
+void add_instruction_line(size_t text_offset, int file_line_num) {
+    size_t instruction = max_instructions + 1;
+    if (instruction >= instructions_capacity) {
+        instructions_capacity = instructions_capacity ? instructions_capacity * 2 : 1024;
+        instructions_array = realloc(instructions_array, instructions_capacity * sizeof(instruction_line));
+        if (instructions_array == NULL) {
+            red("Memory allocation failed while expanding instructions array!\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    return current;
+    instructions_array[instruction].text_offset = text_offset;
+    instructions_array[instruction].file_line_num = file_line_num;
 }
 
-void clean_memory() {
-    for (int i = 0; i < MEMORY_TABLE_SIZE; i++) {
-        memory_table[i] = NULL;
-    }
+// Wall clock time in seconds, for throughput reports
+double host_seconds() {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec + now.tv_nsec / 1e9;
 }
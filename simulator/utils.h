@@ -3,6 +3,9 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "arena.h"
+#include "memory.h"
+
 #ifndef UTILS
 #define UTILS
 
@@ -13,23 +16,28 @@ void ignore_comments(char* str);
 void format_input(char*);
 void format_input_no_newline(char*);
 
+// Encoding details of one mnemonic, see find_mnemonic()
+typedef struct mnemonic_info {
+    const char* name;
+    char type;              // 'r', 'i', 's', 'b', 'u' or 'j'
+    uint32_t funct3;        // -1u where the format has none
+    uint32_t funct7;
+    _Bool is_load;
+} mnemonic_info;
+
+uint32_t hash_name(const char* name, size_t length, uint32_t seed);
+uint64_t hash_bytes(const void* bytes, size_t size);
+void build_lookup_tables();
+const mnemonic_info* find_mnemonic(const char* name, size_t length);
+uint32_t find_register(const char* name, size_t length);
+
 char identify_type(const char*);
-uint32_t parse_register(char*);
-uint32_t get_funct3(char, char*);
-uint32_t get_funct7(char, char*);
 
-_Bool check_has_label(char*);
-void create_label_array(FILE*);
-_Bool check_load_or_not(char* str);
+_Bool check_has_label(const char*);
+
 char* get_error_string(int error_code);
-int get_label_line_num(char*);
 void debug_enabled(const char* format, ...);
 
-unsigned int hash(uint64_t);
-void write_memory_byte(uint32_t address, uint8_t value);
-void write_memory_half(uint32_t address, uint16_t value);
-void write_memory_word(uint32_t address, uint32_t value);
-void write_memory_dword(uint32_t address, uint64_t value);
 
 #define R_INSTRUCTIONS_SIZE 10
 #define I_INSTRUCTIONS_SIZE 15
@@ -37,26 +45,25 @@ void write_memory_dword(uint32_t address, uint64_t value);
 #define B_INSTRUCTIONS_SIZE 6
 #define U_INSTRUCTIONS_SIZE 1
 #define J_INSTRUCTIONS_SIZE 1
-#define MEMORY_TABLE_SIZE 5000
 
-extern size_t file_line_num;
-extern int text_line_num;  // points to the current line in .text section being parsed. Ignores blank lines, and lines with just labels. Starts after .text, so .text is not counted. Special ability: can make you cry sometimes!
-extern int error_code;
+// Parse state of the file being assembled. Files are assembled on several threads at once, so
+// each thread has its own copy; the main thread's error_code is also the load's outcome.
+extern _Thread_local size_t file_line_num;
+extern _Thread_local int text_line_num;  // points to the current line in .text section being parsed. Ignores blank lines, and lines with just labels. Starts after .text, so .text is not counted. Special ability: can make you cry sometimes!
+extern _Thread_local int error_code;
 extern _Bool debug_flag;
 extern _Bool break_line_found;
-typedef struct memory_node {
-    uint64_t address;          // Memory address (key)
-    uint8_t value;             // Memory value (1 byte)
-    struct memory_node* next;  // Pointer to next node (for collision handling)
-} memory_node;
-
+extern _Bool jit_enabled;
+// Per-instruction metadata, indexed by instruction number (pc / 4 + 1). The printable text of
+// every instruction lives in source_text, the loaded copy of the input file, formatted in place over its line.
 typedef struct instruction_line {
-    char* instruction;
-    bool break_point;
+    uint32_t text_offset;   // into source_text, NUL terminated
     int file_line_num;
 } instruction_line;
 
-extern instruction_line instructions_array[1000];
+extern instruction_line* instructions_array;
+extern char* source_text;
+extern size_t source_text_size;
 
 extern size_t max_instructions;
 extern size_t current_instruction;
@@ -69,18 +76,24 @@ typedef struct {
     int file_line_num;
 } label;
 
-typedef struct stack_node {
-    char* function_name;
-    int line_num;
-    struct stack_node* next;
-} stack_node;
-
-extern stack_node* main_node;
-
-extern label* label_array;
+// Labels of one source file, indexed by name
+typedef struct label_table {
+    label* labels;
+    int count;
+    int capacity;
+    int* slots;
+    size_t slot_mask;
+    arena* names;           // label names are copied here
+} label_table;
+
+int find_label(const label_table* table, const char* name, size_t length);
+void add_label(label_table* table, const char* label_name, size_t length, int line_num, int label_file_line_num);
+_Bool define_label(label_table* table, const char* line, int line_num);
+void free_label_table(label_table* table);
+
+extern label* label_array;      // every label of the loaded program, line_num counting from its first instruction
 extern int label_count;
 void free_label_array();
-extern memory_node* memory_table[MEMORY_TABLE_SIZE];
 
 int decode_type(uint32_t instruction);
 int64_t sign_extend_12bit(uint32_t value);
@@ -106,13 +119,16 @@ void yellow(const char* format, ...);
 void clear_screen();
 
 void free_instructions_array();
+void add_instruction_line(size_t text_offset, int file_line_num);
+size_t map_source_files(char* const* file_names, size_t count, size_t* offsets, size_t* sizes);
+void use_source_mapping(char* base, size_t size);
+void unmap_source_text();
 
-void push_to_stack(char*, int);
-void pop_from_stack();
-stack_node* return_top_of_stack();
-void free_stack();
-void clean_memory();
+static inline const char* instruction_text(size_t instruction) {
+    return source_text + instructions_array[instruction].text_offset;
+}
 
 void display_help();
+double host_seconds();
 char* strdup(const char*);
 #endif
@@ -0,0 +1,7 @@
+.text
+lui x2, 0x10
+ld x3, 0(x2)
+ld x3, 16(x2)
+ld x3, 32(x2)
+ld x3, 16(x2)
+ld x3, 0(x2)
@@ -0,0 +1,27 @@
+.data
+.byte 1, 2, 3
+.align 3
+.dword 0x1122334455667788
+.space 5, 0xaa
+.zero 3
+.fill 2, 4, 0xdeadbeef
+.half 0x7fff
+.align 4
+.incbin "tests/directives.bin", 2, 8
+.word 0x12345678
+
+.text
+lui x2, 0x10
+lbu x3, 2(x2)
+lbu x4, 3(x2)
+ld x5, 8(x2)
+lbu x6, 20(x2)
+lbu x7, 21(x2)
+lw x8, 24(x2)
+lwu x9, 28(x2)
+lh x10, 32(x2)
+lh x11, 34(x2)
+ld x12, 48(x2)
+lw x13, 56(x2)
+sb x3, 49(x2)
+lbu x14, 49(x2)
@@ -0,0 +1,4 @@
+.text
+.globl square
+square:
+addi a0, a0, 1
@@ -0,0 +1,18 @@
+.data
+.dword 3
+.text
+.globl square, finish
+jal x0, finish
+square:
+add a1, a0, x0
+addi a2, x0, 0
+loop:
+bge x0, a1, done
+add a2, a2, a0
+addi a1, a1, -1
+jal x0, loop
+done:
+add a0, a2, x0
+jalr x0, 0(ra)
+finish:
+ld s2, 16(s0)
@@ -0,0 +1,14 @@
+.data
+.dword 7
+.text
+.globl main
+main:
+lui s0, 0x10
+ld a0, 0(s0)
+jal ra, square
+addi s1, a0, 0
+ld a0, 8(s0)
+jal ra, square
+add s1, s1, a0
+sd s1, 16(s0)
+jal x0, finish
@@ -0,0 +1,2 @@
+.text
+jal ra, cube